@@ -0,0 +1,182 @@
+#ifndef GAMEENGINE_COWARRAY_H
+#define GAMEENGINE_COWARRAY_H
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+/// CowArray is a copy-on-write array of plain-old-data elements, intended as the backing store for
+/// large GameStates.  The elements are split into fixed-size pages, and copying a CowArray only
+/// copies the page table and bumps a reference count on each page.  A page is only duplicated the
+/// first time it is written to through a copy that shares it.  This means that when the GameEngine
+/// copies the GameState from one timestep to the next, the new snapshot only stores the pages that
+/// were actually modified by the events and Think() for that timestep, and the cost of the copy
+/// scales with the amount of state that was mutated rather than the total size of the state.
+///
+/// T must be safe to copy with memcpy.  Reference counts are not atomic: all copies that share
+/// pages must be created, written to, and destroyed by one thread at a time.  Other threads may
+/// read from a CowArray as long as nothing is writing to that same copy.
+template <class T, int kElementsPerPage = 256>
+class CowArray {
+ public:
+  CowArray() : size_(0), pages_copied_(0) {}
+  explicit CowArray(int size) : size_(0), pages_copied_(0) {
+    Resize(size);
+  }
+  CowArray(const CowArray& rhs) : size_(rhs.size_), pages_(rhs.pages_), pages_copied_(0) {
+    for (int i = 0; i < pages_.size(); i++) {
+      pages_[i]->refs++;
+    }
+  }
+  CowArray& operator=(const CowArray& rhs) {
+    if (this == &rhs) {
+      return *this;
+    }
+    for (int i = 0; i < rhs.pages_.size(); i++) {
+      rhs.pages_[i]->refs++;
+    }
+    Release();
+    size_ = rhs.size_;
+    pages_ = rhs.pages_;
+    return *this;
+  }
+  ~CowArray() {
+    Release();
+  }
+
+  int size() const { return size_; }
+
+  /// Number of pages that have been duplicated because a shared page was written to.  This is
+  /// primarily here so that tests and profiling code can see how much copying actually happened.
+  int pages_copied() const { return pages_copied_; }
+
+  /// Returns the number of pages currently shared with at least one other CowArray.
+  int NumSharedPages() const {
+    int shared = 0;
+    for (int i = 0; i < pages_.size(); i++) {
+      if (pages_[i]->refs > 1) {
+        shared++;
+      }
+    }
+    return shared;
+  }
+  int NumPages() const { return pages_.size(); }
+
+  /// Grows or shrinks the array.  New elements are zero-filled.
+  void Resize(int size) {
+    assert(size >= 0);
+    int num_pages = (size + kElementsPerPage - 1) / kElementsPerPage;
+    while (pages_.size() > num_pages) {
+      Unref(pages_.back());
+      pages_.pop_back();
+    }
+    while (pages_.size() < num_pages) {
+      Page* page = new Page;
+      memset(page->data, 0, sizeof(page->data));
+      pages_.push_back(page);
+    }
+    // Zero out anything past the old size on its last page, since it might still hold data from
+    // before a shrink.
+    int old_size = size_;
+    size_ = size;
+    if (size > old_size && old_size % kElementsPerPage != 0) {
+      int page_end = (old_size / kElementsPerPage + 1) * kElementsPerPage;
+      for (int i = old_size; i < size && i < page_end; i++) {
+        memset(Mutable(i), 0, sizeof(T));
+      }
+    }
+  }
+
+  const T& operator[](int index) const {
+    assert(index >= 0 && index < size_);
+    return pages_[index / kElementsPerPage]->data[index % kElementsPerPage];
+  }
+
+  /// Returns a writable pointer to an element, duplicating its page first if it is shared.  The
+  /// pointer is only valid until the next call to a non-const method.
+  T* Mutable(int index) {
+    assert(index >= 0 && index < size_);
+    Page*& page = pages_[index / kElementsPerPage];
+    if (page->refs > 1) {
+      Page* copy = new Page;
+      memcpy(copy->data, page->data, sizeof(page->data));
+      page->refs--;
+      page = copy;
+      pages_copied_++;
+    }
+    return &page->data[index % kElementsPerPage];
+  }
+
+  void Set(int index, const T& value) {
+    *Mutable(index) = value;
+  }
+
+  /// Appends the raw contents of the array to data.
+  void AppendToString(string* data) const {
+    int size = size_;
+    data->append((const char*)&size, sizeof(size));
+    for (int i = 0; i < pages_.size(); i++) {
+      int count = size_ - i * kElementsPerPage;
+      if (count > kElementsPerPage) {
+        count = kElementsPerPage;
+      }
+      data->append((const char*)pages_[i]->data, count * sizeof(T));
+    }
+  }
+
+  /// Reads an array written by AppendToString starting at *pos, and advances *pos past it.
+  /// Returns false if data is too short.
+  bool ParseFromString(const string& data, int* pos) {
+    int size;
+    if (*pos + (int)sizeof(size) > data.size()) {
+      return false;
+    }
+    memcpy(&size, data.data() + *pos, sizeof(size));
+    if (size < 0 || *pos + sizeof(size) + size * sizeof(T) > data.size()) {
+      return false;
+    }
+    *pos += sizeof(size);
+    Release();
+    size_ = 0;
+    Resize(size);
+    for (int i = 0; i < pages_.size(); i++) {
+      int count = size_ - i * kElementsPerPage;
+      if (count > kElementsPerPage) {
+        count = kElementsPerPage;
+      }
+      memcpy(pages_[i]->data, data.data() + *pos, count * sizeof(T));
+      *pos += count * sizeof(T);
+    }
+    return true;
+  }
+
+ private:
+  struct Page {
+    Page() : refs(1) {}
+    int refs;
+    T data[kElementsPerPage];
+  };
+
+  static void Unref(Page* page) {
+    page->refs--;
+    if (page->refs == 0) {
+      delete page;
+    }
+  }
+
+  void Release() {
+    for (int i = 0; i < pages_.size(); i++) {
+      Unref(pages_[i]);
+    }
+    pages_.clear();
+  }
+
+  int size_;
+  vector<Page*> pages_;
+  int pages_copied_;
+};
+
+#endif // GAMEENGINE_COWARRAY_H
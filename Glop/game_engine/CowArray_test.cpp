@@ -0,0 +1,75 @@
+#include <gtest/gtest.h>
+#include "CowArray.h"
+
+struct TestEntity {
+  int x;
+  int y;
+};
+
+TEST(CowArrayTest, TestNewElementsAreZeroed) {
+  CowArray<TestEntity, 4> a(10);
+  ASSERT_EQ(10, a.size());
+  ASSERT_EQ(3, a.NumPages());
+  for (int i = 0; i < a.size(); i++) {
+    EXPECT_EQ(0, a[i].x);
+    EXPECT_EQ(0, a[i].y);
+  }
+  a.Mutable(9)->x = 5;
+  a.Resize(9);
+  a.Resize(10);
+  EXPECT_EQ(0, a[9].x);
+}
+
+TEST(CowArrayTest, TestCopiesSharePagesUntilWritten) {
+  CowArray<TestEntity, 4> a(16);
+  for (int i = 0; i < a.size(); i++) {
+    a.Mutable(i)->x = i;
+  }
+  CowArray<TestEntity, 4> b(a);
+  EXPECT_EQ(4, a.NumSharedPages());
+  EXPECT_EQ(4, b.NumSharedPages());
+
+  b.Mutable(5)->x = 100;
+  EXPECT_EQ(1, b.pages_copied());
+  EXPECT_EQ(3, b.NumSharedPages());
+  EXPECT_EQ(5, a[5].x);
+  EXPECT_EQ(100, b[5].x);
+
+  // Writing to the same page again should not copy it again.
+  b.Mutable(6)->x = 101;
+  EXPECT_EQ(1, b.pages_copied());
+  EXPECT_EQ(6, a[6].x);
+
+  // Once b is gone, a should own all of its pages outright.
+  {
+    CowArray<TestEntity, 4> c;
+    c = b;
+  }
+  b = CowArray<TestEntity, 4>();
+  EXPECT_EQ(0, a.NumSharedPages());
+  a.Mutable(0)->x = 7;
+  EXPECT_EQ(0, a.pages_copied());
+}
+
+TEST(CowArrayTest, TestSerialization) {
+  CowArray<TestEntity, 4> a(11);
+  for (int i = 0; i < a.size(); i++) {
+    a.Mutable(i)->x = i;
+    a.Mutable(i)->y = -i;
+  }
+  string data = "xx";
+  a.AppendToString(&data);
+
+  CowArray<TestEntity, 4> b;
+  int pos = 2;
+  ASSERT_TRUE(b.ParseFromString(data, &pos));
+  EXPECT_EQ(data.size(), pos);
+  ASSERT_EQ(11, b.size());
+  for (int i = 0; i < b.size(); i++) {
+    EXPECT_EQ(i, b[i].x);
+    EXPECT_EQ(-i, b[i].y);
+  }
+
+  pos = 2;
+  EXPECT_FALSE(b.ParseFromString(data.substr(0, data.size() - 1), &pos));
+}
@@ -0,0 +1,134 @@
+#ifndef GAMEENGINE_ENGINESET_H
+#define GAMEENGINE_ENGINESET_H
+
+#include "P2PNG.h"
+#include "../Base.h"
+
+/// Every engine in a game holds one EngineID, and one that is joining holds a temporary one as well
+/// until a little after it has joined, when the id is handed out again.  This limits how many
+/// engines can be in a game at once, not how many can join over its lifetime.
+const int kMaxEngineIDs = 256;
+
+/// A set of EngineIDs, stored as a fixed-width bitmask.  The GameEngine keeps one of these per
+/// timestep for the engines in the game and another for the engines whose events have arrived, so
+/// it has to be cheap to copy, and checking whether a timestep is complete is a handful of word
+/// operations rather than a walk over a tree.  It is trivially copyable, and has the parts of the
+/// set<EngineID> interface that the engine needs, so that it can be used in the same way.
+class EngineSet {
+ public:
+  EngineSet() {
+    clear();
+  }
+
+  /// Ids outside [0, kMaxEngineIDs) can't be stored, so they are ignored, as they are by erase.
+  void insert(EngineID engine_id) {
+    if (engine_id >= 0 && engine_id < kMaxEngineIDs) {
+      words_[engine_id / 64] |= uint64(1) << (engine_id % 64);
+    }
+  }
+  void erase(EngineID engine_id) {
+    if (engine_id >= 0 && engine_id < kMaxEngineIDs) {
+      words_[engine_id / 64] &= ~(uint64(1) << (engine_id % 64));
+    }
+  }
+  int count(EngineID engine_id) const {
+    if (engine_id < 0 || engine_id >= kMaxEngineIDs) {
+      return 0;
+    }
+    return (words_[engine_id / 64] >> (engine_id % 64)) & 1;
+  }
+  void clear() {
+    for (int i = 0; i < kWords; i++) {
+      words_[i] = 0;
+    }
+  }
+  bool empty() const {
+    for (int i = 0; i < kWords; i++) {
+      if (words_[i] != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+  int size() const {
+    int ret = 0;
+    for (int i = 0; i < kWords; i++) {
+      for (uint64 word = words_[i]; word != 0; word &= word - 1) {
+        ret++;
+      }
+    }
+    return ret;
+  }
+
+  /// Whether every engine in other is also in this set.
+  bool Contains(const EngineSet& other) const {
+    for (int i = 0; i < kWords; i++) {
+      if ((other.words_[i] & ~words_[i]) != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+  bool operator==(const EngineSet& other) const {
+    for (int i = 0; i < kWords; i++) {
+      if (words_[i] != other.words_[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+  bool operator!=(const EngineSet& other) const {
+    return !(*this == other);
+  }
+
+  /// Visits the engines in increasing order.
+  class const_iterator {
+   public:
+    const_iterator() : set_(NULL), engine_id_(kMaxEngineIDs) {}
+    EngineID operator*() const { return engine_id_; }
+    const_iterator& operator++() {
+      engine_id_ = set_->Next(engine_id_ + 1);
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator ret = *this;
+      ++*this;
+      return ret;
+    }
+    bool operator==(const const_iterator& other) const { return engine_id_ == other.engine_id_; }
+    bool operator!=(const const_iterator& other) const { return engine_id_ != other.engine_id_; }
+
+   private:
+    friend class EngineSet;
+    const_iterator(const EngineSet* set, EngineID engine_id) : set_(set), engine_id_(engine_id) {}
+    const EngineSet* set_;
+    EngineID engine_id_;
+  };
+  typedef const_iterator iterator;
+  const_iterator begin() const { return const_iterator(this, Next(0)); }
+  const_iterator end() const { return const_iterator(this, kMaxEngineIDs); }
+
+ private:
+  static const int kWords = kMaxEngineIDs / 64;
+
+  // The first engine at or after engine_id, or kMaxEngineIDs if there are none.
+  EngineID Next(EngineID engine_id) const {
+    while (engine_id < kMaxEngineIDs) {
+      uint64 word = words_[engine_id / 64] >> (engine_id % 64);
+      if (word == 0) {
+        engine_id = (engine_id / 64 + 1) * 64;
+        continue;
+      }
+      while (!(word & 1)) {
+        word >>= 1;
+        engine_id++;
+      }
+      return engine_id;
+    }
+    return kMaxEngineIDs;
+  }
+
+  uint64 words_[kWords];
+};
+
+#endif // GAMEENGINE_ENGINESET_H
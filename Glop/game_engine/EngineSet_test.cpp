@@ -0,0 +1,62 @@
+#include <gtest/gtest.h>
+#include "EngineSet.h"
+
+TEST(EngineSetTest, TestInsertEraseAndCount) {
+  EngineSet engines;
+  EXPECT_TRUE(engines.empty());
+  engines.insert(0);
+  engines.insert(63);
+  engines.insert(64);
+  engines.insert(kMaxEngineIDs - 1);
+  engines.insert(64);
+  engines.insert(-1);
+  engines.insert(kMaxEngineIDs);
+  EXPECT_EQ(4, engines.size());
+  EXPECT_EQ(1, engines.count(63));
+  EXPECT_EQ(1, engines.count(64));
+  EXPECT_EQ(0, engines.count(65));
+  EXPECT_EQ(0, engines.count(-1));
+  EXPECT_EQ(0, engines.count(kMaxEngineIDs));
+  engines.erase(63);
+  EXPECT_EQ(0, engines.count(63));
+  EXPECT_EQ(3, engines.size());
+  engines.clear();
+  EXPECT_TRUE(engines.empty());
+}
+
+TEST(EngineSetTest, TestIterationIsInOrder) {
+  EngineSet engines;
+  EXPECT_TRUE(engines.begin() == engines.end());
+  int ids[] = {1, 5, 64, 127, 128, 200};
+  for (int i = 5; i >= 0; i--) {
+    engines.insert(ids[i]);
+  }
+  int i = 0;
+  for (EngineSet::const_iterator it = engines.begin(); it != engines.end(); it++) {
+    ASSERT_GT(6, i);
+    EXPECT_EQ(ids[i++], *it);
+  }
+  EXPECT_EQ(6, i);
+}
+
+TEST(EngineSetTest, TestContainsAndCompare) {
+  EngineSet in_game, received;
+  in_game.insert(0);
+  in_game.insert(3);
+  in_game.insert(130);
+  received.insert(0);
+  received.insert(130);
+  EXPECT_FALSE(received.Contains(in_game));
+  received.insert(3);
+  received.insert(7);
+  EXPECT_TRUE(received.Contains(in_game));
+  EXPECT_FALSE(in_game.Contains(received));
+  EXPECT_TRUE(received != in_game);
+
+  // Copies are plain copies.
+  EngineSet copy = in_game;
+  EXPECT_TRUE(copy == in_game);
+  copy.insert(7);
+  EXPECT_FALSE(copy == in_game);
+  EXPECT_EQ(3, in_game.size());
+}
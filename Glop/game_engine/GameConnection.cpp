@@ -1,6 +1,10 @@
 #include "GameConnection.h"
+#include "EngineSet.h"
 #include "GameEvent.h"
+#include "GameEventArena.h"
+#include "Varint.h"
 
+#include "../Base.h"
 #include "../net/NetworkManagerInterface.h"
 
 bool operator < (const EventPackageID& a, const EventPackageID& b) {
@@ -10,99 +14,127 @@ bool operator < (const EventPackageID& a, const EventPackageID& b) {
   return a.engine_id < b.engine_id;
 }
 
+// Appends the part of a package that doesn't depend on the rest of the message.
+static void AppendEvents(const vector<GameEvent*>& events, string* data) {
+  AppendVarint(events.size(), data);
+  for (int i = 0; i < events.size(); i++) {
+    ASSERT(events[i]->type() != 0);
+    const google::protobuf::Message& message = events[i]->GetData();
+    AppendVarint(ZigZag(events[i]->type()), data);
+    AppendVarint(message.ByteSize(), data);
+    message.AppendToString(data);
+  }
+}
+
+void EncodedEvents::Encode(const vector<GameEvent*>& events) {
+  num_events_ = events.size();
+  data_.clear();
+  AppendEvents(events, &data_);
+}
+
 void GameConnection::QueueEvents(int channel, EventPackageID id, const vector<GameEvent*>& events) {
-  string data;
-  SerializeEvents(id, events, &data);
-  string size(sizeof(int), 0);
-  ((int*)size.data())[0] = data.size();
-  buffers_[channel] += size + data;
+  AppendEvents(events, QueuePackageHeader(channel, id));
+}
+
+void GameConnection::QueueEvents(int channel, EventPackageID id, const EncodedEvents& events) {
+  *QueuePackageHeader(channel, id) += events.data_;
+}
+
+string* GameConnection::QueuePackageHeader(int channel, EventPackageID id) {
+  ChannelBuffer& buffer = buffers_[channel];
+  if (buffer.data.empty()) {
+    buffer.data.push_back(kWireFormatVersion);
+    buffer.last_timestep = 0;
+  }
+  AppendVarint(ZigZag(int64(id.state_timestep) - buffer.last_timestep), &buffer.data);
+  AppendVarint(ZigZag(id.engine_id), &buffer.data);
+  buffer.last_timestep = id.state_timestep;
+  stats_.packages_sent++;
+  return &buffer.data;
 }
 
 void GameConnection::SendEvents(int channel) {
-  SendData(buffers_[channel]);
-  buffers_[channel].clear();
+  ChannelBuffer& buffer = buffers_[channel];
+  if (buffer.data.empty()) {
+    return;
+  }
+  SendData(buffer.data);
+  stats_.messages_sent++;
+  stats_.bytes_sent += buffer.data.size();
+  buffer.data.clear();
 }
 
 void GameConnection::SendAllEvents() {
-  map<int,string>::iterator it;
+  map<int, ChannelBuffer>::iterator it;
   for (it = buffers_.begin(); it != buffers_.end(); it++) {
     SendEvents(it->first);
   }
 }
 
-// TODO: Need to be sure this method is resiliant to corrupt data
-void GameConnection::ReceiveEvents(vector<pair<EventPackageID, vector<GameEvent*> > >* events) {
+void GameConnection::ReceiveEvents(
+    vector<pair<EventPackageID, vector<GameEvent*> > >* events,
+    GameEventArenaSource* arenas) {
   vector<string> data;
   ReceiveData(&data);
+  int num_packages = events->size();
   for (int i = 0; i < data.size(); i++) {
-    for (int pos = 0; pos < data[i].size(); ) {
-      // TODO: This does unaligned memory access, is that bad?
-      int len = *((int*)(&data[i].data()[pos]));
-      pos += sizeof(int);
-      EventPackageID id;
-      vector<GameEvent*> batch;
-      DeserializeEvents(data[i].substr(pos, len), &id, &batch);
-      pos += len;
-      events->push_back(pair<EventPackageID, vector<GameEvent*> >(id, batch));
+    stats_.messages_received++;
+    stats_.bytes_received += data[i].size();
+    if (!DeserializeMessage(data[i], events, arenas)) {
+      printf("Dropped the rest of a corrupt message of length %d\n", (int)data[i].size());
     }
   }
+  stats_.packages_received += events->size() - num_packages;
 }
 
-/// \todo jwills - This serialization is incredibly inefficient.  Replace it with something that
-/// doesn't send 4 bytes for ints that can EASILY be compressed.
-void GameConnection::SerializeEvents(
-    EventPackageID id,
-    const vector<GameEvent*>& events,
-    string* data) {
-  ASSERT(data->size() == 0);
-  data->resize(8);
-  (*data)[0] = (id.state_timestep  >>  0) & 0xff;
-  (*data)[1] = (id.state_timestep  >>  8) & 0xff;
-  (*data)[2] = (id.state_timestep  >> 16) & 0xff;
-  (*data)[3] = (id.state_timestep  >> 24) & 0xff;
-  (*data)[4] = (id.engine_id >>  0) & 0xff;
-  (*data)[5] = (id.engine_id >>  8) & 0xff;
-  (*data)[6] = (id.engine_id >> 16) & 0xff;
-  (*data)[7] = (id.engine_id >> 24) & 0xff;
-  for (int i = 0; i < events.size(); i++) {
-    string event_data;
-    GameEventFactory::Serialize(events[i], &event_data);
-    string size;
-    size.resize(4);
-    size[0] = (event_data.size() >>  0) & 0xff;
-    size[1] = (event_data.size() >>  8) & 0xff;
-    size[2] = (event_data.size() >> 16) & 0xff;
-    size[3] = (event_data.size() >> 24) & 0xff;
-    (*data) += size + event_data;
-  }
-}
-
-void GameConnection::DeserializeEvents(
+bool GameConnection::DeserializeMessage(
     const string& data,
-    EventPackageID* id,
-    vector<GameEvent*>* events) {
-  assert(data.size() >= 8);
-  id->state_timestep = 0;
-  id->state_timestep  |= ((unsigned char)data[0]) <<  0;
-  id->state_timestep  |= ((unsigned char)data[1]) <<  8;
-  id->state_timestep  |= ((unsigned char)data[2]) << 16;
-  id->state_timestep  |= ((unsigned char)data[3]) << 24;
-  id->engine_id = 0;
-  id->engine_id |= ((unsigned char)data[4]) <<  0;
-  id->engine_id |= ((unsigned char)data[5]) <<  8;
-  id->engine_id |= ((unsigned char)data[6]) << 16;
-  id->engine_id |= ((unsigned char)data[7]) << 24;
-  int index = 8;
-  while (index < data.size()) {
-    int size = 0;
-    size |= data[index + 0] <<  0;
-    size |= data[index + 1] <<  8;
-    size |= data[index + 2] << 16;
-    size |= data[index + 3] << 24;
-    index += 4;
-    events->push_back(GameEventFactory::Deserialize(data.substr(index, size)));
-    index += size;
+    vector<pair<EventPackageID, vector<GameEvent*> > >* events,
+    GameEventArenaSource* arenas) {
+  if (data.empty() || (unsigned char)data[0] != kWireFormatVersion) {
+    return false;
+  }
+  int pos = 1;
+  int64 last_timestep = 0;
+  while (pos < data.size()) {
+    uint64 timestep_delta, engine_id, num_events;
+    if (!ReadVarint(data, &pos, &timestep_delta) ||
+        !ReadVarint(data, &pos, &engine_id) ||
+        !ReadVarint(data, &pos, &num_events)) {
+      return false;
+    }
+    last_timestep += UnZigZag(timestep_delta);
+    // Every EngineSet that this package's sender ends up in only has room for kMaxEngineIDs ids.
+    if (UnZigZag(engine_id) < 0 || UnZigZag(engine_id) >= kMaxEngineIDs) {
+      return false;
+    }
+    EventPackageID id(last_timestep, UnZigZag(engine_id));
+    GameEventArena* arena = arenas == NULL ? NULL : arenas->GetEventArena(id.state_timestep);
+    vector<GameEvent*> batch;
+    for (uint64 i = 0; i < num_events; i++) {
+      uint64 type, size;
+      GameEvent* event = NULL;
+      if (ReadVarint(data, &pos, &type) &&
+          ReadVarint(data, &pos, &size) &&
+          size <= data.size() - pos) {
+        // Parse straight out of the message; the only work per event is the parse itself.
+        event = GameEventFactory::Deserialize(UnZigZag(type), data.data() + pos, size, arena);
+      }
+      if (event == NULL) {
+        // Events that came from an arena belong to it, but the rest are ours to clean up.
+        if (arena == NULL) {
+          for (int j = 0; j < batch.size(); j++) {
+            delete batch[j];
+          }
+        }
+        return false;
+      }
+      batch.push_back(event);
+      pos += size;
+    }
+    events->push_back(make_pair(id, batch));
   }
+  return true;
 }
 
 void PeerConnection::SendData(const string& data) {
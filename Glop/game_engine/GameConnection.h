@@ -9,8 +9,11 @@
 using namespace std;
 
 #include "P2PNG.h"
+#include "../Base.h"
 
 class GameEvent;
+class GameEventArena;
+class GameEventArenaSource;
 class GamePlayer;
 
 struct EventPackageID {
@@ -20,7 +23,54 @@ struct EventPackageID {
   EngineID engine_id;
 };
 
-/// This class handles the communication between GameEngines.  This class should be subclassed for
+/// Traffic totals for one GameConnection.  A message is one call to SendData, and holds any number
+/// of event packages.
+struct GameConnectionStats {
+  GameConnectionStats()
+    : address(0, 0),
+      messages_sent(0),
+      bytes_sent(0),
+      packages_sent(0),
+      messages_received(0),
+      bytes_received(0),
+      packages_received(0) {}
+  GlopNetworkAddress address;  // Who is on the other end, or (0, 0) if it isn't a network peer.
+  int64 messages_sent;
+  int64 bytes_sent;
+  int64 packages_sent;
+  int64 messages_received;
+  int64 bytes_received;
+  int64 packages_received;
+};
+
+/// The events of one package, encoded once so that the same package can be queued on any number of
+/// connections without encoding its events again for each of them.  Only the package header, which
+/// depends on what else is in each connection's message, is written per connection.  Encode() can
+/// be called again to reuse the same buffer for another package.
+class EncodedEvents {
+ public:
+  EncodedEvents() : num_events_(0) {}
+  explicit EncodedEvents(const vector<GameEvent*>& events) {
+    Encode(events);
+  }
+
+  void Encode(const vector<GameEvent*>& events);
+
+  int num_events() const { return num_events_; }
+
+ private:
+  friend class GameConnection;
+  int num_events_;
+  string data_;  // The event count and every event, exactly as they go on the wire.
+};
+
+/// This class handles the communication between GameEngines.  Every message sent over a connection
+/// starts with kWireFormatVersion, followed by any number of event packages.  Each package is a
+/// varint-encoded header of the zigzagged difference between its StateTimestep and the previous
+/// package's in the same message, the zigzagged EngineID, and the number of events.  Each event is
+/// then its zigzagged type, the length of its protocol buffer, and the protocol buffer itself.
+/// Since event types are small and packages in a message usually have nearby timesteps, a package
+/// with one small input event is usually under a dozen bytes.  This class should be subclassed for
 /// connections like NetworkConnection for connections over the internet, and ApplicationConnection
 /// for connections to GameEngines on the same machine (useful for testing).  Each connection is
 /// connected to exactly one other connection, to/from which data is sent.  Subclasses on this will
@@ -28,21 +78,33 @@ struct EventPackageID {
 /// connection.
 class GameConnection {
  public:
+  /// Bump this whenever the wire format changes.  Messages with any other version are dropped.
+  static const unsigned char kWireFormatVersion = 1;
+
   GameConnection() {};
   virtual ~GameConnection() {};
 
   /// Queues up all events for one NetTimestep/EngineID pair.  These events will get sent the next
   /// time that SendEvents() is called on this channel.
   void QueueEvents(int channel, EventPackageID id, const vector<GameEvent*>& events);
+  /// The same, for events that have already been encoded.  This is what to use when the same
+  /// package goes out over several connections.
+  void QueueEvents(int channel, EventPackageID id, const EncodedEvents& events);
 
-  /// Sends all events that have been queued up by QueueEvents() on this channel.
+  /// Sends all events that have been queued up by QueueEvents() on this channel.  Nothing is sent
+  /// if nothing has been queued.
   void SendEvents(int channel);
 
   /// Sends all events that have been queued up by QueueEvents() on all channels.
   void SendAllEvents();
 
-  /// Receive all available events on this connection.
-  void ReceiveEvents(vector<pair<EventPackageID, vector<GameEvent*> > >* events);
+  /// Receive all available events on this connection.  If arenas is not NULL each event is
+  /// allocated from the arena it gives for the event's timestep, otherwise the caller owns them.
+  void ReceiveEvents(
+      vector<pair<EventPackageID, vector<GameEvent*> > >* events,
+      GameEventArenaSource* arenas = NULL);
+
+  const GameConnectionStats& GetStats() const { return stats_; }
 
  protected:
   /// Subclasses implement this function to send data to whoever is on the other end of the
@@ -53,20 +115,38 @@ class GameConnection {
   /// once.
   virtual void ReceiveData(vector<string>* data) = 0; 
 
+  GameConnectionStats stats_;
+
  private:
-  void SerializeEvents(EventPackageID id, const vector<GameEvent*>& events, string* data);
-  void DeserializeEvents(const string& data, EventPackageID* id, vector<GameEvent*>* events);
+  // Decodes one message, appending every package in it to events.  Returns false if the message is
+  // corrupt, in which case the packages before the corruption are still appended.
+  bool DeserializeMessage(
+      const string& data,
+      vector<pair<EventPackageID, vector<GameEvent*> > >* events,
+      GameEventArenaSource* arenas);
+
+  // Starts a package on channel, up to but not including its events, and returns the buffer they
+  // should be appended to.
+  string* QueuePackageHeader(int channel, EventPackageID id);
+
+  struct ChannelBuffer {
+    ChannelBuffer() : last_timestep(0) {}
+    string data;                  // Kept around between sends so its memory is reused.
+    StateTimestep last_timestep;  // Timestep of the last package in data, for delta coding.
+  };
 
   // map of channel to buffer.  The buffers will be sent over the connection when the appropriate
   // send method is called.
-  map<int, string>  buffers_;
+  map<int, ChannelBuffer> buffers_;
 };
 
 class PeerConnection : public GameConnection {
  public:
   PeerConnection(NetworkManagerInterface* network_manager, GlopNetworkAddress gna)
       : network_manager_(network_manager),
-        gna_(gna) {}
+        gna_(gna) {
+    stats_.address = gna;
+  }
   virtual ~PeerConnection() {}
 
  protected:
@@ -1,4 +1,5 @@
 #include <gtest/gtest.h>
+#include "EngineSet.h"
 #include "GameConnection.h"
 #include "GameEvent.h"
 #include "TestProtos.pb.h"
@@ -212,10 +213,12 @@ TEST(GameConnectionTest, TestSendingAndReceivingVariousEngineIDsAndStateTimestep
 
   int v[] = {0, 1, 2, 3, 254, 255, 256, 511, 512, 513, 65535, 65536, 65537, 2147483647};
   vector<int> values(v, v + 14);
+  // Engine ids only go up to kMaxEngineIDs - 1 = 255.
+  vector<int> engine_ids(v, v + 6);
   for (int i = 0; i < values.size(); i++) {
-    for (int j = 0; j < values.size(); j++) {
+    for (int j = 0; j < engine_ids.size(); j++) {
       StateTimestep state_timestep = values[i];
-      EngineID engine_id = values[j];
+      EngineID engine_id = engine_ids[j];
       vector<GameEvent*> v;
       in->QueueEvents(0, EventPackageID(state_timestep, engine_id), v);
       in->SendEvents(0);
@@ -231,6 +234,213 @@ TEST(GameConnectionTest, TestSendingAndReceivingVariousEngineIDsAndStateTimestep
   delete out;
 }
 
+// A TestConnection that keeps track of what it has sent, and can send arbitrary data.
+class CountingConnection : public TestConnection {
+ public:
+  CountingConnection() : bytes_sent(0), messages_sent(0) {}
+  void SendRawData(const string& data) {
+    TestConnection::SendData(data);
+  }
+  int bytes_sent;
+  int messages_sent;
+  string last_data;
+ protected:
+  virtual void SendData(const string& data) {
+    bytes_sent += data.size();
+    messages_sent++;
+    last_data = data;
+    TestConnection::SendData(data);
+  }
+};
+
+TEST(GameConnectionTest, TestInputPackagesAreCompact) {
+  CountingConnection* in = new CountingConnection();
+  TestConnection* out = new TestConnection();
+  in->SetOutput(out);
+  out->SetOutput(in);
+
+  // This is what a typical net frame looks like: a few timesteps' worth of small input events from
+  // a couple of engines, on a game that has been running for a while.
+  FooEvent* input = NewFooEvent();
+  input->GetData()->set_foo(3);
+  input->GetData()->set_bar(2);
+  string serialized_input;
+  input->GetData()->SerializeToString(&serialized_input);
+  int legacy_bytes = 0;
+  for (int t = 100000; t < 100003; t++) {
+    for (EngineID e = 0; e < 2; e++) {
+      in->QueueEvents(0, EventPackageID(t, e), vector<GameEvent*>(1, input));
+      // The old format spent 4 bytes on each of the package length, timestep, engine, event length
+      // and event type.
+      legacy_bytes += 4 * 5 + serialized_input.size();
+    }
+  }
+  in->SendEvents(0);
+  delete input;
+  EXPECT_EQ(1, in->messages_sent);
+  EXPECT_GT(legacy_bytes / 2, in->bytes_sent);
+
+  vector<pair<EventPackageID, vector<GameEvent*> > > output_events;
+  out->ReceiveEvents(&output_events);
+  ASSERT_EQ(6, output_events.size());
+  for (int i = 0; i < output_events.size(); i++) {
+    EXPECT_EQ(100000 + i / 2, output_events[i].first.state_timestep);
+    EXPECT_EQ(i % 2, output_events[i].first.engine_id);
+    ASSERT_EQ(1, output_events[i].second.size());
+    FooEvent* foo = (FooEvent*)output_events[i].second[0];
+    EXPECT_EQ(1, GameEventFactory::GetGameEventType(foo));
+    EXPECT_EQ(3, foo->GetData()->foo());
+    EXPECT_EQ(2, foo->GetData()->bar());
+  }
+
+  // Nothing should go out when nothing has been queued.
+  in->SendEvents(0);
+  in->SendAllEvents();
+  EXPECT_EQ(1, in->messages_sent);
+
+  delete in;
+  delete out;
+}
+
+TEST(GameConnectionTest, TestEncodedEventsMatchTheUsualEncoding) {
+  CountingConnection* plain = new CountingConnection();
+  CountingConnection* encoded = new CountingConnection();
+  TestConnection* out = new TestConnection();
+  plain->SetOutput(out);
+  encoded->SetOutput(out);
+
+  FooEvent* foo = NewFooEvent();
+  foo->GetData()->set_foo(17);
+  foo->GetData()->set_bar(4);
+  BarEvent* bar = NewBarEvent();
+  bar->GetData()->set_wingding(9);
+  bar->GetData()->set_barbaz(300);
+  vector<GameEvent*> events;
+  events.push_back(foo);
+  events.push_back(bar);
+
+  // The same EncodedEvents can go into any number of packages, on any channel.
+  EncodedEvents encoded_events(events);
+  EXPECT_EQ(2, encoded_events.num_events());
+  for (int t = 50; t < 53; t++) {
+    plain->QueueEvents(0, EventPackageID(t, 3), events);
+    encoded->QueueEvents(0, EventPackageID(t, 3), encoded_events);
+  }
+  encoded_events.Encode(vector<GameEvent*>());
+  plain->QueueEvents(0, EventPackageID(53, 4), vector<GameEvent*>());
+  encoded->QueueEvents(0, EventPackageID(53, 4), encoded_events);
+  plain->SendEvents(0);
+  encoded->SendEvents(0);
+  delete foo;
+  delete bar;
+  EXPECT_EQ(plain->last_data, encoded->last_data);
+  EXPECT_EQ(4, encoded->GetStats().packages_sent);
+
+  vector<pair<EventPackageID, vector<GameEvent*> > > output_events;
+  out->ReceiveEvents(&output_events);
+  ASSERT_EQ(8, output_events.size());
+  EXPECT_EQ(52, output_events[6].first.state_timestep);
+  ASSERT_EQ(2, output_events[6].second.size());
+  EXPECT_EQ(17, ((FooEvent*)output_events[6].second[0])->GetData()->foo());
+  EXPECT_EQ(300, ((BarEvent*)output_events[6].second[1])->GetData()->barbaz());
+  EXPECT_EQ(0, output_events[7].second.size());
+  for (int i = 0; i < output_events.size(); i++) {
+    for (int j = 0; j < output_events[i].second.size(); j++) {
+      delete output_events[i].second[j];
+    }
+  }
+
+  delete plain;
+  delete encoded;
+  delete out;
+}
+
+TEST(GameConnectionTest, TestCorruptMessagesAreDropped) {
+  CountingConnection* in = new CountingConnection();
+  TestConnection* out = new TestConnection();
+  in->SetOutput(out);
+  out->SetOutput(in);
+
+  FooEvent* e = NewFooEvent();
+  e->GetData()->set_foo(1);
+  in->QueueEvents(0, EventPackageID(5, 1), vector<GameEvent*>(1, e));
+  in->QueueEvents(0, EventPackageID(6, 1), vector<GameEvent*>(1, e));
+  delete e;
+  in->SendEvents(0);
+  string message = in->last_data;
+
+  // The same message chopped off in the middle of the second package.
+  in->SendRawData(message.substr(0, message.size() - 2));
+  // And the same message from some other version of the wire format.
+  string other_version = message;
+  other_version[0]++;
+  in->SendRawData(other_version);
+
+  vector<pair<EventPackageID, vector<GameEvent*> > > output_events;
+  out->ReceiveEvents(&output_events);
+  ASSERT_EQ(3, output_events.size());
+  EXPECT_EQ(5, output_events[0].first.state_timestep);
+  EXPECT_EQ(6, output_events[1].first.state_timestep);
+  EXPECT_EQ(5, output_events[2].first.state_timestep);
+  for (int i = 0; i < output_events.size(); i++) {
+    EXPECT_EQ(1, output_events[i].second.size());
+    EXPECT_EQ(1, output_events[i].first.engine_id);
+  }
+
+  delete in;
+  delete out;
+}
+
+TEST(GameConnectionTest, TestUnknownEventTypesAreDropped) {
+  CountingConnection* in = new CountingConnection();
+  TestConnection* out = new TestConnection();
+  in->SetOutput(out);
+  out->SetOutput(in);
+
+  // Version 1, timestep 5, engine 1, one event of type 1000 with an empty payload.
+  string message;
+  message += (char)GameConnection::kWireFormatVersion;
+  message += (char)10;
+  message += (char)2;
+  message += (char)1;
+  message += (char)0xd0;
+  message += (char)0x0f;
+  message += (char)0;
+  ASSERT_FALSE(GameEventFactory::IsRegisteredEventType(1000));
+  in->SendRawData(message);
+
+  vector<pair<EventPackageID, vector<GameEvent*> > > output_events;
+  out->ReceiveEvents(&output_events);
+  EXPECT_EQ(0, output_events.size());
+
+  delete in;
+  delete out;
+}
+
+TEST(GameConnectionTest, TestOutOfRangeEngineIDsAreDropped) {
+  CountingConnection* in = new CountingConnection();
+  TestConnection* out = new TestConnection();
+  in->SetOutput(out);
+  out->SetOutput(in);
+
+  FooEvent* e = NewFooEvent();
+  e->GetData()->set_foo(1);
+  EngineID engine_ids[] = {kMaxEngineIDs - 1, kMaxEngineIDs, -1, 1000000};
+  for (int i = 0; i < 4; i++) {
+    in->QueueEvents(0, EventPackageID(5, engine_ids[i]), vector<GameEvent*>(1, e));
+    in->SendEvents(0);
+  }
+  delete e;
+
+  vector<pair<EventPackageID, vector<GameEvent*> > > output_events;
+  out->ReceiveEvents(&output_events);
+  ASSERT_EQ(1, output_events.size());
+  EXPECT_EQ(kMaxEngineIDs - 1, output_events[0].first.engine_id);
+
+  delete in;
+  delete out;
+}
+
 TEST(GameConnectionTest, TestNetworkConnections) {
   MockRouter router;
   MockNetworkManager nm1(&router);
@@ -274,10 +484,11 @@ TEST(GameConnectionTest, TestNetworkConnections) {
 
   int v[] = {0, 1, 2, 3, 254, 255, 256, 511, 512, 513, 65535, 65536, 65537, 2147483647};
   vector<int> values(v, v + 14);
+  vector<int> engine_ids(v, v + 6);
   for (int i = 0; i < values.size(); i++) {
-    for (int j = 0; j < values.size(); j++) {
+    for (int j = 0; j < engine_ids.size(); j++) {
       StateTimestep t = values[i];
-      EngineID e = values[j];
+      EngineID e = engine_ids[j];
       vector<GameEvent*> v;
       p1->QueueEvents(0, EventPackageID(t,e), v);
       p1->SendEvents(0);
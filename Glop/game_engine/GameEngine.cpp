@@ -1,5 +1,7 @@
 #include "GameEngine.h"
 #include "GameEvent.h"
+#include "GameReplay.h"
+#include "GameSpectator.h"
 #include "GameState.h"
 
 #include "GameProtos.pb.h"
@@ -13,6 +15,14 @@ using namespace std;
 REGISTER_EVENT(-1, GameStateEvent);
 REGISTER_EVENT(-2, ReadyToPlayEvent);
 REGISTER_EVENT(-3, NewEngineEvent);
+REGISTER_EVENT(-4, StateHashEvent);
+REGISTER_EVENT(-5, GameStateChunkEvent);
+REGISTER_EVENT(-6, TimeSyncEvent);
+REGISTER_EVENT(-7, DelayChangeEvent);
+
+// Compressed GameStates are sent to joining engines at this many bytes per Think(), unless that
+// would take more than half of the history window to finish.
+static const int kStateChunkBytes = 16 * 1024;
 
 
 class StandardFrameCalculator : public GameEngineFrameCalculator {
@@ -35,13 +45,60 @@ GameEngine::GameEngine(const GameState& reference)
     engine_id_(-1),
     next_game_engine_id_(0),
     host_(false),
+    newest_dirty_timestep_(-1),
+    max_rollback_timesteps_(0),
+    max_rollback_us_(0),
+    snapshot_interval_(1),
     frame_calculator_(new StandardFrameCalculator()),
     network_manager_(new NetworkManager()),
     networking_enabled_(false),
     reference_state_(reference.Copy()),
+    predictor_(NULL),
+    retired_event_timestep_(-2),
     num_thinks_(0),
-    num_rethinks_(0) {
-    
+    num_rethinks_(0),
+    num_state_allocations_(0),
+    num_skipped_rollbacks_(0),
+    num_hash_cutoffs_(0),
+    num_stalled_thinks_(0),
+    num_deferred_rollbacks_(0),
+    num_adopted_branch_states_(0),
+    num_predicted_packages_(0),
+    num_mispredictions_(0),
+    event_timing_(false),
+    desync_detection_(false),
+    last_sent_hash_timestep_(-1),
+    num_hashes_compared_(0),
+    num_desyncs_(0),
+    desync_timestep_(-1),
+    relay_(false),
+    time_sync_(false),
+    last_time_sync_ms_(-1),
+    last_think_time_ms_(-1),
+    time_advantage_ms_(0),
+    adaptive_delay_(false),
+    min_ms_delay_(0),
+    max_ms_delay_(0),
+    last_delay_change_ms_(-1),
+    pending_delay_timestep_(-1),
+    pending_ms_delay_(0),
+    num_delay_changes_(0),
+    delay_rollbacks_(0),
+    delay_rollback_depth_(0),
+    replay_writer_(NULL),
+    spectator_server_(NULL),
+    complete_hash_timestep_(-1),
+    complete_hash_(0),
+    async_rollback_(false),
+    simulation_thread_(NULL),
+    simulation_target_(-1),
+    simulated_timestep_(-1),
+    simulation_dirty_(false),
+    publish_back_(NULL),
+    publish_ready_(NULL),
+    publish_front_(NULL),
+    publish_fresh_(false) {
+  GameEventFactory::Freeze();
 }
 
 GameEngine::GameEngine(
@@ -59,6 +116,10 @@ GameEngine::GameEngine(
       last_send_event_timestep_(0),
       oldest_dirty_timestep_(0),
       latest_complete_state_timestep_(-1),
+      newest_dirty_timestep_(-1),
+      max_rollback_timesteps_(0),
+      max_rollback_us_(0),
+      snapshot_interval_(1),
       network_manager_(new NetworkManager()),
       networking_enabled_(false),
       port_(-1),
@@ -66,12 +127,57 @@ GameEngine::GameEngine(
       game_states_(max_frames_ + 1, -1),
       game_events_(max_frames_ * 2 + 1, -1),
       game_engine_infos_(max_frames_ + 1, -1),
+      predictor_(NULL),
+      predicted_events_(max_frames_ * 2 + 1, -1),
+      retired_event_timestep_(-2),
       frame_calculator_(new StandardFrameCalculator()),
       engine_id_(0),
       source_engine_id_(-1),
       next_game_engine_id_(1),
       num_thinks_(0),
-      num_rethinks_(0) {
+      num_rethinks_(0),
+      num_state_allocations_(0),
+      num_skipped_rollbacks_(0),
+      num_hash_cutoffs_(0),
+      num_stalled_thinks_(0),
+      num_deferred_rollbacks_(0),
+      num_adopted_branch_states_(0),
+      num_predicted_packages_(0),
+      num_mispredictions_(0),
+      event_timing_(false),
+      desync_detection_(false),
+      last_sent_hash_timestep_(-1),
+      num_hashes_compared_(0),
+      num_desyncs_(0),
+      desync_timestep_(-1),
+      relay_(false),
+      time_sync_(false),
+      last_time_sync_ms_(-1),
+      last_think_time_ms_(-1),
+      time_advantage_ms_(0),
+      adaptive_delay_(false),
+      min_ms_delay_(0),
+      max_ms_delay_(0),
+      last_delay_change_ms_(-1),
+      pending_delay_timestep_(-1),
+      pending_ms_delay_(0),
+      num_delay_changes_(0),
+      delay_rollbacks_(0),
+      delay_rollback_depth_(0),
+      replay_writer_(NULL),
+      spectator_server_(NULL),
+      complete_hash_timestep_(-1),
+      complete_hash_(0),
+      async_rollback_(false),
+      simulation_thread_(NULL),
+      simulation_target_(-1),
+      simulated_timestep_(-1),
+      simulation_dirty_(false),
+      publish_back_(NULL),
+      publish_ready_(NULL),
+      publish_front_(NULL),
+      publish_fresh_(false) {
+  GameEventFactory::Freeze();
   /// \todo jwills - There should probably be functionality for a default value in MovingWindow
   for (StateTimestep t = game_states_.GetFirstIndex(); t < game_states_.GetLastIndex(); t++) {
     game_states_[t] = NULL;
@@ -85,17 +191,54 @@ GameEngine::GameEngine(
     assert(!"ms_delay must be less than ms_per_net_frame\n");
   }
 
-  game_states_[-1] = reference_state_->Copy();
+  game_states_[-1] = CopyState(*reference_state_, NULL);
   game_engine_infos_[-1].state_timestep = -1;
 
   game_engine_infos_[-1].engine_ids.insert(0);
-  game_events_[-1][0].clear();
+  complete_engine_ids_ = game_engine_infos_[-1].engine_ids;
+  game_events_[-1].SetPackage(0, vector<GameEvent*>());
+  event_arenas_.Reset(max_frames_ * 2 + 1, -1);
 
   think_state_ = kPlaying;
 }
 /// \todo jwills - Might want to consider making some generic DeleteSTL things like google has.
 /// \todo jwills - This destructor actually needs to clean things up.
 GameEngine::~GameEngine() {
+  StopSimulationThread();
+  StopBranchThreads();
+  for (int i = 0; i < pending_joins_.size(); i++) {
+    delete pending_joins_[i].transfer;
+    delete pending_joins_[i].snapshot;
+  }
+  delete publish_back_;
+  delete publish_ready_;
+  delete publish_front_;
+  if (game_states_.size() > 0) {
+    for (StateTimestep t = game_states_.GetFirstIndex(); t <= game_states_.GetLastIndex(); t++) {
+      delete game_states_[t];
+    }
+  }
+  for (int i = 0; i < spare_states_.size(); i++) {
+    delete spare_states_[i];
+  }
+  for (int i = 0; i < local_events_.size(); i++) {
+    delete local_events_[i];
+  }
+  for (int i = 0; i < held_packages_.size(); i++) {
+    for (int j = 0; j < held_packages_[i].second.size(); j++) {
+      delete held_packages_[i].second[j];
+    }
+  }
+  if (predicted_events_.size() > 0) {
+    for (StateTimestep t = predicted_events_.GetFirstIndex();
+         t <= predicted_events_.GetLastIndex();
+         t++) {
+      DeletePredictedEvents(t);
+    }
+  }
+  delete predictor_;
+  delete replay_writer_;
+  delete reference_state_;
   delete frame_calculator_;
   delete network_manager_;
 }
@@ -116,12 +259,25 @@ void GameEngine::InstallNetworkManager(NetworkManagerInterface* manager) {
 
 void GameEngine::QueueEvents(StateTimestep current_state_timestep) {
   for (StateTimestep t = last_queue_event_timestep_ + 1; t <= current_state_timestep; t++) {
-    game_events_[t][engine_id_] = local_events_;
-    if (t < oldest_dirty_timestep_) {
-      oldest_dirty_timestep_ = t;
+    // Piggyback the checksum of our newest complete state on the first package that goes out
+    // after it completes.
+    if (desync_detection_) {
+      MutexLock lock(&publish_mutex_);
+      if (complete_hash_timestep_ > last_sent_hash_timestep_) {
+        StateHashEvent* she = NewStateHashEvent();
+        she->SetData(complete_hash_timestep_, complete_hash_);
+        local_events_.push_back(she);
+        last_sent_hash_timestep_ = complete_hash_timestep_;
+      }
+    }
+    if (time_sync_) {
+      QueueTimeSync(frame_calculator_->GetTime());
     }
+    event_arenas_.Adopt(t, local_events_);
+    PostEvents(EventPackageID(t, engine_id_), local_events_);
+    encoded_events_.Encode(local_events_);
     for (int i = 0; i < all_connections_.size(); i++) {
-      all_connections_[i]->QueueEvents(0, EventPackageID(t, engine_id_), local_events_);
+      all_connections_[i]->QueueEvents(0, EventPackageID(t, engine_id_), encoded_events_);
     }
     local_events_.clear();
   }
@@ -163,6 +319,9 @@ void GameEngine::ApplyEvents(const vector<GameEvent*>& events) {
 }
 
 const GameState& GameEngine::GetCurrentGameState() {
+  if (simulation_thread_ != NULL) {
+    return *publish_front_;
+  }
   for (StateTimestep t = game_states_.GetFirstIndex() + 1; t < game_states_.GetLastIndex(); t++) {
     if (game_engine_infos_[t].state_timestep != t) {
       return *game_states_[t - 1];
@@ -170,11 +329,14 @@ const GameState& GameEngine::GetCurrentGameState() {
   }
 }
 
-/*
 const GameState& GameEngine::GetCompleteGameState() {
-  return *game_states_[GetCompleteStateTimestep()];
+  // The worker owns the history, and won't touch it again until the next Think() gives it more to
+  // do.
+  FlushAsyncRollback();
+  return *game_states_[latest_complete_state_timestep_];
 }
 
+/*
 const GameState& GameEngine::GetSpecificGameState(StateTimestep state_timestep) {
   return *game_states_[state_timestep];
 }
@@ -184,70 +346,458 @@ const GameState& GameEngine::GetSpecificGameState(StateTimestep state_timestep)
 // previous GameState is complete, and that all available events in game_events_ that should be
 // applied to this GameState have already been.
 bool GameEngine::IsStateComplete(StateTimestep state_timestep) {
-  set<EngineID>::const_iterator it;
-  for (it = game_engine_infos_[state_timestep].engine_ids.begin();
-       it != game_engine_infos_[state_timestep].engine_ids.end();
-       it++) {
-    if (!game_events_[state_timestep].count(*it)) {
-      return false;
+  // Every timestep needs a package from the host, as well as from everybody in the game.
+  const EngineSet& received = game_events_[state_timestep].engine_ids();
+  return received.count(0) &&
+         received.Contains(game_engine_infos_[state_timestep].engine_ids) &&
+         game_engine_infos_[state_timestep].state_timestep == state_timestep;
+}
+
+GameState* GameEngine::CopyState(const GameState& source, GameState* dest) {
+  if (dest != NULL) {
+    if (source.CopyInto(dest)) {
+      return dest;
     }
+    delete dest;
   }
-  if (!game_events_[state_timestep].count(0)) {
-    return false;
+  if (!spare_states_.empty()) {
+    GameState* spare = spare_states_.back();
+    spare_states_.pop_back();
+    if (source.CopyInto(spare)) {
+      return spare;
+    }
+    // States that don't support CopyInto are no use to the pool.
+    delete spare;
   }
-  if (game_engine_infos_[state_timestep].state_timestep != state_timestep) {
-    return false;
+  num_state_allocations_++;
+  return source.Copy();
+}
+
+GameState* GameEngine::DeepCopyState(const GameState& source, GameState* dest) {
+  // Only source's data is read, so this is safe even while another thread copies it.  Nobody but
+  // us copies reference_state_ once the game is running.
+  string data;
+  source.SerializeToString(&data);
+  if (dest == NULL) {
+    dest = CopyState(*reference_state_, NULL);
   }
-  return true;
+  dest->ParseFromString(data);
+  return dest;
 }
 
-void GameEngine::RecreateState(StateTimestep state_timestep) {
-  if (game_states_[state_timestep] != NULL) {
-    delete game_states_[state_timestep];
+void GameEngine::RecycleState(GameState* state) {
+  if (state == NULL) {
+    return;
+  }
+  // A rollback takes at most one spare per state in game_states_, so more than that is never used.
+  // This also keeps states that don't support CopyInto, which CopyState never takes out of the
+  // pool, from piling up.
+  if (spare_states_.size() > max_frames_) {
+    delete state;
+    return;
   }
+  spare_states_.push_back(state);
+}
 
+void GameEngine::AdvanceWindows() {
+  // The events of the timestep leaving the window are about to be freed.
+  CancelBranches(game_events_.GetFirstIndex());
+  GameState* retired;
+  game_states_.Advance(&retired);
+  RecycleState(retired);
+  // The table leaving the window is recycled as the new one, so it keeps its memory.
+  TimestepEvents recycled;
+  recycled.swap(game_events_[game_events_.GetFirstIndex()]);
+  game_events_.Advance();
+  recycled.clear();
+  recycled.swap(game_events_[game_events_.GetLastIndex()]);
+  DeletePredictedEvents(predicted_events_.GetFirstIndex());
+  predicted_events_.Advance();
+  game_engine_infos_.Advance();
+  MutexLock lock(&publish_mutex_);
+  retired_event_timestep_ = game_events_.GetFirstIndex() - 1;
+  complete_engine_ids_ = game_engine_infos_[game_engine_infos_.GetFirstIndex()].engine_ids;
+}
+
+void GameEngine::RecreateState(StateTimestep state_timestep) {
+  int64 start_us = system()->GetTimeMicro();
   if (game_engine_infos_[state_timestep].state_timestep == state_timestep) {
     num_rethinks_++;
   }
   num_thinks_++;
 
-  game_states_[state_timestep] = game_states_[state_timestep - 1]->Copy();
+  if (game_states_[state_timestep - 1] == NULL) {
+    RestoreState(state_timestep - 1);
+  }
+  game_states_[state_timestep] =
+      CopyState(*game_states_[state_timestep - 1], game_states_[state_timestep]);
   game_engine_infos_[state_timestep] = game_engine_infos_[state_timestep - 1];
   game_engine_infos_[state_timestep].state_timestep = state_timestep;
 
 
+  // Engines whose events haven't arrived yet are simulated with predicted events if we can, which
+  // go in the same place in the application order as the real events would.
+  const TimestepEvents* events = &game_events_[state_timestep];
+  if (predictor_ != NULL) {
+    PredictMissingEvents(state_timestep);
+    if (!predicted_events_[state_timestep].empty()) {
+      speculative_events_ = game_events_[state_timestep];
+      map<EngineID, vector<GameEvent*> >::const_iterator it;
+      for (it = predicted_events_[state_timestep].begin();
+           it != predicted_events_[state_timestep].end();
+           it++) {
+        speculative_events_.SetPackage(it->first, it->second);
+      }
+      events = &speculative_events_;
+    }
+  } else {
+    DeletePredictedEvents(state_timestep);
+  }
+
+  int64 apply_us = system()->GetTimeMicro();
   ApplyEventsToGameState(
       state_timestep,
-      game_events_[state_timestep],
+      *events,
       game_states_[state_timestep],
-      &game_engine_infos_[state_timestep]);
+      &game_engine_infos_[state_timestep],
+      &stats_,
+      event_timing_);
+  stats_.apply_events_us.Add(system()->GetTimeMicro() - apply_us);
 
   game_states_[state_timestep]->Think();
 
-  if (latest_complete_state_timestep_ == state_timestep - 1 && IsStateComplete(state_timestep)) {
+  if (IsStateComplete(state_timestep)) {
+    stats_.confirmed_frames++;
+  } else {
+    stats_.speculative_frames++;
+  }
+  stats_.recreate_state_us.Add(system()->GetTimeMicro() - start_us);
+}
+
+void GameEngine::RestoreState(StateTimestep state_timestep) {
+  StateTimestep t = state_timestep;
+  while (game_states_[t - 1] == NULL) {
+    t--;
+  }
+  for (; t <= state_timestep; t++) {
+    RecreateState(t);
+  }
+}
+
+void GameEngine::DiscardState(StateTimestep state_timestep, StateTimestep current_state_timestep) {
+  // Keyframes and complete states stay, and so do the head and the state before it, since the
+  // next Think starts by simulating the head again.
+  if (snapshot_interval_ <= 1 ||
+      state_timestep % snapshot_interval_ == 0 ||
+      state_timestep <= latest_complete_state_timestep_ ||
+      state_timestep >= current_state_timestep - 1 ||
+      game_states_[state_timestep] == NULL) {
+    return;
+  }
+  // A rollback through dropped states takes a spare for each one and gives one back, except when
+  // it passes a keyframe, so a few spares go a long way.  Anything beyond that is the memory we are
+  // trying to save.
+  if (spare_states_.size() < snapshot_interval_) {
+    RecycleState(game_states_[state_timestep]);
+  } else {
+    delete game_states_[state_timestep];
+  }
+  game_states_[state_timestep] = NULL;
+}
+
+void GameEngine::AdvanceCompleteStates(StateTimestep last_fresh_timestep) {
+  while (latest_complete_state_timestep_ < last_fresh_timestep &&
+         IsStateComplete(latest_complete_state_timestep_ + 1)) {
     while (latest_complete_state_timestep_ == game_states_.GetFirstIndex() + 1) {
-      game_states_.Advance();
-      game_events_.Advance();
-      game_engine_infos_.Advance();
+      AdvanceWindows();
     }
     latest_complete_state_timestep_++;
+    if (game_states_[latest_complete_state_timestep_] == NULL) {
+      RestoreState(latest_complete_state_timestep_);
+    }
+    RecordStateHash(latest_complete_state_timestep_);
+    if (replay_writer_ != NULL) {
+      replay_writer_->WriteTimestep(
+          game_events_[latest_complete_state_timestep_],
+          game_engine_infos_[latest_complete_state_timestep_],
+          *game_states_[latest_complete_state_timestep_]);
+    }
+    if (spectator_server_ != NULL) {
+      spectator_server_->AddTimestep(
+          game_events_[latest_complete_state_timestep_],
+          game_engine_infos_[latest_complete_state_timestep_],
+          *game_states_[latest_complete_state_timestep_]);
+    }
+  }
+}
+
+bool GameEngine::StartRecording(const string& filename, int keyframe_interval) {
+  StopRecording();
+  MutexLock lock(&simulation_mutex_);
+  if ((think_state_ != kReady && think_state_ != kPlaying) ||
+      game_states_[latest_complete_state_timestep_] == NULL) {
+    return false;
+  }
+  GameReplayWriter* writer = new GameReplayWriter(filename, keyframe_interval);
+  if (!writer->IsOpen()) {
+    delete writer;
+    return false;
+  }
+  writer->WriteInitialState(
+      game_engine_infos_[latest_complete_state_timestep_],
+      *game_states_[latest_complete_state_timestep_]);
+  replay_writer_ = writer;
+  return true;
+}
+
+void GameEngine::StopRecording() {
+  MutexLock lock(&simulation_mutex_);
+  delete replay_writer_;
+  replay_writer_ = NULL;
+}
+
+bool GameEngine::AttachSpectatorServer(GameSpectatorServer* server) {
+  MutexLock lock(&simulation_mutex_);
+  if (server == NULL) {
+    spectator_server_ = NULL;
+    return true;
+  }
+  if ((think_state_ != kReady && think_state_ != kPlaying) ||
+      game_states_[latest_complete_state_timestep_] == NULL) {
+    return false;
+  }
+  server->AddInitialState(
+      game_engine_infos_[latest_complete_state_timestep_],
+      *game_states_[latest_complete_state_timestep_]);
+  spectator_server_ = server;
+  return true;
+}
+
+void GameEngine::RecordStateHash(StateTimestep state_timestep) {
+  if (!desync_detection_) {
+    return;
+  }
+  // Forget about anything that has fallen out of our history.
+  StateTimestep first = game_states_.GetFirstIndex();
+  while (!state_hashes_.empty() && state_hashes_.begin()->first < first) {
+    state_hashes_.erase(state_hashes_.begin());
+  }
+  while (!remote_state_hashes_.empty() && remote_state_hashes_.begin()->first < first) {
+    remote_state_hashes_.erase(remote_state_hashes_.begin());
+  }
+
+  uint32 hash;
+  if (!game_states_[state_timestep]->Hash(&hash)) {
+    return;
+  }
+  state_hashes_[state_timestep] = hash;
+  {
+    MutexLock lock(&publish_mutex_);
+    complete_hash_timestep_ = state_timestep;
+    complete_hash_ = hash;
+  }
+
+  map<StateTimestep, map<EngineID, uint32> >::iterator it =
+      remote_state_hashes_.find(state_timestep);
+  if (it != remote_state_hashes_.end()) {
+    map<EngineID, uint32> pending = it->second;
+    remote_state_hashes_.erase(it);
+    map<EngineID, uint32>::const_iterator pit;
+    for (pit = pending.begin(); pit != pending.end(); pit++) {
+      CheckStateHash(pit->first, state_timestep, pit->second);
+    }
+  }
+}
+
+void GameEngine::CheckStateHash(EngineID engine_id, StateTimestep state_timestep, uint32 hash) {
+  if (!desync_detection_ || engine_id == engine_id_) {
+    return;
+  }
+  map<StateTimestep, uint32>::const_iterator it = state_hashes_.find(state_timestep);
+  if (it == state_hashes_.end()) {
+    // If we haven't completed this timestep yet, hang on to the hash until we have.  Otherwise it
+    // is too old for us to check, or our GameState doesn't support hashing.
+    if (state_timestep > latest_complete_state_timestep_) {
+      remote_state_hashes_[state_timestep][engine_id] = hash;
+    }
+    return;
+  }
+  num_hashes_compared_++;
+  if (it->second != hash) {
+    printf("Engine %d has desynced from engine %d on timestep %d (%08x != %08x)\n",
+           engine_id_, engine_id, state_timestep, it->second, hash);
+    num_desyncs_++;
+    if (desync_timestep_ == -1 || state_timestep < desync_timestep_) {
+      desync_timestep_ = state_timestep;
+    }
+  }
+}
+
+// Returns true iff a and b hold the same events once no-ops are left out.
+static bool SameEvents(const vector<GameEvent*>& a, const vector<GameEvent*>& b) {
+  vector<GameEvent*> a_events, b_events;
+  for (int i = 0; i < a.size(); i++) {
+    if (!a[i]->IsNoOp()) {
+      a_events.push_back(a[i]);
+    }
+  }
+  for (int i = 0; i < b.size(); i++) {
+    if (!b[i]->IsNoOp()) {
+      b_events.push_back(b[i]);
+    }
+  }
+  if (a_events.size() != b_events.size()) {
+    return false;
+  }
+  for (int i = 0; i < a_events.size(); i++) {
+    string a_data, b_data;
+    GameEventFactory::Serialize(a_events[i], &a_data);
+    GameEventFactory::Serialize(b_events[i], &b_data);
+    if (a_data != b_data) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Appends copies of the game events in events to copies.
+static void CopyGameEvents(const vector<GameEvent*>& events, vector<GameEvent*>* copies) {
+  for (int i = 0; i < events.size(); i++) {
+    if (events[i]->type() > 0) {
+      string data;
+      GameEventFactory::Serialize(events[i], &data);
+      copies->push_back(GameEventFactory::Deserialize(data));
+    }
+  }
+}
+
+static bool IsNoOpPackage(const vector<GameEvent*>& events) {
+  for (int i = 0; i < events.size(); i++) {
+    if (!events[i]->IsNoOp()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool GameEngine::CanSkipRollback(StateTimestep state_timestep,
+                                 const vector<GameEvent*>& events) {
+  // If we haven't simulated this timestep yet there is nothing to roll back anyway.
+  if (game_engine_infos_[state_timestep].state_timestep != state_timestep) {
+    return false;
+  }
+  if (!IsNoOpPackage(events)) {
+    return false;
+  }
+  // Adding a package changes the order ApplyEventsToGameState applies the other packages in, so
+  // this is only safe if at most one other package actually does anything.
+  int active_packages = 0;
+  const TimestepEvents& received = game_events_[state_timestep];
+  for (int i = 0; i < received.NumPackages(); i++) {
+    const TimestepEvents::Package& package = received.GetPackage(i);
+    for (int j = package.begin; j < package.end; j++) {
+      if (!received.GetRecord(j).event->IsNoOp()) {
+        active_packages++;
+        break;
+      }
+    }
   }
+  map<EngineID, vector<GameEvent*> >::const_iterator it;
+  for (it = predicted_events_[state_timestep].begin();
+       it != predicted_events_[state_timestep].end();
+       it++) {
+    if (!IsNoOpPackage(it->second)) {
+      active_packages++;
+    }
+  }
+  return active_packages <= 1;
+}
+
+void GameEngine::InstallEventPredictor(GameEventPredictor* predictor) {
+  MutexLock lock(&simulation_mutex_);
+  delete predictor_;
+  predictor_ = predictor;
+}
+
+void GameEngine::PredictMissingEvents(StateTimestep state_timestep) {
+  DeletePredictedEvents(state_timestep);
+  const EngineSet& engine_ids = game_engine_infos_[state_timestep].engine_ids;
+  EngineSet::const_iterator it;
+  for (it = engine_ids.begin(); it != engine_ids.end(); it++) {
+    if (*it == engine_id_ || game_events_[state_timestep].HasPackage(*it)) {
+      continue;
+    }
+    // Predictions are based on the newest package that really arrived from that engine.
+    StateTimestep last_timestep = state_timestep - 1;
+    while (last_timestep >= game_events_.GetFirstIndex() &&
+           !game_events_[last_timestep].HasPackage(*it)) {
+      last_timestep--;
+    }
+    vector<GameEvent*> last_events;
+    if (last_timestep >= game_events_.GetFirstIndex()) {
+      game_events_[last_timestep].GetEvents(*it, &last_events);
+    } else {
+      last_timestep = -1;
+    }
+    vector<GameEvent*>& predicted = predicted_events_[state_timestep][*it];
+    predictor_->PredictEvents(*it, state_timestep, last_timestep, last_events, &predicted);
+    for (int i = 0; i < predicted.size(); i++) {
+      ASSERT(predicted[i]->type() > 0);
+    }
+    num_predicted_packages_++;
+  }
+}
+
+void GameEngine::DeletePredictedEvents(StateTimestep state_timestep) {
+  map<EngineID, vector<GameEvent*> >& predicted = predicted_events_[state_timestep];
+  map<EngineID, vector<GameEvent*> >::iterator it;
+  for (it = predicted.begin(); it != predicted.end(); it++) {
+    for (int i = 0; i < it->second.size(); i++) {
+      delete it->second[i];
+    }
+  }
+  predicted.clear();
+}
+
+bool GameEngine::ConsumePrediction(
+    StateTimestep state_timestep,
+    EngineID engine_id,
+    const vector<GameEvent*>& events,
+    bool* matched) {
+  if (state_timestep > predicted_events_.GetLastIndex()) {
+    return false;
+  }
+  map<EngineID, vector<GameEvent*> >& predicted = predicted_events_[state_timestep];
+  map<EngineID, vector<GameEvent*> >::iterator it = predicted.find(engine_id);
+  if (it == predicted.end()) {
+    return false;
+  }
+  // No-ops, like the checksums and clock stamps that ride along with packages, can't have made a
+  // difference.  Other engine-level events never get predicted, so they are always a mismatch.
+  *matched = SameEvents(it->second, events);
+  for (int i = 0; i < it->second.size(); i++) {
+    delete it->second[i];
+  }
+  predicted.erase(it);
+  if (!*matched) {
+    num_mispredictions_++;
+  }
+  return true;
 }
 
 void GameEngine::ApplyEventsToGameState(
     int think_count,
-    const map<EngineID, vector<GameEvent*> >& events,
+    const TimestepEvents& events,
     GameState* game_state,
-    GameEngineInfo* game_engine_info) {
+    GameEngineInfo* game_engine_info,
+    GameEngineStats* stats,
+    bool time_events) {
 
   // For simplicity, we always apply game engine events (ID < 0) in the order of engine id
-  map<EngineID, vector<GameEvent*> >::const_iterator map_it;
-  for (map_it = events.begin(); map_it != events.end(); map_it++) {
-    for (int i = 0; i < map_it->second.size(); i++) {
-      /// \todo jwills - Should probably check that these events are coming from the host?
-      if (map_it->second[i]->type() < 0) {
-        map_it->second[i]->ApplyToGameEngineInfo(game_engine_info);
-      }
+  for (int i = 0; i < events.NumRecords(); i++) {
+    /// \todo jwills - Should probably check that these events are coming from the host?
+    if (events.GetRecord(i).type < 0) {
+      events.GetRecord(i).event->ApplyToGameEngineInfo(game_engine_info);
     }
   }
 
@@ -256,29 +806,73 @@ void GameEngine::ApplyEventsToGameState(
   // loop through all of the indices in order from there, wrapping around at the end.  It could be
   // more fair, but this is dead simple and probably good enough.
   // TODO: Don't forget to make a test to ensure this fair ordering actually happens
-  vector<EngineID> ids;
-  for (map_it = events.begin(); map_it != events.end(); map_it++) {
-    ids.push_back(map_it->first);
+  if (stats != NULL && stats->event_types.size() != GameEventFactory::NumEventTypes()) {
+    stats->event_types.resize(GameEventFactory::NumEventTypes());
   }
-  int total = 0;
-  for (int i = 0; i < events.size(); i++) {
-    int index = (i + think_count) % events.size();
-    const vector<GameEvent*> events_package = events.find(ids[index])->second;
-    for (int j = 0; j < events_package.size(); j++) {
-      if (events_package[j]->type() > 0) {
-        events_package[j]->ApplyToGameState(game_state);
-        total++;
+  int num_packages = events.NumPackages();
+  for (int i = 0; i < num_packages; i++) {
+    const TimestepEvents::Package& package = events.GetPackage((i + think_count) % num_packages);
+    for (int j = package.begin; j < package.end; j++) {
+      const TimestepEvents::Record& record = events.GetRecord(j);
+      if (record.type <= 0) {
+        continue;
+      }
+      if (stats == NULL) {
+        record.event->ApplyToGameState(game_state);
+        continue;
+      }
+      EventTypeStats& type_stats =
+          stats->event_types[GameEventFactory::GetEventTypeIndex(record.type)];
+      type_stats.count++;
+      if (time_events) {
+        int64 start_us = system()->GetTimeMicro();
+        record.event->ApplyToGameState(game_state);
+        type_stats.total_us += system()->GetTimeMicro() - start_us;
+      } else {
+        record.event->ApplyToGameState(game_state);
       }
     }
   }
 }
 
 void GameEngine::ThinkPlaying() {
-  ASSERT(game_states_.GetFirstIndex() == game_engine_infos_.GetFirstIndex());
-  ASSERT(game_states_.GetFirstIndex() == game_events_.GetFirstIndex());
   int time_ms = frame_calculator_->GetTime();
+  // The history only reaches max_frames_ timesteps past the oldest one we are keeping, which is
+  // the one before the latest complete state.  If another engine's events are further behind than
+  // that, hold our clock back until they arrive instead of running off the end of the history.
+  StateTimestep last_state_timestep = GetLastStateTimestep();
+  // We might only be this far ahead because the simulation hasn't caught up with events we already
+  // have, like right after joining a game that went on while the snapshot was on its way.  That
+  // shouldn't cost us clock time, or we would end up behind everyone else for good, so catch up
+  // first.  The async worker is never waited for, since keeping Think() from blocking on rollback
+  // is its whole point.  It is only pointed at the end of the history, and whatever it has retired
+  // so far is picked up here, and the rest on a later Think().
+  while (time_ms >= (last_state_timestep + 1) * ms_per_state_frame_) {
+    if (simulation_thread_ == NULL) {
+      Simulate(last_state_timestep);
+    } else {
+      MutexLock lock(&inbox_mutex_);
+      if (last_state_timestep > simulation_target_) {
+        simulation_target_ = last_state_timestep;
+      }
+    }
+    RetireEventArenas();
+    PostHeldPackages();
+    StateTimestep caught_up_timestep = GetLastStateTimestep();
+    if (caught_up_timestep == last_state_timestep) {
+      break;
+    }
+    last_state_timestep = caught_up_timestep;
+  }
+  int max_time_ms = (last_state_timestep + 1) * ms_per_state_frame_ - 1;
+  if (time_ms > max_time_ms) {
+    time_ms = max_time_ms;
+    frame_calculator_->SetTime(time_ms);
+    num_stalled_thinks_++;
+  }
   StateTimestep current_state_timestep = time_ms / ms_per_state_frame_;
   NetTimestep current_net_timestep = time_ms / ms_per_net_frame_;
+  ApplyPendingDelay(current_state_timestep);
   StateTimestep delayed_state_timestep = GetCurrentDelayedStateTimestep(time_ms);
   if (think_state_ == kPlaying) {
     QueueEvents(delayed_state_timestep);
@@ -289,9 +883,12 @@ void GameEngine::ThinkPlaying() {
   // First go through all of the connections and get any new events that are available and add them
   // game_events_.  Keep track of the oldest timestep for which we have received new events, this is
   // the one that we'll have to rewind to.
+  // Nothing from the previous Think refers to events outside of the history any more.
+  event_arenas_.ClearScratch();
+  PostHeldPackages();
   for (int i = 0; i < playing_connections_.size(); i++) {
     vector<pair<EventPackageID, vector<GameEvent*> > > events;
-    playing_connections_[i]->ReceiveEvents(&events);
+    playing_connections_[i]->ReceiveEvents(&events, &event_arenas_);
 
     // Special processing for certain engine-level events.  This should probably be migrated to its
     // own method.
@@ -299,16 +896,32 @@ void GameEngine::ThinkPlaying() {
       for (int k = 0; k < events[j].second.size(); k++) {
         if (events[j].second[k]->type() == -2) {
           assert(events[j].second.size() == 1); // This event should always be by itself
+          if (event_arenas_.GetEventArena(events[j].first.state_timestep) == NULL) {
+            // It was decoded onto the heap, and it needs an owner at the timestep it moves to.
+            event_arenas_.Adopt(current_state_timestep, events[j].second);
+          }
           // This event can come from any time, so we set it to our current timestep so that we
           // don't put it into a place in our history we've already forgotten about.
           events[j].first.state_timestep = current_state_timestep;
           ReadyToPlayEvent* r2p = (ReadyToPlayEvent*)events[j].second[k];
-          if (host_) {
+          EngineID new_engine_id = host_ ? AllocateEngineID() : -1;
+          if (host_ && new_engine_id < 0) {
+            printf("Refused to add engine %d, the game is out of engine ids\n", r2p->temporary());
+          } else if (host_) {
             NewEngineEvent* nen = NewNewEngineEvent();
-            nen->SetData(r2p->origin(), r2p->temporary(), next_game_engine_id_++);
+            nen->SetData(r2p->origin(), r2p->temporary(), new_engine_id);
             ApplyEvent(nen);
           }
         }
+        if (events[j].second[k]->type() == -7) {
+          ReceiveDelayChange(
+              events[j].first.engine_id,
+              *(DelayChangeEvent*)events[j].second[k],
+              current_state_timestep);
+        }
+        if (events[j].second[k]->type() == -6) {
+          ReceiveTimeSync(events[j].first.engine_id, *(TimeSyncEvent*)events[j].second[k], time_ms);
+        }
 // TODO: Need to make sure to not to reset oldest_dirty_timestep if we receive events for someone
 // on a timestep before they actually exist.  It's clearly an error, but we shouldn't crash.
         if (events[j].second[k]->type() == -3) {
@@ -326,10 +939,27 @@ void GameEngine::ThinkPlaying() {
         }
       }
 
-      // NOTE: This check must be at the end of this block because in the event of a ReadyToPlay
-      // event we actually modify the timestep of the event package.
-      if (events[j].first.state_timestep < oldest_dirty_timestep_) {
-        oldest_dirty_timestep_ = events[j].first.state_timestep;
+    }
+
+    EngineSet engine_ids;
+    {
+      MutexLock lock(&publish_mutex_);
+      engine_ids = complete_engine_ids_;
+    }
+    for (int j = 0; j < events.size(); j++) {
+      // Only engines that are actually in the game get a lateness entry, or anyone could fill
+      // these maps with made-up ids.
+      EngineID engine_id = events[j].first.engine_id;
+      if (!engine_ids.count(engine_id) || engine_id == engine_id_) { continue; }
+      int lateness = time_ms - events[j].first.state_timestep * ms_per_state_frame_;
+      stats_.arrival_lateness_ms[engine_id].Add(lateness);
+      if (adaptive_delay_ && host_) {
+        map<EngineID, int>::iterator it = arrival_lateness_ms_.find(engine_id);
+        if (it == arrival_lateness_ms_.end()) {
+          arrival_lateness_ms_[engine_id] = lateness;
+        } else {
+          it->second = (it->second * 7 + lateness) / 8;
+        }
       }
     }
 
@@ -337,15 +967,18 @@ void GameEngine::ThinkPlaying() {
     // all of our other connections.
     // TODO: If we ever change to any graph that isn't a tree this won't work and we'll actually
     // need to keep track of who we should send which events to,
-    for (int j = 0; j < all_connections_.size(); j++) {
-      if (all_connections_[j] == playing_connections_[i]) { continue; }
+    // A relay merges them in with its own packages, so that each connection gets one stream.
+    int forward_channel = relay_ ? 0 : 1;
+    if (all_connections_.size() > 1) {
       for (int k = 0; k < events.size(); k++) {
-        all_connections_[j]->QueueEvents(1, events[k].first, events[k].second);
+        encoded_events_.Encode(events[k].second);
+        for (int j = 0; j < all_connections_.size(); j++) {
+          if (all_connections_[j] == playing_connections_[i]) { continue; }
+          all_connections_[j]->QueueEvents(forward_channel, events[k].first, encoded_events_);
+        }
       }
     }
     for (int j = 0; j < events.size(); j++) {
-      EngineID engine_id = events[j].first.engine_id;
-      StateTimestep state_timestep = events[j].first.state_timestep;
       // In the case that the only events in a package are ReadyToPlay events, then we ignore that
       // package for the purposes of updating oldest_dirty_timestep_, since it won't actually change
       // anything, and can even cause a crash on the hosting engine.
@@ -356,115 +989,1171 @@ void GameEngine::ThinkPlaying() {
         }
       }
       if (!valid) { continue; }
-      // Check that we haven't already received events on this timestep for this player
-      if (game_events_[state_timestep].count(engine_id)) {
-        printf("Timestep: %d\n", state_timestep);
-        printf("Engine %d has received a second batch of events from engine %d\n", engine_id_, engine_id);
-        printf("Sizes (prev/cur): %d/%d\n", game_events_[state_timestep][engine_id].size(), events[j].second.size());
-        // TODO: Maybe this is because of duplicated packets?  Investigate more, we might just be
-        // able to ignore this when it happens to long as we get the same packets each time.
-        assert(!game_events_[state_timestep].count(engine_id));
+      // NOTE: This must come after the engine-level event processing above because in the event
+      // of a ReadyToPlay event we actually modify the timestep of the event package.
+      const EventPackageID& id = events[j].first;
+      if (id.state_timestep < event_arenas_.GetFirstIndex()) {
+        // The history has moved past these, and they are in the scratch arena, which is cleared
+        // at the start of the next Think.
+        continue;
       }
-      game_events_[state_timestep][engine_id] = events[j].second;
+      if (id.state_timestep > event_arenas_.GetLastIndex()) {
+        // These were decoded onto the heap, and wait there until the history reaches them.
+        held_packages_.push_back(events[j]);
+        continue;
+      }
+      PostEvents(id, events[j].second);
     }
   }
-  for (StateTimestep t = oldest_dirty_timestep_; t <= current_state_timestep; t++) {
-    RecreateState(t);
+  if (time_sync_ && think_state_ == kPlaying) {
+    AdjustTime(time_ms);
+  }
+  if (adaptive_delay_ && host_) {
+    AdaptDelay(time_ms, current_state_timestep);
+  }
+  last_think_time_ms_ = frame_calculator_->GetTime();
+  if (simulation_thread_ == NULL) {
+    Simulate(current_state_timestep);
+    if (async_rollback_ && think_state_ == kPlaying) {
+      StartSimulationThread(current_state_timestep);
+    }
+  } else {
+    {
+      MutexLock lock(&inbox_mutex_);
+      if (current_state_timestep > simulation_target_) {
+        simulation_target_ = current_state_timestep;
+      }
+    }
+    AcquirePublishedHead();
   }
-  for (int j = 0; j < all_connections_.size(); j++) {
-    all_connections_[j]->SendEvents(1);
+  // Forwarded packages go out right away, unless we are a relay, in which case they wait for our
+  // own next package and go out with it.
+  if (!relay_) {
+    for (int j = 0; j < all_connections_.size(); j++) {
+      all_connections_[j]->SendEvents(1);
+    }
   }
   SendEvents(current_state_timestep);
+  RetireEventArenas();
+}
 
-  // TODO: Consider whether we should skip the if statement, and just make sure we're always ready
-  // to have oldest_dirty_timestep_ updated
-  if (current_state_timestep > oldest_dirty_timestep_) {
-    oldest_dirty_timestep_ = current_state_timestep;
+StateTimestep GameEngine::GetLastStateTimestep() {
+  if (simulation_thread_ == NULL) {
+    return game_states_.GetLastIndex();
   }
-  // We only go up to delayed_timestep here so that we have a little extra time to get everyone
-  // else's events for the head frame before having to call think on it.  This prevents us from
-  // having to run GameState.Think() more than once on any frame so long as we receive all events
-  // for a frame before delayed_frame = current_frame.
-  head_ = game_states_[current_state_timestep];
+  // The worker owns the history, but event_arenas_ only retires a timestep after the worker has,
+  // so its window is never ahead of the worker's.
+  return event_arenas_.GetFirstIndex() + max_frames_;
 }
 
-void GameEngine::ThinkLagging() {
-  
+void GameEngine::PostHeldPackages() {
+  int num_held_packages = 0;
+  for (int i = 0; i < held_packages_.size(); i++) {
+    const EventPackageID& id = held_packages_[i].first;
+    if (id.state_timestep > event_arenas_.GetLastIndex()) {
+      held_packages_[num_held_packages++] = held_packages_[i];
+      continue;
+    }
+    event_arenas_.Adopt(id.state_timestep, held_packages_[i].second);
+    PostEvents(id, held_packages_[i].second);
+  }
+  held_packages_.resize(num_held_packages);
 }
 
-GameEngineThinkState GameEngine::Think() {
-  ThinkNetworking();
-  switch (think_state_) {
-    case kIdle:
-    case kGameOver:
-    case kConnectionFailed: {
-      think_state_ = kIdle;
-      break;
-    }
-    case kReady:
-    case kPlaying: {
-      ThinkPlaying();
-      break;
-    }
-    case kLagging: {
-//      ThinkLagging();
-      break;
-    }
-    case kConnecting: {
-      ThinkConnecting();
-      break;
-    }
-    case kJoining: {
-      ThinkJoining();
-      break;
+EngineID GameEngine::AllocateEngineID() {
+  ReleaseRetiredEngineIDs();
+  if (!free_engine_ids_.empty()) {
+    EngineID engine_id = free_engine_ids_.back();
+    free_engine_ids_.pop_back();
+    return engine_id;
+  }
+  if (next_game_engine_id_ >= kMaxEngineIDs) {
+    return -1;
+  }
+  return next_game_engine_id_++;
+}
+
+int GameEngine::NumFreeEngineIDs() {
+  ReleaseRetiredEngineIDs();
+  return free_engine_ids_.size() + kMaxEngineIDs - next_game_engine_id_;
+}
+
+void GameEngine::ReleaseRetiredEngineIDs() {
+  // event_arenas_ never gets ahead of the history, so once it has moved past a timestep, so has
+  // every snapshot a new joiner could be sent.
+  int num_retiring = 0;
+  for (int i = 0; i < retiring_engine_ids_.size(); i++) {
+    if (retiring_engine_ids_[i].first < event_arenas_.GetFirstIndex()) {
+      free_engine_ids_.push_back(retiring_engine_ids_[i].second);
+    } else {
+      retiring_engine_ids_[num_retiring++] = retiring_engine_ids_[i];
     }
   }
-  return think_state_;
+  retiring_engine_ids_.resize(num_retiring);
 }
 
+void GameEngine::RetireEventArenas() {
+  StateTimestep retired_event_timestep;
+  {
+    MutexLock lock(&publish_mutex_);
+    retired_event_timestep = retired_event_timestep_;
+  }
+  event_arenas_.RetireThrough(retired_event_timestep);
+}
 
-// NETWORKING SCHTUFF
-void GameEngine::ThinkNetworking() {
-  if (!networking_enabled_) { return; }
-  network_manager_->Think();
+void GameEngine::EnableAdaptiveDelay(bool enabled, int min_ms_delay, int max_ms_delay) {
+  ASSERT(min_ms_delay >= 0 && min_ms_delay <= max_ms_delay);
+  ASSERT(max_ms_delay < ms_per_net_frame_);
+  adaptive_delay_ = enabled;
+  min_ms_delay_ = min_ms_delay;
+  max_ms_delay_ = max_ms_delay;
+  arrival_lateness_ms_.clear();
+  MutexLock lock(&publish_mutex_);
+  delay_rollbacks_ = 0;
+  delay_rollback_depth_ = 0;
+}
 
-  // TODO: This should be in a different function entireyly
-  if (think_state_ != kPlaying) {
+void GameEngine::AdaptDelay(int time_ms, StateTimestep current_state_timestep) {
+  if (pending_delay_timestep_ >= 0 || arrival_lateness_ms_.empty()) {
+    return;
+  }
+  // Measure for a while after the last change before making another.
+  if (last_delay_change_ms_ >= 0 && time_ms - last_delay_change_ms_ < ms_per_net_frame_ * 10) {
+    return;
+  }
+  int worst_lateness = arrival_lateness_ms_.begin()->second;
+  map<EngineID, int>::iterator it;
+  for (it = arrival_lateness_ms_.begin(); it != arrival_lateness_ms_.end(); it++) {
+    if (it->second > worst_lateness) {
+      worst_lateness = it->second;
+    }
+  }
+  // A package that made us re-simulate depth states arrived at least depth - 1 state frames late,
+  // so the rollbacks since the last change set a floor on the lateness, even if the averages say
+  // packages have mostly been early.
+  int rollbacks, rollback_depth;
+  {
+    MutexLock lock(&publish_mutex_);
+    rollbacks = delay_rollbacks_;
+    rollback_depth = delay_rollback_depth_;
+  }
+  if (rollbacks > 0) {
+    int rollback_lateness = (rollback_depth / rollbacks - 1) * ms_per_state_frame_;
+    if (rollback_lateness > worst_lateness) {
+      worst_lateness = rollback_lateness;
+    }
+  }
+  // Every ms of delay makes every package arrive a ms earlier relative to its timestep.  Aim to
+  // have the latest engine's packages show up half a state frame early.
+  int target = ms_delay_ + worst_lateness + ms_per_state_frame_ / 2;
+  if (target < min_ms_delay_) {
+    target = min_ms_delay_;
+  }
+  if (target > max_ms_delay_) {
+    target = max_ms_delay_;
+  }
+  if (abs(target - ms_delay_) < ms_per_state_frame_) {
     return;
   }
-  // TODO: Should also notice when conncetions are lost so we can remove those Peers
-  vector<GlopNetworkAddress> connections = network_manager_->GetConnections();
-  for (int i = 0; i < connections.size(); i++) {
-    if (!connected_gnas_.count(connections[i])) {
 
-      GameConnection* peer = new PeerConnection(network_manager_, connections[i]);
-      all_connections_.push_back(peer);
+  // Announce the change far enough ahead that it reaches every engine before its timestep, as long
+  // as packages are getting through at all.
+  StateTimestep timestep = current_state_timestep + max_frames_ / 2;
+  DelayChangeEvent* dce = NewDelayChangeEvent();
+  dce->SetData(timestep, target);
+  local_events_.push_back(dce);
+  pending_delay_timestep_ = timestep;
+  pending_ms_delay_ = target;
+}
+
+void GameEngine::ReceiveDelayChange(
+    EngineID engine_id,
+    const DelayChangeEvent& event,
+    StateTimestep current_state_timestep) {
+  // Only the host, engine 0, picks the delay.
+  if (engine_id != 0) {
+    return;
+  }
+  // A change that shows up after its timestep is still made, as soon as we can, so that we don't
+  // stay on the old delay after everybody else has moved on.
+  pending_delay_timestep_ = max(event.timestep(), current_state_timestep + 1);
+  pending_ms_delay_ = max(0, min(ms_per_net_frame_ - 1, event.ms_delay()));
+}
+
+void GameEngine::RecordRollbackDepth(int depth) {
+  stats_.rollback_depth.Add(depth);
+  MutexLock lock(&publish_mutex_);
+  delay_rollbacks_++;
+  delay_rollback_depth_ += depth;
+}
+
+void GameEngine::ApplyPendingDelay(StateTimestep current_state_timestep) {
+  if (pending_delay_timestep_ < 0 || current_state_timestep < pending_delay_timestep_) {
+    return;
+  }
+  if (pending_ms_delay_ != ms_delay_) {
+    ms_delay_ = pending_ms_delay_;
+    num_delay_changes_++;
+  }
+  pending_delay_timestep_ = -1;
+  // Lateness measured under the old delay says nothing about the new one.
+  last_delay_change_ms_ = current_state_timestep * ms_per_state_frame_;
+  arrival_lateness_ms_.clear();
+  MutexLock lock(&publish_mutex_);
+  delay_rollbacks_ = 0;
+  delay_rollback_depth_ = 0;
+}
+
+int GameEngine::RoundTripTime(EngineID engine_id) const {
+  map<EngineID, TimeSyncPeer>::const_iterator it = time_sync_peers_.find(engine_id);
+  if (it == time_sync_peers_.end()) {
+    return -1;
+  }
+  return it->second.rtt_ms;
+}
+
+int GameEngine::NumThinks() const {
+  MutexLock lock(&simulation_mutex_);
+  return num_thinks_;
+}
+
+int GameEngine::NumRethinks() const {
+  MutexLock lock(&simulation_mutex_);
+  return num_rethinks_;
+}
+
+int GameEngine::NumStateAllocations() const {
+  MutexLock lock(&simulation_mutex_);
+  return num_state_allocations_;
+}
+
+int GameEngine::NumSkippedRollbacks() const {
+  MutexLock lock(&simulation_mutex_);
+  return num_skipped_rollbacks_;
+}
+
+int GameEngine::NumHashCutoffs() const {
+  MutexLock lock(&simulation_mutex_);
+  return num_hash_cutoffs_;
+}
+
+int GameEngine::NumDeferredRollbacks() const {
+  MutexLock lock(&simulation_mutex_);
+  return num_deferred_rollbacks_;
+}
+
+int GameEngine::NumHashesCompared() const {
+  MutexLock lock(&simulation_mutex_);
+  return num_hashes_compared_;
+}
+
+int GameEngine::NumDesyncs() const {
+  MutexLock lock(&simulation_mutex_);
+  return num_desyncs_;
+}
+
+StateTimestep GameEngine::DesyncTimestep() const {
+  MutexLock lock(&simulation_mutex_);
+  return desync_timestep_;
+}
+
+StateTimestep GameEngine::EarliestDirtyTimestep() const {
+  MutexLock lock(&simulation_mutex_);
+  return oldest_dirty_timestep_;
+}
+
+int GameEngine::NumPredictedPackages() const {
+  MutexLock lock(&simulation_mutex_);
+  return num_predicted_packages_;
+}
+
+int GameEngine::NumMispredictions() const {
+  MutexLock lock(&simulation_mutex_);
+  return num_mispredictions_;
+}
+
+int GameEngine::NumAdoptedBranchStates() const {
+  MutexLock lock(&simulation_mutex_);
+  return num_adopted_branch_states_;
+}
+
+int GameEngine::NumStoredStates() const {
+  MutexLock lock(&simulation_mutex_);
+  int num_states = spare_states_.size();
+  if (game_states_.size() > 0) {
+    for (StateTimestep t = game_states_.GetFirstIndex(); t <= game_states_.GetLastIndex(); t++) {
+      if (game_states_[t] != NULL) {
+        num_states++;
+      }
+    }
+  }
+  return num_states;
+}
+
+void GameEngine::GetStats(GameEngineStats* stats) {
+  {
+    // Everything the simulation writes comes over in one go so that it is self-consistent.
+    MutexLock lock(&simulation_mutex_);
+    stats->confirmed_frames = stats_.confirmed_frames;
+    stats->speculative_frames = stats_.speculative_frames;
+    stats->rollback_depth = stats_.rollback_depth;
+    stats->recreate_state_us = stats_.recreate_state_us;
+    stats->apply_events_us = stats_.apply_events_us;
+    stats->adopt_branch_state_us = stats_.adopt_branch_state_us;
+    stats->event_types = stats_.event_types;
+    stats->thinks = num_thinks_;
+    stats->rethinks = num_rethinks_;
+    stats->skipped_rollbacks = num_skipped_rollbacks_;
+    stats->hash_cutoffs = num_hash_cutoffs_;
+    stats->predicted_packages = num_predicted_packages_;
+    stats->mispredictions = num_mispredictions_;
+    stats->deferred_rollbacks = num_deferred_rollbacks_;
+    stats->desyncs = num_desyncs_;
+  }
+  stats->time_ms = frame_calculator_->GetTime();
+  stats->stalled_thinks = num_stalled_thinks_;
+  stats->arrival_lateness_ms = stats_.arrival_lateness_ms;
+  stats->connections.clear();
+  for (int i = 0; i < all_connections_.size(); i++) {
+    stats->connections.push_back(all_connections_[i]->GetStats());
+  }
+}
+
+void GameEngine::QueueTimeSync(int time_ms) {
+  if (last_time_sync_ms_ >= 0 && time_ms - last_time_sync_ms_ < ms_per_net_frame_) {
+    return;
+  }
+  last_time_sync_ms_ = time_ms;
+  TimeSyncEvent* tse = NewTimeSyncEvent();
+  tse->SetData(time_ms);
+  map<EngineID, TimeSyncPeer>::iterator it;
+  for (it = time_sync_peers_.begin(); it != time_sync_peers_.end(); it++) {
+    tse->AddEcho(it->first, it->second.time_ms, time_ms - it->second.received_ms);
+  }
+  local_events_.push_back(tse);
+}
+
+void GameEngine::ReceiveTimeSync(EngineID engine_id, const TimeSyncEvent& event, int time_ms) {
+  if (engine_id == engine_id_) {
+    return;
+  }
+  TimeSyncPeer& peer = time_sync_peers_[engine_id];
+  const TimeSyncEventData& data = event.GetData();
+  for (int i = 0; i < data.echoes_size(); i++) {
+    if (data.echoes(i).engine() != engine_id_) {
+      continue;
+    }
+    int rtt = time_ms - data.echoes(i).time_ms() - data.echoes(i).held_ms();
+    if (rtt < 0) {
+      rtt = 0;
+    }
+    peer.rtt_ms = peer.rtt_ms < 0 ? rtt : (peer.rtt_ms * 3 + rtt) / 4;
+  }
+  peer.time_ms = data.time_ms();
+  peer.received_ms = time_ms;
+  if (peer.rtt_ms >= 0) {
+    // The peer's clock has moved on by about half a round trip since it stamped this.
+    peer.advantage_ms = time_ms - (data.time_ms() + peer.rtt_ms / 2);
+  }
+}
+
+void GameEngine::AdjustTime(int time_ms) {
+  int total = 0;
+  int count = 0;
+  map<EngineID, TimeSyncPeer>::iterator it;
+  for (it = time_sync_peers_.begin(); it != time_sync_peers_.end(); it++) {
+    if (it->second.rtt_ms >= 0) {
+      total += it->second.advantage_ms;
+      count++;
+    }
+  }
+  if (count == 0) {
+    time_advantage_ms_ = 0;
+    return;
+  }
+  time_advantage_ms_ = total / count;
+  if (last_think_time_ms_ < 0 || abs(time_advantage_ms_) < ms_per_state_frame_) {
+    return;
+  }
+
+  // Every engine moves halfway, so that they meet in the middle, but the clock never runs at less
+  // than three quarters or more than five quarters of its normal speed.
+  int adjustment = -time_advantage_ms_ / 2;
+  int limit = (time_ms - last_think_time_ms_) / 4;
+  if (adjustment > limit) {
+    adjustment = limit;
+  }
+  if (adjustment < -limit) {
+    adjustment = -limit;
+  }
+  if (adjustment == 0) {
+    return;
+  }
+  frame_calculator_->SetTime(time_ms + adjustment);
+  // Keep everything we remember about our own clock in the new time, so that the adjustment
+  // doesn't show up in how long we held the peers' stamps for, or in how far ahead of them we are.
+  if (last_time_sync_ms_ >= 0) {
+    last_time_sync_ms_ += adjustment;
+  }
+  for (it = time_sync_peers_.begin(); it != time_sync_peers_.end(); it++) {
+    it->second.received_ms += adjustment;
+    it->second.advantage_ms += adjustment;
+  }
+}
+
+void GameEngine::PostEvents(const EventPackageID& id, const vector<GameEvent*>& events) {
+  for (int i = 0; i < events.size(); i++) {
+    if (events[i]->type() == -3 && ((NewEngineEvent*)events[i])->origin() == engine_id_) {
+      // One of our joiners is done with its temporary id.
+      NewEngineEvent* nen = (NewEngineEvent*)events[i];
+      retiring_engine_ids_.push_back(make_pair(id.state_timestep, (EngineID)nen->temporary()));
+    }
+  }
+  if (simulation_thread_ == NULL) {
+    StoreEvents(id.state_timestep, id.engine_id, events);
+    return;
+  }
+  MutexLock lock(&inbox_mutex_);
+  inbox_.push_back(make_pair(id, events));
+}
+
+void GameEngine::StoreEvents(
+    StateTimestep state_timestep,
+    EngineID engine_id,
+    const vector<GameEvent*>& events) {
+  // Check that we haven't already received events on this timestep for this player
+  if (game_events_[state_timestep].HasPackage(engine_id)) {
+    vector<GameEvent*> previous;
+    game_events_[state_timestep].GetEvents(engine_id, &previous);
+    printf("Timestep: %d\n", state_timestep);
+    printf("Engine %d has received a second batch of events from engine %d\n", engine_id_, engine_id);
+    printf("Sizes (prev/cur): %d/%d\n", (int)previous.size(), (int)events.size());
+    // TODO: Maybe this is because of duplicated packets?  Investigate more, we might just be
+    // able to ignore this when it happens to long as we get the same packets each time.
+    assert(!game_events_[state_timestep].HasPackage(engine_id));
+  }
+  for (int i = 0; i < events.size(); i++) {
+    if (events[i]->type() == -4) {
+      StateHashEvent* she = (StateHashEvent*)events[i];
+      CheckStateHash(engine_id, she->timestep(), she->hash());
+    }
+  }
+  bool prediction_matched;
+  bool predicted = ConsumePrediction(state_timestep, engine_id, events, &prediction_matched);
+  if (predicted && prediction_matched && state_timestep < oldest_dirty_timestep_) {
+    // The state was already simulated with exactly these events, although it might be complete
+    // now.
+    CheckBranches(state_timestep, engine_id, events, false);
+    game_events_[state_timestep].SetPackage(engine_id, events);
+    simulation_dirty_ = true;
+    return;
+  }
+  if (state_timestep < oldest_dirty_timestep_) {
+    // CanSkipRollback assumes the state was simulated without anything from engine_id.
+    if (!predicted && CanSkipRollback(state_timestep, events)) {
+      num_skipped_rollbacks_++;
+      CheckBranches(state_timestep, engine_id, events, false);
+    } else if (!CheckBranches(state_timestep, engine_id, events, true)) {
+      oldest_dirty_timestep_ = state_timestep;
+    }
+  } else {
+    CheckBranches(state_timestep, engine_id, events, false);
+  }
+  if (state_timestep > newest_dirty_timestep_ &&
+      state_timestep <= game_engine_infos_.GetLastIndex() &&
+      game_engine_infos_[state_timestep].state_timestep == state_timestep) {
+    newest_dirty_timestep_ = state_timestep;
+  }
+  game_events_[state_timestep].SetPackage(engine_id, events);
+  simulation_dirty_ = true;
+}
+
+void GameEngine::Simulate(StateTimestep current_state_timestep) {
+  ASSERT(game_states_.GetFirstIndex() == game_engine_infos_.GetFirstIndex());
+  ASSERT(game_states_.GetFirstIndex() == game_events_.GetFirstIndex());
+  if (RecreateDirtyStates(current_state_timestep)) {
+    simulation_dirty_ = false;
+
+    // TODO: Consider whether we should skip the if statement, and just make sure we're always
+    // ready to have oldest_dirty_timestep_ updated
+    if (current_state_timestep > oldest_dirty_timestep_) {
+      oldest_dirty_timestep_ = current_state_timestep;
+    }
+    UpdateBranches(current_state_timestep);
+  } else {
+    // The rollback ran out of budget, and the next call picks up where it left off.
+    simulation_dirty_ = true;
+  }
+  // We only go up to delayed_timestep here so that we have a little extra time to get everyone
+  // else's events for the head frame before having to call think on it.  This prevents us from
+  // having to run GameState.Think() more than once on any frame so long as we receive all events
+  // for a frame before delayed_frame = current_frame.
+  head_ = game_states_[current_state_timestep];
+}
+
+class GameEngineSimulationThread : public Thread {
+ public:
+  GameEngineSimulationThread(GameEngine* engine) : engine_(engine) {}
+ protected:
+  virtual void Run() {
+    while (!IsStopRequested()) {
+      if (!engine_->RunSimulationStep()) {
+        system()->Sleep(1);
+      }
+    }
+  }
+ private:
+  GameEngine* engine_;
+};
+
+void GameEngine::EnableAsyncRollback(bool enabled) {
+  async_rollback_ = enabled;
+  if (!enabled) {
+    StopSimulationThread();
+  }
+}
+
+void GameEngine::StartSimulationThread(StateTimestep current_state_timestep) {
+  // Everything up through current_state_timestep has just been simulated on this thread, so the
+  // worker starts from there.
+  simulation_target_ = current_state_timestep;
+  simulated_timestep_ = current_state_timestep;
+  publish_front_ = CopyState(*head_, publish_front_);
+  simulation_thread_ = new GameEngineSimulationThread(this);
+  simulation_thread_->Start();
+}
+
+void GameEngine::StopSimulationThread() {
+  if (simulation_thread_ == NULL) {
+    return;
+  }
+  simulation_thread_->RequestStop();
+  simulation_thread_->Join();
+  delete simulation_thread_;
+  simulation_thread_ = NULL;
+  // Anything left in the inbox gets picked up by the next synchronous Think().
+  DrainInbox();
+}
+
+void GameEngine::DrainInbox() {
+  vector<pair<EventPackageID, vector<GameEvent*> > > packages;
+  {
+    MutexLock lock(&inbox_mutex_);
+    packages.swap(inbox_);
+  }
+  // Think() keeps its clock and the packages it posts inside event_arenas_, which lags behind
+  // game_events_, so nothing should be past the end of the history.  If something is, it waits in
+  // the inbox until the history gets there rather than overwriting a live timestep.
+  vector<pair<EventPackageID, vector<GameEvent*> > > later;
+  for (int i = 0; i < packages.size(); i++) {
+    StateTimestep state_timestep = packages[i].first.state_timestep;
+    if (state_timestep < game_events_.GetFirstIndex()) {
+      // Its timestep is complete already, and its arena may be gone, so don't touch the events.
+      continue;
+    }
+    if (state_timestep > game_events_.GetLastIndex()) {
+      later.push_back(packages[i]);
+      continue;
+    }
+    StoreEvents(state_timestep, packages[i].first.engine_id, packages[i].second);
+  }
+  if (!later.empty()) {
+    MutexLock lock(&inbox_mutex_);
+    inbox_.insert(inbox_.begin(), later.begin(), later.end());
+  }
+}
+
+bool GameEngine::RunSimulationStep() {
+  MutexLock lock(&simulation_mutex_);
+  DrainInbox();
+  StateTimestep target;
+  {
+    MutexLock inbox_lock(&inbox_mutex_);
+    target = simulation_target_;
+  }
+  // Simulate as far as the history reaches, and catch up once another engine's events let it move
+  // on.
+  if (target > game_states_.GetLastIndex()) {
+    target = game_states_.GetLastIndex();
+  }
+  if (!simulation_dirty_ && target <= simulated_timestep_) {
+    return false;
+  }
+  Simulate(target);
+  simulated_timestep_ = target;
+  PublishHead();
+  return true;
+}
+
+void GameEngine::PublishHead() {
+  publish_back_ = CopyState(*head_, publish_back_);
+  MutexLock lock(&publish_mutex_);
+  GameState* swap = publish_ready_;
+  publish_ready_ = publish_back_;
+  publish_back_ = swap;
+  publish_fresh_ = true;
+}
+
+void GameEngine::AcquirePublishedHead() {
+  MutexLock lock(&publish_mutex_);
+  if (publish_fresh_) {
+    GameState* swap = publish_front_;
+    publish_front_ = publish_ready_;
+    publish_ready_ = swap;
+    publish_fresh_ = false;
+  }
+}
+
+void GameEngine::FlushAsyncRollback() {
+  if (simulation_thread_ == NULL) {
+    return;
+  }
+  while (true) {
+    {
+      MutexLock lock(&simulation_mutex_);
+      MutexLock inbox_lock(&inbox_mutex_);
+      // The worker can't get past the end of the history until other engines catch up.
+      StateTimestep target = simulation_target_;
+      if (target > game_states_.GetLastIndex()) {
+        target = game_states_.GetLastIndex();
+      }
+      if (inbox_.empty() && !simulation_dirty_ && simulated_timestep_ >= target) {
+        break;
+      }
+    }
+    system()->Sleep(1);
+  }
+  AcquirePublishedHead();
+}
+
+// A guess that engine_id sends package at every timestep from first_timestep on, and the states
+// that follow from it.  events[i] holds every event for first_timestep + i with the guess filled
+// in, and states[i] and infos[i] are for first_timestep + i - 1, so states[0] is the state the
+// branch starts from.  The worker only reads events and appends to states and infos, with
+// branch_mutex_ held, and everything else is only touched by whichever thread runs the
+// simulation.  While a branch isn't active its worker leaves it alone entirely.  states and
+// spare_states may share CowArray pages with each other but with nothing else, and only the worker
+// copies them, so the simulation thread only ever reads their data through DeepCopyState.
+struct SpeculativeBranch {
+  SpeculativeBranch()
+    : active(false), closed(false), busy(false), engine_id(0), first_timestep(-1), adopted(0) {}
+  bool active;
+  bool closed;  // engine_id's package stopped being the only one missing after the last of events.
+  bool busy;    // The worker is simulating a state.
+  EngineID engine_id;
+  StateTimestep first_timestep;
+  int adopted;  // Number of timesteps from first_timestep on whose real package matched.
+  vector<GameEvent*> package;
+  vector<TimestepEvents> events;
+  vector<GameState*> states;
+  vector<GameEngineInfo> infos;
+  vector<GameState*> spare_states;
+  TimestepEvents worker_events;  // Only touched by the worker.
+};
+
+class GameEngineBranchThread : public Thread {
+ public:
+  GameEngineBranchThread(GameEngine* engine, SpeculativeBranch* branch)
+    : engine_(engine), branch_(branch) {}
+ protected:
+  virtual void Run() {
+    while (!IsStopRequested()) {
+      if (!engine_->RunBranchStep(branch_)) {
+        system()->Sleep(1);
+      }
+    }
+  }
+ private:
+  GameEngine* engine_;
+  SpeculativeBranch* branch_;
+};
+
+// Returns a copy of source, reusing dest if possible.  dest may be NULL.
+static GameState* CopyBranchState(const GameState& source, GameState* dest) {
+  if (dest != NULL) {
+    if (source.CopyInto(dest)) {
+      return dest;
+    }
+    delete dest;
+  }
+  return source.Copy();
+}
+
+void GameEngine::EnableSpeculativeBranches(int num_threads) {
+  MutexLock lock(&simulation_mutex_);
+  StopBranchThreads();
+  for (int i = 0; i < num_threads; i++) {
+    branches_.push_back(new SpeculativeBranch);
+    branch_threads_.push_back(new GameEngineBranchThread(this, branches_.back()));
+    branch_threads_.back()->Start();
+  }
+}
+
+void GameEngine::StopBranchThreads() {
+  for (int i = 0; i < branch_threads_.size(); i++) {
+    branch_threads_[i]->RequestStop();
+    branch_threads_[i]->Join();
+    delete branch_threads_[i];
+  }
+  branch_threads_.clear();
+  for (int i = 0; i < branches_.size(); i++) {
+    CancelBranch(branches_[i]);
+    for (int j = 0; j < branches_[i]->spare_states.size(); j++) {
+      delete branches_[i]->spare_states[j];
+    }
+    delete branches_[i];
+  }
+  branches_.clear();
+}
+
+void GameEngine::FlushSpeculativeBranches() {
+  while (true) {
+    bool done = true;
+    {
+      MutexLock lock(&branch_mutex_);
+      for (int i = 0; i < branches_.size(); i++) {
+        if (branches_[i]->active && branches_[i]->states.size() <= branches_[i]->events.size()) {
+          done = false;
+        }
+      }
+    }
+    if (done) {
+      break;
+    }
+    system()->Sleep(1);
+  }
+}
+
+bool GameEngine::RunBranchStep(SpeculativeBranch* branch) {
+  const GameState* source;
+  GameState* state = NULL;
+  GameEngineInfo info;
+  StateTimestep state_timestep;
+  {
+    MutexLock lock(&branch_mutex_);
+    if (!branch->active) {
+      return false;
+    }
+    int done = branch->states.size() - 1;
+    if (done >= branch->events.size()) {
+      return false;
+    }
+    state_timestep = branch->first_timestep + done;
+    source = branch->states.back();
+    info = branch->infos.back();
+    branch->worker_events = branch->events[done];
+    if (!branch->spare_states.empty()) {
+      state = branch->spare_states.back();
+      branch->spare_states.pop_back();
+    }
+    branch->busy = true;
+  }
+  // Nothing else writes to source, and the events can't go away while we are busy.
+  state = CopyBranchState(*source, state);
+  info.state_timestep = state_timestep;
+  ApplyEventsToGameState(state_timestep, branch->worker_events, state, &info);
+  state->Think();
+
+  MutexLock lock(&branch_mutex_);
+  branch->states.push_back(state);
+  branch->infos.push_back(info);
+  branch->busy = false;
+  return true;
+}
+
+void GameEngine::CancelBranch(SpeculativeBranch* branch) {
+  // The worker is at most one Think() from done.  Sleeping leaves its core to it while we wait.
+  while (true) {
+    {
+      MutexLock lock(&branch_mutex_);
+      branch->active = false;
+      if (!branch->busy) {
+        break;
+      }
+    }
+    system()->Sleep(1);
+  }
+  for (int i = 0; i < branch->states.size(); i++) {
+    branch->spare_states.push_back(branch->states[i]);
+  }
+  branch->states.clear();
+  branch->infos.clear();
+  branch->events.clear();
+  for (int i = 0; i < branch->package.size(); i++) {
+    delete branch->package[i];
+  }
+  branch->package.clear();
+}
+
+void GameEngine::CancelBranches(StateTimestep state_timestep) {
+  for (int i = 0; i < branches_.size(); i++) {
+    SpeculativeBranch* branch = branches_[i];
+    if (branch->active) {
+      int done;
+      {
+        MutexLock lock(&branch_mutex_);
+        done = branch->states.size() - 1;
+      }
+      if (branch->first_timestep + done <= state_timestep) {
+        CancelBranch(branch);
+      }
+    }
+  }
+}
+
+int GameEngine::FindMissingPackage(StateTimestep state_timestep, EngineID* engine_id) {
+  const TimestepEvents& received = game_events_[state_timestep];
+  int num_missing = 0;
+  if (!received.HasPackage(0)) {
+    num_missing++;
+    *engine_id = 0;
+  }
+  const EngineSet& engine_ids = game_engine_infos_[state_timestep].engine_ids;
+  EngineSet::const_iterator it;
+  for (it = engine_ids.begin(); it != engine_ids.end(); it++) {
+    if (*it != 0 && !received.HasPackage(*it)) {
+      num_missing++;
+      *engine_id = *it;
+    }
+  }
+  return num_missing;
+}
+
+void GameEngine::UpdateBranches(StateTimestep current_state_timestep) {
+  if (branches_.empty()) {
+    return;
+  }
+  // Everything up to the latest complete state is certain, and the state after it is missing a
+  // package if we have simulated it.  Branching only pays off if that is one engine's package,
+  // since otherwise there would be too many combinations to guess.
+  StateTimestep first_timestep = latest_complete_state_timestep_ + 1;
+  EngineID engine_id = -1;
+  vector<vector<GameEvent*> > guesses;
+  if (first_timestep <= current_state_timestep &&
+      FindMissingPackage(first_timestep, &engine_id) == 1 &&
+      engine_id != engine_id_) {
+    // Most of the time an engine either does nothing or carries on doing what it did last.
+    guesses.push_back(vector<GameEvent*>());
+    StateTimestep last_timestep = first_timestep - 1;
+    while (last_timestep >= game_events_.GetFirstIndex() &&
+           !game_events_[last_timestep].HasPackage(engine_id)) {
+      last_timestep--;
+    }
+    if (last_timestep >= game_events_.GetFirstIndex()) {
+      vector<GameEvent*> last_events;
+      game_events_[last_timestep].GetEvents(engine_id, &last_events);
+      if (!SameEvents(last_events, guesses[0])) {
+        guesses.push_back(last_events);
+      }
+    }
+    // The history already covers whatever we predicted.
+    map<EngineID, vector<GameEvent*> >::const_iterator it =
+        predicted_events_[first_timestep].find(engine_id);
+    if (it != predicted_events_[first_timestep].end()) {
+      for (int i = 0; i < guesses.size(); i++) {
+        if (SameEvents(guesses[i], it->second)) {
+          guesses.erase(guesses.begin() + i);
+          break;
+        }
+      }
+    }
+  }
+
+  // Branches that are still on one of the guesses carry on, and the rest start over.
+  vector<bool> taken(guesses.size(), false);
+  for (int i = 0; i < branches_.size(); i++) {
+    SpeculativeBranch* branch = branches_[i];
+    if (!branch->active) {
+      continue;
+    }
+    bool keep = false;
+    if (branch->engine_id == engine_id &&
+        branch->first_timestep + branch->adopted == first_timestep) {
+      for (int j = 0; j < guesses.size() && !keep; j++) {
+        if (!taken[j] && SameEvents(branch->package, guesses[j])) {
+          taken[j] = true;
+          keep = true;
+        }
+      }
+    }
+    if (!keep) {
+      CancelBranch(branch);
+    }
+  }
+  int next_guess = 0;
+  for (int i = 0; i < branches_.size(); i++) {
+    SpeculativeBranch* branch = branches_[i];
+    if (branch->active) {
+      continue;
+    }
+    while (next_guess < guesses.size() && taken[next_guess]) {
+      next_guess++;
+    }
+    if (next_guess == guesses.size()) {
+      break;
+    }
+    taken[next_guess] = true;
+    // The worker leaves inactive branches alone, so there is no need to lock yet.
+    branch->closed = false;
+    branch->engine_id = engine_id;
+    branch->first_timestep = first_timestep;
+    branch->adopted = 0;
+    CopyGameEvents(guesses[next_guess], &branch->package);
+    // The spares may still share pages with states the worker copied, so they are left to it.
+    branch->states.push_back(DeepCopyState(*game_states_[first_timestep - 1], NULL));
+    branch->infos.push_back(game_engine_infos_[first_timestep - 1]);
+    MutexLock lock(&branch_mutex_);
+    branch->active = true;
+  }
+
+  // Hand the workers every timestep where the guess is all that is missing.
+  for (int i = 0; i < branches_.size(); i++) {
+    SpeculativeBranch* branch = branches_[i];
+    if (!branch->active || branch->closed) {
+      continue;
+    }
+    for (StateTimestep t = branch->first_timestep + branch->events.size();
+         t <= current_state_timestep;
+         t++) {
+      EngineID missing;
+      if (FindMissingPackage(t, &missing) != 1 || missing != branch->engine_id) {
+        branch->closed = true;
+        break;
+      }
+      TimestepEvents events = game_events_[t];
+      events.SetPackage(branch->engine_id, branch->package);
+      MutexLock lock(&branch_mutex_);
+      branch->events.push_back(events);
+    }
+  }
+}
+
+bool GameEngine::CheckBranches(
+    StateTimestep state_timestep,
+    EngineID engine_id,
+    const vector<GameEvent*>& events,
+    bool rollback) {
+  bool adopted = false;
+  for (int i = 0; i < branches_.size(); i++) {
+    SpeculativeBranch* branch = branches_[i];
+    if (!branch->active || state_timestep >= branch->first_timestep + branch->events.size()) {
+      continue;
+    }
+    if (engine_id == branch->engine_id &&
+        state_timestep == branch->first_timestep + branch->adopted &&
+        SameEvents(branch->package, events)) {
+      // Even if the worker isn't there yet, the branch is still right.
+      if (rollback && !adopted) {
+        adopted = AdoptBranch(branch, state_timestep);
+      }
+      branch->adopted++;
+    } else {
+      CancelBranch(branch);
+    }
+  }
+  return adopted;
+}
+
+bool GameEngine::AdoptBranch(SpeculativeBranch* branch, StateTimestep state_timestep) {
+  // Past oldest_dirty_timestep_ everything is going to be re-simulated anyway.
+  vector<GameState*> states;
+  vector<GameEngineInfo> infos;
+  {
+    MutexLock lock(&branch_mutex_);
+    for (int i = state_timestep - branch->first_timestep + 1;
+         i < branch->states.size() && branch->first_timestep + i - 1 < oldest_dirty_timestep_;
+         i++) {
+      states.push_back(branch->states[i]);
+      infos.push_back(branch->infos[i]);
+    }
+  }
+  if (states.empty()) {
+    return false;
+  }
+  for (int i = 0; i < states.size(); i++) {
+    StateTimestep t = state_timestep + i;
+    int64 start_us = system()->GetTimeMicro();
+    game_states_[t] = DeepCopyState(*states[i], game_states_[t]);
+    stats_.adopt_branch_state_us.Add(system()->GetTimeMicro() - start_us);
+    game_engine_infos_[t] = infos[i];
+    // Later states are now built on the guess, so that is what their real packages get checked
+    // against when they arrive.
+    if (i > 0) {
+      DeletePredictedEvents(t);
+      CopyGameEvents(branch->package, &predicted_events_[t][branch->engine_id]);
+    }
+  }
+  num_adopted_branch_states_ += states.size();
+  oldest_dirty_timestep_ = state_timestep + states.size();
+  return true;
+}
+
+bool GameEngine::RecreateDirtyStates(StateTimestep current_state_timestep) {
+  int rethinks = num_rethinks_;
+  int64 start_us = system()->GetTimeMicro();
+
+  // Nothing past simulated_through has been simulated yet.  A budgeted call still has to
+  // re-simulate more states than the head moves forward by, or a deep rollback would never finish.
+  StateTimestep simulated_through = oldest_dirty_timestep_ - 1;
+  while (simulated_through < current_state_timestep &&
+         game_engine_infos_[simulated_through + 1].state_timestep == simulated_through + 1) {
+    simulated_through++;
+  }
+  int min_resimulated = current_state_timestep - simulated_through + 1;
+  int resimulated = 0;
+
+  for (StateTimestep t = oldest_dirty_timestep_; t <= current_state_timestep; t++) {
+    if (t <= simulated_through && resimulated >= min_resimulated &&
+        ((max_rollback_timesteps_ > 0 && resimulated >= max_rollback_timesteps_) ||
+         (max_rollback_us_ > 0 && system()->GetTimeMicro() - start_us >= max_rollback_us_))) {
+      DeferRollback(t, simulated_through, current_state_timestep);
+      int depth = num_rethinks_ - rethinks;
+      if (depth > 0) {
+        RecordRollbackDepth(depth);
+      }
+      return false;
+    }
+
+    // Past the newest timestep whose events changed, the only thing that can make a previously
+    // simulated state differ is the state it was built from.  So if re-simulating this one gave the
+    // same result as before, everything after it that we already simulated is still correct.  A
+    // matching hash is only a hint, since a collision would leave every later state wrong, so the
+    // old state is kept aside and compared against the new one before we trust it.
+    bool simulated = game_engine_infos_[t].state_timestep == t;
+    uint32 old_hash;
+    bool can_cut_off =
+        t >= newest_dirty_timestep_ && simulated &&
+        game_states_[t] != NULL && game_states_[t]->Hash(&old_hash);
+    EngineSet old_engine_ids;
+    GameState* old_state = NULL;
+    if (can_cut_off) {
+      old_engine_ids = game_engine_infos_[t].engine_ids;
+      old_state = game_states_[t];
+      game_states_[t] = NULL;
+    }
+    RecreateState(t);
+    AdvanceCompleteStates(t);
+    DiscardState(t - 1, current_state_timestep);
+    resimulated++;
+    uint32 new_hash;
+    if (can_cut_off &&
+        game_states_[t]->Hash(&new_hash) &&
+        new_hash == old_hash &&
+        game_engine_infos_[t].engine_ids == old_engine_ids &&
+        t < current_state_timestep &&
+        game_engine_infos_[t + 1].state_timestep == t + 1 &&
+        game_states_[t]->Equals(*old_state)) {
+      num_hash_cutoffs_++;
+      while (t < current_state_timestep && game_engine_infos_[t + 1].state_timestep == t + 1) {
+        t++;
+      }
+    }
+    RecycleState(old_state);
+  }
+  newest_dirty_timestep_ = -1;
+  int depth = num_rethinks_ - rethinks;
+  if (depth > 0) {
+    RecordRollbackDepth(depth);
+  }
+  // Skipped rollbacks can leave older states complete without them being recreated.
+  AdvanceCompleteStates(current_state_timestep);
+  return true;
+}
+
+void GameEngine::DeferRollback(
+    StateTimestep stale_timestep,
+    StateTimestep simulated_through,
+    StateTimestep current_state_timestep) {
+  num_deferred_rollbacks_++;
+  // The head keeps moving, built on top of the stale states, so that there is something sensible
+  // to show until the catch-up reaches it.  Those states are just as stale as the ones they are
+  // built on, and get redone along with them.
+  for (StateTimestep t = simulated_through + 1; t <= current_state_timestep; t++) {
+    RecreateState(t);
+  }
+  oldest_dirty_timestep_ = stale_timestep;
+}
+
+void GameEngine::ThinkLagging() {
+  
+}
+
+GameEngineThinkState GameEngine::Think() {
+  ThinkNetworking();
+  switch (think_state_) {
+    case kIdle:
+    case kGameOver:
+    case kConnectionFailed: {
+      think_state_ = kIdle;
+      break;
+    }
+    case kReady:
+    case kPlaying: {
+      ThinkPlaying();
+      break;
+    }
+    case kLagging: {
+//      ThinkLagging();
+      break;
+    }
+    case kConnecting: {
+      ThinkConnecting();
+      break;
+    }
+    case kJoining: {
+      ThinkJoining();
+      break;
+    }
+  }
+  return think_state_;
+}
+
+
+// NETWORKING SCHTUFF
+void GameEngine::ThinkNetworking() {
+  if (!networking_enabled_) { return; }
+  network_manager_->Think();
+
+  // TODO: This should be in a different function entireyly
+  if (think_state_ != kPlaying) {
+    return;
+  }
+  // TODO: Should also notice when conncetions are lost so we can remove those Peers
+  vector<GlopNetworkAddress> connections = network_manager_->GetConnections();
+  for (int i = 0; i < connections.size(); i++) {
+    if (!connected_gnas_.count(connections[i])) {
+      // A joiner uses up a temporary id now and its real id once it is ready to play, and neither
+      // may run past what an EngineSet can hold.
+      if (NumFreeEngineIDs() < 2) {
+        printf("Refused a connection, the game is out of engine ids\n");
+        network_manager_->Disconnect(connections[i]);
+        connected_gnas_.insert(connections[i]);
+        continue;
+      }
+
+      GameConnection* peer = new PeerConnection(network_manager_, connections[i]);
+      all_connections_.push_back(peer);
       playing_connections_.push_back(peer);
 
+      // The new peer needs a consistent snapshot of our history, so this has to wait for the
+      // simulation thread if there is one.  Joins are rare enough that this is fine.
+      MutexLock lock(&simulation_mutex_);
+      if (simulation_thread_ != NULL) {
+        DrainInbox();
+      }
+
       // We got a new connection, we start by sending them the latest fully-completed game state
-      // that we have
-      GameStateEvent* gse = NewGameStateEvent();
-      string serialized_game_state;
-      // TODO: Consider allowing a constructor for game events that uses a protobuf that the event
-      // takes constrol of, that would prevent one case of copying this data around.
-      game_states_[latest_complete_state_timestep_]->SerializeToString(&serialized_game_state);
-      gse->SetData(
-          serialized_game_state,
-          latest_complete_state_timestep_,
-          game_engine_infos_[latest_complete_state_timestep_].engine_ids,
-          engine_id_,
-          next_game_engine_id_++,
-          max_frames_,
-          ms_per_net_frame_,
-          ms_per_state_frame_,
-          ms_delay_,
-          frame_calculator_->GetTime());
-      peer->QueueEvents(
-          0,
-          EventPackageID(latest_complete_state_timestep_ - 1, engine_id_),
-          vector<GameEvent*>(1, gse));
-      // Send this first, and apart from the events that we send next, because this might be big.
-      peer->SendEvents(0);
+      // that we have.  Serializing and compressing it could take a while for a big state, so that
+      // happens in the background on a copy, and SendPendingJoins streams it out once it's ready.
+      PendingJoin join;
+      join.peer = peer;
+      join.snapshot = CopyState(*game_states_[latest_complete_state_timestep_], NULL);
+      join.transfer = new GameStateTransfer(join.snapshot);
+      join.state_timestep = latest_complete_state_timestep_;
+      join.engine_ids = game_engine_infos_[latest_complete_state_timestep_].engine_ids;
+      join.temporary_engine_id = AllocateEngineID();
+      join.chunk_bytes = 0;
+      pending_joins_.push_back(join);
 
       // Now we have to send any events that we have that happened after that timestep
       // TODO: prolly need to only go up to last_queue_event_timestep_
@@ -473,9 +2162,11 @@ void GameEngine::ThinkNetworking() {
            //(last_send_event_timestep_ * ms_per_net_timestep_) / ms_per_state_timestep_;
            //t <= game_events_.GetLastIndex();
            t++) {
-        map<EngineID, vector<GameEvent*> >::iterator it;
-        for (it = game_events_[t].begin(); it != game_events_[t].end(); it++) {
-          peer->QueueEvents(0, EventPackageID(t, it->first), it->second);
+        const TimestepEvents& events = game_events_[t];
+        for (int j = 0; j < events.NumPackages(); j++) {
+          vector<GameEvent*> package;
+          events.GetEvents(events.GetPackage(j).engine_id, &package);
+          peer->QueueEvents(0, EventPackageID(t, events.GetPackage(j).engine_id), package);
         }
       }
       // TODO: Consider whether or not these should all be sent as one packet, it could be big.
@@ -484,6 +2175,63 @@ void GameEngine::ThinkNetworking() {
       connected_gnas_.insert(connections[i]);
     }
   }
+  SendPendingJoins();
+}
+
+void GameEngine::SendPendingJoins() {
+  for (int i = 0; i < pending_joins_.size(); i++) {
+    PendingJoin& join = pending_joins_[i];
+    if (!join.transfer->IsReady()) {
+      continue;
+    }
+    if (join.chunk_bytes == 0) {
+      // The peer can only buffer events for max_frames_ timesteps past the snapshot, so make sure
+      // the state gets there well before then even if it is huge.
+      join.chunk_bytes = join.transfer->compressed_size() / (max_frames_ / 2 + 1) + 1;
+      if (join.chunk_bytes < kStateChunkBytes) {
+        join.chunk_bytes = kStateChunkBytes;
+      }
+      // The snapshot may share data with states the simulation thread is working on.
+      MutexLock lock(&simulation_mutex_);
+      RecycleState(join.snapshot);
+      join.snapshot = NULL;
+    }
+
+    // Everything about the state goes out with the same EventPackageID, ahead of the events that
+    // came after it.  The GameStateEvent goes last, so once the peer has it it has every chunk.
+    EventPackageID id(join.state_timestep - 1, engine_id_);
+    string chunk;
+    if (join.transfer->NextChunk(join.chunk_bytes, &chunk)) {
+      GameStateChunkEvent* gsce = NewGameStateChunkEvent();
+      gsce->SetData(chunk);
+      join.peer->QueueEvents(0, id, vector<GameEvent*>(1, gsce));
+      delete gsce;
+    }
+    if (join.transfer->IsFinished()) {
+      GameStateEvent* gse = NewGameStateEvent();
+      gse->SetData(
+          "",
+          join.state_timestep,
+          join.engine_ids,
+          engine_id_,
+          join.temporary_engine_id,
+          max_frames_,
+          ms_per_net_frame_,
+          ms_per_state_frame_,
+          ms_delay_,
+          frame_calculator_->GetTime());
+      gse->SetStreamedState(join.transfer->compressed_size(), join.transfer->raw_size());
+      join.peer->QueueEvents(0, id, vector<GameEvent*>(1, gse));
+      delete gse;
+    }
+    join.peer->SendEvents(0);
+
+    if (join.transfer->IsFinished()) {
+      delete join.transfer;
+      pending_joins_.erase(pending_joins_.begin() + i);
+      i--;
+    }
+  }
 }
 
 bool GameEngine::StartNetworkManager(int port) {
@@ -544,6 +2292,7 @@ void GameEngine::ThinkConnecting() {
       all_connections_.push_back(peer);
       playing_connections_.push_back(peer);
       game_event_buffer_.clear();  // Just in case.
+      joining_state_data_.clear();
       return;
     }
   }
@@ -557,6 +2306,13 @@ void GameEngine::ThinkJoining() {
   all_connections_[0]->ReceiveEvents(&events);
   GameStateEvent* gse = NULL;
   for (int i = 0; i < events.size(); i++) {
+    // Pieces of the GameState all share an EventPackageID, so they are collected here rather than
+    // in the buffer.
+    if (events[i].second.size() == 1 && events[i].second[0]->type() == -5) {
+      joining_state_data_ += ((GameStateChunkEvent*)events[i].second[0])->data();
+      delete events[i].second[0];
+      continue;
+    }
     game_event_buffer_[events[i].first.state_timestep][events[i].first.engine_id] =
         events[i].second;
     for (int j = 0; j < events[i].second.size(); j++) {
@@ -568,6 +2324,18 @@ void GameEngine::ThinkJoining() {
   int mark = 0;
   if (gse != NULL) {
     const GameStateEventData& data = gse->GetData();
+    string streamed_state;
+    if (data.has_compressed_size()) {
+      if (joining_state_data_.size() != data.compressed_size() ||
+          !GameStateTransfer::Decompress(joining_state_data_, data.raw_size(), &streamed_state)) {
+        printf("Received a corrupt GameState of %d bytes\n", (int)joining_state_data_.size());
+        ClearGameEventBuffer(game_event_buffer_.rbegin()->first);
+        joining_state_data_.clear();
+        think_state_ = kConnectionFailed;
+        return;
+      }
+      joining_state_data_.clear();
+    }
     source_engine_id_ = data.source_engine_id();
 
 //    typed_data_->set_max_frames(max_frames);
@@ -579,47 +2347,79 @@ void GameEngine::ThinkJoining() {
     ms_per_state_frame_ = data.ms_per_state_frame();
     ms_delay_ = data.ms_delay();
 
+    if (game_states_.size() > 0) {
+      for (StateTimestep t = game_states_.GetFirstIndex(); t <= game_states_.GetLastIndex(); t++) {
+        RecycleState(game_states_[t]);
+      }
+    }
     game_states_ = MovingWindow<GameState*>(max_frames_ + 1, data.timestep());
     game_engine_infos_ = MovingWindow<GameEngineInfo>(max_frames_ + 1, data.timestep());
-    game_events_ =
+    game_events_ = MovingWindow<TimestepEvents>(max_frames_ * 2 + 1, data.timestep());
+    predicted_events_ =
         MovingWindow<map<EngineID, vector<GameEvent*> > >(max_frames_ * 2 + 1, data.timestep());
+    event_arenas_.Reset(max_frames_ * 2 + 1, data.timestep());
+    {
+      MutexLock lock(&publish_mutex_);
+      retired_event_timestep_ = data.timestep() - 1;
+    }
 
       // TODO: Templatize the class on GameState type so that we're not required to supply a sample GameState object as a reference state.
-    game_states_[data.timestep()] = reference_state_->Copy();
-    game_states_[data.timestep()]->ParseFromString(data.game_state());
+    game_states_[data.timestep()] = CopyState(*reference_state_, NULL);
+    game_states_[data.timestep()]->ParseFromString(
+        data.has_compressed_size() ? streamed_state : data.game_state());
 
     // TODO: VERY IMPORTANT: Right now we're assuming that we can get the whole gamestate event
     // within max_frames_, but this can't be something we rely on in practice.
     for (int i = 0; i < data.engine_ids_size(); i++) {
-      game_events_[data.timestep()][data.engine_ids(i)].clear();
+      game_events_[data.timestep()].SetPackage(data.engine_ids(i), vector<GameEvent*>());
       game_engine_infos_[data.timestep()].engine_ids.insert(data.engine_ids(i));
       game_engine_infos_[data.timestep()].state_timestep = data.timestep();
     }
+    {
+      MutexLock lock(&publish_mutex_);
+      complete_engine_ids_ = game_engine_infos_[data.timestep()].engine_ids;
+    }
 
     engine_id_ = gse->GetData().temporary_engine_id();
 
+    // The host may have announced a delay change while the GameState was on its way, even in a
+    // package from before the snapshot.
     map<StateTimestep, map<EngineID, vector<GameEvent*> > >::iterator it;
+    for (it = game_event_buffer_.begin(); it != game_event_buffer_.end(); it++) {
+      map<EngineID, vector<GameEvent*> >::iterator host = it->second.find(0);
+      if (host == it->second.end()) { continue; }
+      for (int j = 0; j < host->second.size(); j++) {
+        if (host->second[j]->type() == -7) {
+          ReceiveDelayChange(0, *(DelayChangeEvent*)host->second[j], data.timestep());
+        }
+      }
+    }
     for (it = game_event_buffer_.begin(); it != game_event_buffer_.end(); it++) {
       map<EngineID, vector<GameEvent*> >::iterator xit;
       if (it->first <= data.timestep()) { continue; }
       for (xit = it->second.begin(); xit != it->second.end(); xit++) {
-        game_events_[it->first][xit->first] = xit->second;
+        if (it->first > event_arenas_.GetLastIndex()) {
+          // The game went on for longer than our history reaches while the GameState was on its
+          // way, so these wait until the history catches up, like packages that arrive ahead of it
+          // while we are playing.
+          held_packages_.push_back(make_pair(EventPackageID(it->first, xit->first), xit->second));
+          continue;
+        }
+        game_events_[it->first].SetPackage(xit->first, xit->second);
+        event_arenas_.Adopt(it->first, xit->second);
       }
     }
-    it = game_event_buffer_.end();
-    it--;
 
     int complete = game_states_.GetFirstIndex();
-    if (it->first - complete > max_frames_) {
-      printf("WE ARE IN BIIIIIG TROUBLE\n");
-    }
     ReadyToPlayEvent* r2p = NewReadyToPlayEvent();
     r2p->SetData(source_engine_id_, engine_id_);
+    // Our temporary id is unique and in range, unlike -1, which the connections won't carry.
     all_connections_[0]->QueueEvents(
         0,
-        EventPackageID(complete, (unsigned int)-1),
+        EventPackageID(complete, engine_id_),
         vector<GameEvent*>(1, r2p));
     all_connections_[0]->SendEvents(0);
+    delete r2p;
 
     latest_complete_state_timestep_ = complete;
 
@@ -632,6 +2432,24 @@ void GameEngine::ThinkJoining() {
 
     think_state_ = kReady;
     last_queue_event_timestep_ = -1;
+
+    // Everything that made it into game_events_ now belongs to event_arenas_, everything past it
+    // to held_packages_, and the rest, including the GameStateEvent, is no longer needed.
+    ClearGameEventBuffer(data.timestep());
+  }
+}
+
+void GameEngine::ClearGameEventBuffer(StateTimestep last_timestep) {
+  map<StateTimestep, map<EngineID, vector<GameEvent*> > >::iterator it;
+  for (it = game_event_buffer_.begin(); it != game_event_buffer_.end(); it++) {
+    if (it->first > last_timestep) { continue; }
+    map<EngineID, vector<GameEvent*> >::iterator xit;
+    for (xit = it->second.begin(); xit != it->second.end(); xit++) {
+      for (int i = 0; i < xit->second.size(); i++) {
+        delete xit->second[i];
+      }
+    }
   }
+  game_event_buffer_.clear();
 }
 
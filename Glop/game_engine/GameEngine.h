@@ -7,12 +7,19 @@
 using namespace std;
 
 #include "P2PNG.h"
+#include "EngineSet.h"
 #include "MovingWindow.h"
 #include "GameEvent.h"
+#include "GameEventArena.h"
+#include "GameEventPredictor.h"
 #include "GameState.h"
 #include "GameConnection.h"
+#include "GameEngineStats.h"
+#include "GameStateTransfer.h"
+#include "TimestepEvents.h"
 #include "GameProtos.pb.h"
 #include "../List.h"
+#include "../Thread.h"
 #include "../net/NetworkManager.h"
 
 // CORNER CASES: This is a list of problematic situations, all of which will need to be dealt with
@@ -32,14 +39,22 @@ using namespace std;
 
 class GameConnection;
 class GameState;
+class GameEngineSimulationThread;
+class GameEngineBranchThread;
+struct SpeculativeBranch;
+class TimeSyncEvent;
+class DelayChangeEvent;
+class GameReplayWriter;
+class GameSpectatorServer;
 
 /// This struct maintains important information about the GameEngine that could change from frame to
-/// frame.
+/// frame.  It is copied from each timestep to the next whenever a state is simulated, so it is kept
+/// trivially copyable.
 struct GameEngineInfo {
   GameEngineInfo() : state_timestep(-1) { }
 
   /// set of the IDs of all engines currently in the game
-  set<EngineID> engine_ids;
+  EngineSet engine_ids;
 
   /// timestep of this frame (possibly not needed since its in a MovingWindow?)
   StateTimestep state_timestep;
@@ -85,15 +100,182 @@ class GameEngine {
   ~GameEngine();
 
   // Stats
-  int NumThinks() const { return num_thinks_; }
-  int NumRethinks() const { return num_rethinks_; }
-  StateTimestep EarliestDirtyTimestep() const { return oldest_dirty_timestep_; }
+  // The async worker updates most of these, so they all wait for it to finish its current step.
+  int NumThinks() const;
+  int NumRethinks() const;
+  /// Number of GameStates that have been heap-allocated through GameState::Copy().  Once the
+  /// history window is full this stays constant for states that support GameState::CopyInto().
+  int NumStateAllocations() const;
+  /// Number of late event batches that did not require a backtrack because they provably did not
+  /// change the state they arrived for.
+  int NumSkippedRollbacks() const;
+  /// Number of backtracks that stopped early because a re-simulated state hashed the same as it
+  /// did before and GameState::Equals() confirmed it, so the rest of the history was still valid.
+  int NumHashCutoffs() const;
+  /// Number of Thinks that held the clock back because another engine had fallen so far behind
+  /// that the history could not hold everything since its last package.
+  int NumStalledThinks() const { return num_stalled_thinks_; }
+  /// Number of Thinks that ran out of rollback budget and left the rest of a rollback for later.
+  int NumDeferredRollbacks() const;
+  /// Number of GameStates currently held, in the history or waiting to be reused.  This is what
+  /// SetSnapshotInterval() trades against re-simulation.
+  int NumStoredStates() const;
+  /// Fills in a snapshot of everything above along with timing histograms, per-engine arrival
+  /// times and per-connection traffic.  This is cheap enough to poll every frame, and is safe to
+  /// call while an async rollback is running, but only from the thread that calls Think().
+  void GetStats(GameEngineStats* stats);
+  /// Turns on timing every game event the simulation applies, for GameEngineStats::event_types.
+  /// That is two clock reads per event, so it is off by default.
+  void EnableEventTiming(bool enabled) { event_timing_ = enabled; }
+
+  /// Turns on piggybacking of GameState::Hash() checksums for completed timesteps onto outgoing
+  /// event packages, and checking the checksums received from other engines against our own.
+  /// Every engine in the game should enable this for it to be useful.
+  void EnableDesyncDetection(bool enabled) { desync_detection_ = enabled; }
+  /// Number of checksums received from other engines that have been compared against our own.
+  int NumHashesCompared() const;
+  /// Number of checksums received from other engines that did not match our own.
+  int NumDesyncs() const;
+  /// The earliest StateTimestep at which a desync has been detected, or -1 if there have been none.
+  StateTimestep DesyncTimestep() const;
+  StateTimestep EarliestDirtyTimestep() const;
+
+  /// Installs a predictor that guesses the events of other engines for timesteps that have to be
+  /// simulated before their events arrive, instead of simulating those timesteps as if the other
+  /// engines did nothing.  States built on a prediction are speculative until the real events
+  /// arrive, and are only rolled back if the real events differ from the prediction.  The engine
+  /// takes ownership of the predictor.  Prediction is off by default, and NULL turns it off again.
+  void InstallEventPredictor(GameEventPredictor* predictor);
+  /// Number of packages that have been predicted, including ones predicted again on a rollback.
+  int NumPredictedPackages() const;
+  /// Number of predictions that turned out to be wrong when the real events arrived.
+  int NumMispredictions() const;
+
+  /// Starts num_threads worker threads that pre-simulate likely alternatives while we wait for
+  /// another engine's events.  When exactly one engine's package is holding up the history, each
+  /// worker takes one guess at what that engine is doing and simulates it from the last state we
+  /// are sure of: either it sends nothing, or it keeps sending the game events of its last
+  /// package.  Guesses that are the same as what the engine is already predicting are skipped, so
+  /// more than two threads never help.  When the real package matches a guess, the worker's states
+  /// are copied into the history instead of re-simulating them one by one.  That copy goes through
+  /// GameState::SerializeToString, so for large states it is worth checking that
+  /// GameEngineStats::adopt_branch_state_us is below recreate_state_us.  GameStates and GameEvents
+  /// must not share mutable data with anything outside of the engine for this to be safe.  0 turns
+  /// it off, which is the default.
+  void EnableSpeculativeBranches(int num_threads);
+  /// Blocks until every worker has simulated everything it has been given so far.  This is mostly
+  /// useful for tests.
+  void FlushSpeculativeBranches();
+  /// Number of states that were taken from a speculative branch instead of being re-simulated.
+  int NumAdoptedBranchStates() const;
+
+  /// Caps how much re-simulation a single Think() does when late events force a deep rollback.
+  /// Once max_timesteps states have been re-simulated, or max_us microseconds have passed, the
+  /// rest of the rollback is spread over the following Thinks.  Until it catches up, the head is
+  /// simulated on top of the stale states, so GetCurrentGameState() keeps moving but may be
+  /// briefly wrong.  Complete states are never built on stale ones, so this doesn't affect what
+  /// other engines, replays or spectators see.  Every Think still catches up by at least one more
+  /// timestep than the head moves forward by, however small the budget.  0 means no limit, which
+  /// is the default.
+  void SetRollbackBudget(int max_timesteps, int64 max_us) {
+    max_rollback_timesteps_ = max_timesteps;
+    max_rollback_us_ = max_us;
+  }
+
+  /// Only keeps every interval-th speculative state, plus the head and the state before it, instead
+  /// of every state in the history.  The events are all kept, so a state that was dropped is
+  /// rebuilt when needed by re-simulating from the nearest state before it that was kept.  This
+  /// saves a lot of memory for large GameStates and long histories, at the cost of that extra
+  /// re-simulation on a rollback, which is not counted against the rollback budget.  Complete
+  /// states are always kept, so replays, spectators and joining engines are unaffected.  1 keeps
+  /// every state, which is the default.
+  void SetSnapshotInterval(int interval) {
+    ASSERT(interval >= 1);
+    snapshot_interval_ = interval;
+  }
 
-  /// Returns the most accurate GameState object for the current timestep.  This will block until
-  /// all pending GameEvents have been applied to the GameState history.
+  /// Makes this engine a relay for the engines connected to it.  Engines always connect to the
+  /// host, so the host already receives every package once and passes it on to everybody else, but
+  /// normally it forwards each package the moment it arrives, in a message of its own.  A relay
+  /// holds on to them until its own next package, at most one state frame later, and sends them all
+  /// in one message, so each client uploads its own stream once and downloads one merged stream of
+  /// everybody else's.  Only the host needs this.  A dedicated relay process is just a host that
+  /// never applies any events of its own.
+  void EnableRelay(bool enabled) { relay_ = enabled; }
+
+  /// Keeps this engine's clock in step with the other engines.  Engines stamp their outgoing
+  /// packages with their game time about once per net frame, and echo back the stamps they have
+  /// received, which gives every engine a round trip time and an estimate of how far ahead of each
+  /// other engine it is running.  An engine that is ahead slows its clock down and one that is
+  /// behind speeds it up, by at most a quarter of the real time that passes, until they meet in the
+  /// middle.  The engine that runs ahead is the one that makes everybody else roll back, so every
+  /// engine in the game should enable this.
+  void EnableTimeSync(bool enabled) { time_sync_ = enabled; }
+  /// Average number of ms that this engine's clock is ahead of the other engines', as of the last
+  /// Think().  Negative if it is behind.
+  int TimeAdvantage() const { return time_advantage_ms_; }
+  /// Smoothed round trip time to another engine in ms, or -1 if it isn't known yet.
+  int RoundTripTime(EngineID engine_id) const;
+
+  /// Lets the host tune ms_delay between min_ms_delay and max_ms_delay while the game runs.  The
+  /// host watches how late each engine's packages arrive compared to when it simulated their
+  /// timestep, and how deep the rollbacks they cause are, and picks the smallest delay that would
+  /// have gotten them there in time.  Changes are announced with a DelayChangeEvent that
+  /// names a timestep far enough in the future for every engine to hear about it first, and every
+  /// engine switches at that timestep.  Other engines always follow the host's announcements, so
+  /// this only needs to be enabled on the host.  max_ms_delay must be less than ms_per_net_frame.
+  void EnableAdaptiveDelay(bool enabled, int min_ms_delay, int max_ms_delay);
+  /// Number of times this engine's ms_delay has changed.
+  int NumDelayChanges() const { return num_delay_changes_; }
+
+  /// Starts recording a replay of the game to filename, which a GameReplayRunner can play back
+  /// without any networking.  The replay starts from the latest complete state, and gets the events
+  /// of every timestep as it becomes complete, with a keyframe of the state every
+  /// keyframe_interval timesteps, or none if it is 0.  Returns false if the file could not be
+  /// created or the engine has no complete state yet.  Any previous recording is stopped first.
+  bool StartRecording(const string& filename, int keyframe_interval);
+  /// Stops recording and closes the replay file.
+  void StopRecording();
+
+  /// Streams every timestep to server as it becomes complete, starting from the latest complete
+  /// state, so that spectators can watch the game (see GameSpectator.h).  Spectators only ever see
+  /// complete timesteps, so this costs the other engines nothing.  The server isn't owned by the
+  /// engine, and must be detached by passing NULL before it is deleted.  Returns false if the
+  /// engine has no complete state yet.
+  bool AttachSpectatorServer(GameSpectatorServer* server);
+
+  /// Applies a batch of events to a GameState in the appropriate order for that timestep.  This is
+  /// public so that replays can be simulated exactly the same way that the engine does it.
+  /// If stats is not NULL, each game event is counted in its event_types, and if time_events is
+  /// also true, the time spent applying it is added there too.
+  static void ApplyEventsToGameState(
+      int think_count,
+      const TimestepEvents& events,
+      GameState* game_state,
+      GameEngineInfo* game_engine_info,
+      GameEngineStats* stats = NULL,
+      bool time_events = false);
+
+  /// Moves re-simulation of the GameState history onto a worker thread, so that a deep backtrack
+  /// never stalls Think().  Think() just hands new events and the current timestep to the worker,
+  /// and GetCurrentGameState() returns a copy of the newest head state that the worker has
+  /// published.  The worker starts once the engine is playing.  GameStates and GameEvents must not
+  /// share mutable data with anything outside of the engine for this to be safe.
+  void EnableAsyncRollback(bool enabled);
+
+  /// Blocks until the worker thread has applied every event and simulated up to the timestep of
+  /// the last Think(), and makes the result visible to GetCurrentGameState().  Does nothing unless
+  /// async rollback is running.  This is mostly useful for tests.
+  void FlushAsyncRollback();
+
+  /// Returns the most accurate GameState object for the current timestep.  With async rollback
+  /// this is the newest head state published by the worker thread as of the last call to Think(),
+  /// and it remains valid until the next call to Think().
   const GameState& GetCurrentGameState();
 
-  /// Returns the most recent GameState object that is completely accurate.
+  /// Returns the most recent GameState object that is completely accurate.  With async rollback
+  /// this waits for the worker thread to finish everything it was given by the last Think(), like
+  /// FlushAsyncRollback(), and the state remains valid until the next call to Think().
   const GameState& GetCompleteGameState();
 
   const GameState& GetSpecificGameState(NetTimestep);
@@ -105,7 +287,8 @@ class GameEngine {
   NetTimestep GetCurrentNetTimestep();
 
   /// Applies an event to the current GameState, and packages it to be sent out when appropriate to
-  /// other GameEngines.
+  /// other GameEngines.  The engine takes ownership of the event, and deletes it once its timestep
+  /// has fallen out of the history.
   void ApplyEvent(GameEvent* event);
   void ApplyEvents(const vector<GameEvent*>& events);
 
@@ -149,12 +332,15 @@ class GameEngine {
   void Connect(GlopNetworkAddress gna, const string& message);
 
   // Accessors
+  EngineID engine_id() const { return engine_id_; }
   int ms_per_net_frame() const { return ms_per_net_frame_; }
   int ms_per_state_frame() const { return ms_per_state_frame_; }
   int ms_delay() const { return ms_delay_; }
 
  private:
   friend class GameEvent;
+  friend class GameEngineSimulationThread;
+  friend class GameEngineBranchThread;
 
   // Sub-Think methods
   void ThinkPlaying();
@@ -163,25 +349,163 @@ class GameEngine {
   void ThinkJoining();
   void ThinkNetworking();
 
+  // Streams the next chunk of each compressed join snapshot that is ready to its new peer, and
+  // finishes off any join whose snapshot has been sent completely.
+  void SendPendingJoins();
+
+  // Deletes every event in game_event_buffer_ at or before last_timestep and empties it.  The rest
+  // must already belong to someone else.
+  void ClearGameEventBuffer(StateTimestep last_timestep);
+
   void QueueEvents(StateTimestep state_timestep);
 
+  // Hands a package of events over to the simulation, either directly or through the worker
+  // thread's inbox.
+  void PostEvents(const EventPackageID& id, const vector<GameEvent*>& events);
+
+  // Adds a package of events to game_events_ and updates the dirty timesteps accordingly.
+  void StoreEvents(
+      StateTimestep state_timestep,
+      EngineID engine_id,
+      const vector<GameEvent*>& events);
+
+  // Brings the GameState history up to date with every event stored so far, through
+  // current_state_timestep, and updates head_.
+  void Simulate(StateTimestep current_state_timestep);
+
+  // Async rollback helpers.  Everything that touches the GameState history while the worker thread
+  // is running must hold simulation_mutex_.
+  void StartSimulationThread(StateTimestep current_state_timestep);
+  void StopSimulationThread();
+  void DrainInbox();
+  bool RunSimulationStep();  // Returns false if there was nothing to do.
+  void PublishHead();
+  void AcquirePublishedHead();
+  // Clears the event arenas of every timestep the simulation has retired.
+  void RetireEventArenas();
+  // The last timestep that the history reaches, as far as the thread that calls Think() can tell.
+  StateTimestep GetLastStateTimestep();
+  // Posts every package in held_packages_ that event_arenas_ has reached.
+  void PostHeldPackages();
+
+  // Returns an unused EngineID, or -1 if all kMaxEngineIDs of them are in use.
+  EngineID AllocateEngineID();
+  int NumFreeEngineIDs();
+  // Moves the ids in retiring_engine_ids_ whose timestep has left the history to free_engine_ids_.
+  void ReleaseRetiredEngineIDs();
+
   void SendEvents(NetTimestep net_timestep);
 
   void RecreateState(StateTimestep state_timestep);
+  // Rebuilds the state at state_timestep, which was dropped by DiscardState, from the nearest
+  // state before it that was kept.  Every state up to there must be up to date with our events.
+  void RestoreState(StateTimestep state_timestep);
+  // Drops the state at state_timestep from game_states_ unless it is one we keep with the current
+  // snapshot interval.
+  void DiscardState(StateTimestep state_timestep, StateTimestep current_state_timestep);
+
+  // Returns a copy of source, reusing dest or a recycled state if possible.  dest may be NULL.
+  GameState* CopyState(const GameState& source, GameState* dest);
+
+  // Like CopyState, but goes through SerializeToString so the copy shares nothing with source, such
+  // as CowArray pages.  Branch states are copied by their worker, and CowArray's reference counts
+  // are not thread-safe, so this is the only way states cross into or out of a branch.
+  GameState* DeepCopyState(const GameState& source, GameState* dest);
+
+  // Hands a state that is no longer referenced by game_states_ back to the pool.
+  void RecycleState(GameState* state);
+
+  // Moves all of the MovingWindows forward by one timestep.
+  void AdvanceWindows();
 
   bool IsStateComplete(StateTimestep state_timestep);
 
+  // Moves latest_complete_state_timestep_ forward over every state up to and including
+  // last_fresh_timestep that is now complete, advancing the history windows as it goes.  All states
+  // up to last_fresh_timestep must be up to date with the events we currently have.
+  void AdvanceCompleteStates(StateTimestep last_fresh_timestep);
+
+  // Returns true iff adding the package events to the already-simulated timestep state_timestep
+  // cannot change the resulting state, so that no backtrack is needed.
+  bool CanSkipRollback(StateTimestep state_timestep, const vector<GameEvent*>& events);
+
+  // Replaces the predicted events for state_timestep with fresh predictions for every engine whose
+  // events have not arrived yet.
+  void PredictMissingEvents(StateTimestep state_timestep);
+  void DeletePredictedEvents(StateTimestep state_timestep);
+
+  // Returns true iff the state at state_timestep was last simulated with a prediction for
+  // engine_id, and sets matched to whether events are the same as what was predicted.  The
+  // prediction is discarded, since events replace it.
+  bool ConsumePrediction(
+      StateTimestep state_timestep,
+      EngineID engine_id,
+      const vector<GameEvent*>& events,
+      bool* matched);
+
+  // Re-simulates every dirty timestep up to and including current_state_timestep.  Returns false
+  // if it ran out of rollback budget first, in which case oldest_dirty_timestep_ is where it
+  // stopped.
+  bool RecreateDirtyStates(StateTimestep current_state_timestep);
+  // Simulates the never-simulated states after simulated_through on top of the stale ones, and
+  // leaves everything from stale_timestep on for the next call.
+  void DeferRollback(
+      StateTimestep stale_timestep,
+      StateTimestep simulated_through,
+      StateTimestep current_state_timestep);
+
+  // Speculative branches.  UpdateBranches starts, keeps or drops branches once everything up to
+  // current_state_timestep has been simulated, and hands the workers any new timesteps.
+  // CheckBranches is called with every package that arrives, drops the branches it proves wrong,
+  // and returns true iff it replaced the states from state_timestep on with a branch's, which it
+  // only does if rollback is set.  CancelBranch waits for the branch's worker to finish the state
+  // it is on, so that the events and states it uses can go away.  AdoptBranch copies the branch's
+  // states from state_timestep on into the history, and returns false if the worker has not got
+  // that far yet.
+  void UpdateBranches(StateTimestep current_state_timestep);
+  bool CheckBranches(
+      StateTimestep state_timestep,
+      EngineID engine_id,
+      const vector<GameEvent*>& events,
+      bool rollback);
+  bool AdoptBranch(SpeculativeBranch* branch, StateTimestep state_timestep);
+  void CancelBranch(SpeculativeBranch* branch);
+  // Cancels every branch whose worker might still need the events for state_timestep.
+  void CancelBranches(StateTimestep state_timestep);
+  // Returns the number of engines whose package for state_timestep is missing, and sets engine_id
+  // to one of them.
+  int FindMissingPackage(StateTimestep state_timestep, EngineID* engine_id);
+  bool RunBranchStep(SpeculativeBranch* branch);  // Returns false if there was nothing to do.
+  void StopBranchThreads();
+
+  // Time sync helpers.  QueueTimeSync adds a TimeSyncEvent to local_events_ if one is due,
+  // ReceiveTimeSync handles one that arrived from another engine, and AdjustTime moves our clock
+  // towards everyone else's.
+  void QueueTimeSync(int time_ms);
+  void ReceiveTimeSync(EngineID engine_id, const TimeSyncEvent& event, int time_ms);
+  void AdjustTime(int time_ms);
+
+  // Adaptive delay helpers.  AdaptDelay is called by the host after every batch of packages has
+  // been received, ReceiveDelayChange when an announcement arrives, and ApplyPendingDelay switches
+  // to an announced delay once its timestep comes.  RecordRollbackDepth is how the simulation
+  // reports its rollbacks, which AdaptDelay takes into account along with the arrival times.
+  void AdaptDelay(int time_ms, StateTimestep current_state_timestep);
+  void ReceiveDelayChange(
+      EngineID engine_id,
+      const DelayChangeEvent& event,
+      StateTimestep current_state_timestep);
+  void RecordRollbackDepth(int depth);
+  void ApplyPendingDelay(StateTimestep current_state_timestep);
+
+  // Desync detection helpers.  RecordStateHash is called when a timestep becomes complete,
+  // CheckStateHash when a checksum for a timestep arrives from another engine.
+  void RecordStateHash(StateTimestep state_timestep);
+  void CheckStateHash(EngineID engine_id, StateTimestep state_timestep, uint32 hash);
+
   StateTimestep GetCurrentDelayedStateTimestep(int time_ms);
 
   void AdvanceAsFarAsPossible(NetTimestep current_timestep, NetTimestep delayed_timestep);
 
-  // Helper method that applies a batch of events to a GameState in the appropriate order for that
-  // timestep.
-  void ApplyEventsToGameState(
-      int think_count,
-      const map<EngineID, vector<GameEvent*> >& events,
-      GameState* game_state,
-      GameEngineInfo* game_engine_info);
 //  void ApplyEventsToGameState(
 //      NetTimestep timestep,
 //      map<EngineID, vector<GameEvent*> > events,
@@ -195,6 +519,11 @@ class GameEngine {
   // join.  In the case of non-hosts, this value will be used to distinguish between different
   // engines until they have joined and received a unique EngineID from the host.
   EngineID next_game_engine_id_;
+  // Ids below next_game_engine_id_ that can be handed out again.  A temporary id goes in here once
+  // the NewEngineEvent that replaced it has left the history, since until then a new joiner would
+  // find that event in the history we send it and take the engine id in it for its own.
+  vector<EngineID> free_engine_ids_;
+  vector<pair<StateTimestep, EngineID> > retiring_engine_ids_;
 
   bool host_;
   int max_frames_;
@@ -211,6 +540,19 @@ class GameEngine {
   StateTimestep oldest_dirty_timestep_;
   StateTimestep latest_complete_state_timestep_;
 
+  // The newest already-simulated timestep whose events have changed since it was last simulated.
+  // Once a backtrack has re-simulated past this point, it can stop as soon as it produces a state
+  // identical to the one it replaced.
+  StateTimestep newest_dirty_timestep_;
+
+  // Limits on how much of a rollback RecreateDirtyStates does in one go, or 0 for none.
+  int max_rollback_timesteps_;
+  int64 max_rollback_us_;
+
+  // Every snapshot_interval_-th speculative state is kept; the others are NULL in game_states_ once
+  // the states after them have been simulated.
+  int snapshot_interval_;
+
   int port_;
   List<GlopNetworkAddress> connectees_;  // List of addresses that have asked to join this game.
 
@@ -223,12 +565,35 @@ class GameEngine {
   /// can legally happen within the engine's specs.
   MovingWindow<GameState*> game_states_;
   MovingWindow<GameEngineInfo> game_engine_infos_;
-  MovingWindow<map<EngineID, vector<GameEvent*> > > game_events_;
+  MovingWindow<TimestepEvents> game_events_;
+
+  /// Events that predictor_ guessed for engines that were missing from game_events_ when each
+  /// timestep was last simulated.  A timestep with anything in here is speculative.  These are
+  /// owned by the engine rather than event_arenas_, since they are replaced on every rollback, and
+  /// are only touched by whichever thread runs the simulation.
+  GameEventPredictor* predictor_;
+  MovingWindow<map<EngineID, vector<GameEvent*> > > predicted_events_;
+  /// game_events_ and predicted_events_ together, for simulating a speculative timestep.  It is
+  /// reused so that it only allocates while it grows.
+  TimestepEvents speculative_events_;
+
+  /// Owns every event in game_events_, one arena per timestep.  This is only touched by the thread
+  /// that calls Think(), so with async rollback it lags behind game_events_ and only retires a
+  /// timestep once retired_event_timestep_ says the simulation is done with it.
+  GameEventArenaWindow event_arenas_;
+  StateTimestep retired_event_timestep_;  // Guarded by publish_mutex_.
+  /// Received packages for timesteps past the end of event_arenas_.  Their events are on the heap
+  /// until the window reaches them and they can be posted.  Only touched by the thread that calls
+  /// Think().
+  vector<pair<EventPackageID, vector<GameEvent*> > > held_packages_;
 
   /// The most up-to-date data we have, although maybe not totally accurate because it might need to
   /// be rewound.
   GameState* head_;
 
+  /// GameStates that have fallen out of game_states_ and are waiting to be reused by CopyState.
+  vector<GameState*> spare_states_;
+
   vector<GameConnection*> all_connections_;
   vector<GameConnection*> playing_connections_;
 
@@ -238,6 +603,9 @@ class GameEngine {
   /// List of GameEvents that have been generated by this engine, along with the time in ms (since
   /// the game started) that they were generated.
   vector<GameEvent*> local_events_;
+  /// Every package that goes out over more than one connection is encoded into this once, and it
+  /// is reused so that encoding doesn't allocate.
+  EncodedEvents encoded_events_;
 
   GameEngineFrameCalculator* frame_calculator_;
 
@@ -251,10 +619,118 @@ class GameEngine {
   // While we're waiting to join we may receive a lot of game events, this will hold them until
   // we've received the whole gamestate.
 
+  string joining_state_data_;  // Compressed GameState received so far while joining.
+
+  /// A peer that the host is still sending a GameState to.  The snapshot is a private copy of the
+  /// complete state at the time the peer connected, which the transfer compresses in the
+  /// background.  The events after it are sent right away, and the peer buffers them until the
+  /// state is done.
+  struct PendingJoin {
+    GameConnection* peer;
+    GameState* snapshot;
+    GameStateTransfer* transfer;
+    StateTimestep state_timestep;
+    EngineSet engine_ids;
+    EngineID temporary_engine_id;
+    int chunk_bytes;  // 0 until the transfer is ready.
+  };
+  vector<PendingJoin> pending_joins_;
+
 
   // stats
   int num_thinks_;
   int num_rethinks_;
+  int num_state_allocations_;
+  int num_skipped_rollbacks_;
+  int num_hash_cutoffs_;
+  int num_stalled_thinks_;
+  int num_deferred_rollbacks_;
+  int num_adopted_branch_states_;
+  int num_predicted_packages_;
+  int num_mispredictions_;
+  // Only the histograms, event_types, arrival_lateness_ms and frame counts are kept up to date
+  // here.  The simulation's share is only touched by whichever thread runs the simulation, or with
+  // simulation_mutex_ held, and arrival_lateness_ms only by the thread that calls Think().
+  GameEngineStats stats_;
+  bool event_timing_;
+
+  // Desync detection
+  bool desync_detection_;
+  StateTimestep last_sent_hash_timestep_;
+  map<StateTimestep, uint32> state_hashes_;  // Our own hashes of recently completed timesteps.
+  map<StateTimestep, map<EngineID, uint32> > remote_state_hashes_;  // Not yet checked.
+  int num_hashes_compared_;
+  int num_desyncs_;
+  StateTimestep desync_timestep_;
+
+  bool relay_;
+
+  // Time sync.  All of this is only touched by the thread that calls Think().
+  struct TimeSyncPeer {
+    TimeSyncPeer() : time_ms(0), received_ms(0), rtt_ms(-1), advantage_ms(0) {}
+    int time_ms;       // time_ms from the peer's newest TimeSyncEvent.
+    int received_ms;   // Our time when that arrived.
+    int rtt_ms;        // -1 until one of our own stamps has come back.
+    int advantage_ms;  // How far ahead of the peer we were when that arrived.
+  };
+  bool time_sync_;
+  map<EngineID, TimeSyncPeer> time_sync_peers_;
+  int last_time_sync_ms_;   // When we last sent a TimeSyncEvent, or -1.
+  int last_think_time_ms_;  // Our time at the previous ThinkPlaying(), or -1.
+  int time_advantage_ms_;
+
+  // Adaptive delay.  arrival_lateness_ms_ is the host's smoothed measure of how many ms after we
+  // simulated a timestep each engine's package for it arrived, which is negative if it was early.
+  bool adaptive_delay_;
+  int min_ms_delay_;
+  int max_ms_delay_;
+  map<EngineID, int> arrival_lateness_ms_;
+  int last_delay_change_ms_;              // When ms_delay_ last changed, or -1.
+  StateTimestep pending_delay_timestep_;  // -1 unless a change has been announced.
+  int pending_ms_delay_;
+  int num_delay_changes_;
+  // How many rollbacks the simulation has done since the delay last changed, and how many states
+  // they re-simulated in total.  Guarded by publish_mutex_, since the simulation may be on another
+  // thread.
+  int delay_rollbacks_;
+  int delay_rollback_depth_;
+
+  // Gets every timestep as it becomes complete, if we are recording a replay.  Only touched by
+  // whichever thread runs the simulation, or with simulation_mutex_ held.
+  GameReplayWriter* replay_writer_;
+  GameSpectatorServer* spectator_server_;
+
+  // The hash of latest_complete_state_timestep_, if there is one, for QueueEvents to send out.
+  // Guarded by publish_mutex_, since it is written by whichever thread runs the simulation.
+  StateTimestep complete_hash_timestep_;
+  uint32 complete_hash_;
+  // The engines in the game as of the oldest timestep in the history, so that Think() can tell
+  // real engines from whatever ids show up on the wire.  Guarded by publish_mutex_.
+  EngineSet complete_engine_ids_;
+
+  // Async rollback.  inbox_mutex_ guards inbox_ and simulation_target_, and is always acquired
+  // after simulation_mutex_ if both are needed.  publish_mutex_ guards the handoff of head states:
+  // the worker copies head_ into publish_back_ and swaps it with publish_ready_, and Think() swaps
+  // publish_ready_ into publish_front_, which is what GetCurrentGameState() returns.
+  bool async_rollback_;
+  GameEngineSimulationThread* simulation_thread_;
+  mutable Mutex simulation_mutex_;
+  Mutex inbox_mutex_;
+  Mutex publish_mutex_;
+  vector<pair<EventPackageID, vector<GameEvent*> > > inbox_;
+  StateTimestep simulation_target_;
+  StateTimestep simulated_timestep_;  // Last timestep the worker simulated up to.
+  bool simulation_dirty_;             // Events have been stored since the last Simulate().
+  GameState* publish_back_;
+  GameState* publish_ready_;
+  GameState* publish_front_;
+  bool publish_fresh_;
+
+  // Speculative branches, one per worker thread.  Branches are set up and torn down by whichever
+  // thread runs the simulation, and branch_mutex_ guards what they share with their workers.
+  vector<SpeculativeBranch*> branches_;
+  vector<GameEngineBranchThread*> branch_threads_;
+  Mutex branch_mutex_;
 };
 
 // Use a GameEngineConnector to find games.  Once you've found and connected to the game you're
@@ -285,7 +761,7 @@ class GameStateEvent : public GameEvent {
   void SetData(
       const string& game_state,
       NetTimestep timestep,
-      set<EngineID> engine_ids,
+      const EngineSet& engine_ids,
       EngineID source_engine_id,
       EngineID temporary_engine_id,
       int max_frames,
@@ -295,7 +771,7 @@ class GameStateEvent : public GameEvent {
       int time_ms) {
     typed_data_->set_game_state(game_state);
     typed_data_->set_timestep(timestep);
-    for (set<EngineID>::iterator it = engine_ids.begin(); it != engine_ids.end(); it++) {
+    for (EngineSet::const_iterator it = engine_ids.begin(); it != engine_ids.end(); it++) {
       typed_data_->add_engine_ids(*it);
     }
     typed_data_->set_source_engine_id(source_engine_id);
@@ -306,6 +782,12 @@ class GameStateEvent : public GameEvent {
     typed_data_->set_ms_delay(ms_delay);
     typed_data_->set_time_ms(time_ms);
   }
+  // Marks the state as having been sent ahead in GameStateChunkEvents rather than in this event.
+  void SetStreamedState(int compressed_size, int raw_size) {
+    typed_data_->set_game_state("");
+    typed_data_->set_compressed_size(compressed_size);
+    typed_data_->set_raw_size(raw_size);
+  }
   const GameStateEventData& GetData() {
     return *typed_data_;
   }
@@ -313,6 +795,25 @@ class GameStateEvent : public GameEvent {
   GameStateEventData* typed_data_;
 };
 
+class GameStateChunkEvent : public GameEvent {
+ public:
+  GameStateChunkEvent() {
+    typed_data_ = new GameStateChunkEventData;
+    data_ = typed_data_;
+  }
+  ~GameStateChunkEvent() {
+    delete typed_data_;
+  }
+  void SetData(const string& data) {
+    typed_data_->set_data(data);
+  }
+  const string& data() const {
+    return typed_data_->data();
+  }
+ private:
+  GameStateChunkEventData* typed_data_;
+};
+
 class ReadyToPlayEvent : public GameEvent {
  public:
   ReadyToPlayEvent() {
@@ -366,4 +867,84 @@ class NewEngineEvent : public GameEvent {
  private:
   NewEngineEventData* typed_data_;
 };
+
+class StateHashEvent : public GameEvent {
+ public:
+  StateHashEvent() {
+    typed_data_ = new StateHashEventData;
+    data_ = typed_data_;
+  }
+  ~StateHashEvent() {
+    delete typed_data_;
+  }
+  virtual bool IsNoOp() const {
+    return true;
+  }
+  void SetData(StateTimestep timestep, uint32 hash) {
+    typed_data_->set_timestep(timestep);
+    typed_data_->set_hash(hash);
+  }
+  StateTimestep timestep() const {
+    return typed_data_->timestep();
+  }
+  uint32 hash() const {
+    return typed_data_->hash();
+  }
+ private:
+  StateHashEventData* typed_data_;
+};
+
+class TimeSyncEvent : public GameEvent {
+ public:
+  TimeSyncEvent() {
+    typed_data_ = new TimeSyncEventData;
+    data_ = typed_data_;
+  }
+  ~TimeSyncEvent() {
+    delete typed_data_;
+  }
+  virtual bool IsNoOp() const {
+    return true;
+  }
+  void SetData(int time_ms) {
+    typed_data_->set_time_ms(time_ms);
+  }
+  void AddEcho(EngineID engine, int time_ms, int held_ms) {
+    TimeSyncEcho* echo = typed_data_->add_echoes();
+    echo->set_engine(engine);
+    echo->set_time_ms(time_ms);
+    echo->set_held_ms(held_ms);
+  }
+  const TimeSyncEventData& GetData() const {
+    return *typed_data_;
+  }
+ private:
+  TimeSyncEventData* typed_data_;
+};
+
+class DelayChangeEvent : public GameEvent {
+ public:
+  DelayChangeEvent() {
+    typed_data_ = new DelayChangeEventData;
+    data_ = typed_data_;
+  }
+  ~DelayChangeEvent() {
+    delete typed_data_;
+  }
+  virtual bool IsNoOp() const {
+    return true;
+  }
+  void SetData(StateTimestep timestep, int ms_delay) {
+    typed_data_->set_timestep(timestep);
+    typed_data_->set_ms_delay(ms_delay);
+  }
+  StateTimestep timestep() const {
+    return typed_data_->timestep();
+  }
+  int ms_delay() const {
+    return typed_data_->ms_delay();
+  }
+ private:
+  DelayChangeEventData* typed_data_;
+};
 #endif // GAMEENGINE_GAMEENGINE_H
@@ -0,0 +1,124 @@
+#include "GameEngineScheduler.h"
+#include "GameEvent.h"
+
+#include "../System.h"
+
+// Each worker waits for ThinkAll() to start a new round, thinks engines until there are none left,
+// and reports back.  Everything is handed over under the scheduler's mutex_, so the engines see
+// each other's writes no matter which thread thought them last.
+class GameEngineSchedulerThread : public Thread {
+ public:
+  GameEngineSchedulerThread(GameEngineScheduler* scheduler) : scheduler_(scheduler) {}
+
+ protected:
+  virtual void Run() {
+    int last_round = 0;
+    while (!IsStopRequested()) {
+      int round;
+      {
+        MutexLock lock(&scheduler_->mutex_);
+        round = scheduler_->round_;
+      }
+      if (round == last_round) {
+        system()->Sleep(1);
+        continue;
+      }
+      last_round = round;
+      scheduler_->ThinkEngines();
+      MutexLock lock(&scheduler_->mutex_);
+      scheduler_->num_finished_++;
+    }
+  }
+
+ private:
+  GameEngineScheduler* scheduler_;
+};
+
+GameEngineScheduler::GameEngineScheduler(int num_threads)
+  : round_(0),
+    num_finished_(0),
+    next_engine_(0),
+    last_think_all_us_(0),
+    last_slowest_think_us_(0) {
+  GameEventFactory::Freeze();
+  for (int i = 0; i < num_threads; i++) {
+    threads_.push_back(new GameEngineSchedulerThread(this));
+    threads_.back()->Start();
+  }
+}
+
+GameEngineScheduler::~GameEngineScheduler() {
+  for (int i = 0; i < threads_.size(); i++) {
+    threads_[i]->RequestStop();
+  }
+  for (int i = 0; i < threads_.size(); i++) {
+    threads_[i]->Join();
+    delete threads_[i];
+  }
+}
+
+void GameEngineScheduler::AddEngine(GameEngine* engine) {
+  engines_.push_back(engine);
+  think_states_.push_back(kIdle);
+}
+
+void GameEngineScheduler::RemoveEngine(GameEngine* engine) {
+  for (int i = 0; i < engines_.size(); i++) {
+    if (engines_[i] == engine) {
+      engines_.erase(engines_.begin() + i);
+      think_states_.erase(think_states_.begin() + i);
+      return;
+    }
+  }
+}
+
+GameEngineThinkState GameEngineScheduler::GetThinkState(GameEngine* engine) const {
+  for (int i = 0; i < engines_.size(); i++) {
+    if (engines_[i] == engine) {
+      return think_states_[i];
+    }
+  }
+  return kIdle;
+}
+
+void GameEngineScheduler::ThinkAll() {
+  int64 start_us = system()->GetTimeMicro();
+  {
+    MutexLock lock(&mutex_);
+    next_engine_ = 0;
+    num_finished_ = 0;
+    last_slowest_think_us_ = 0;
+    round_++;
+  }
+  ThinkEngines();
+  // Every worker checks in, even if it woke up too late to find anything left to think.
+  while (true) {
+    {
+      MutexLock lock(&mutex_);
+      if (num_finished_ == threads_.size()) {
+        break;
+      }
+    }
+    system()->Sleep();
+  }
+  last_think_all_us_ = system()->GetTimeMicro() - start_us;
+}
+
+void GameEngineScheduler::ThinkEngines() {
+  int64 slowest_us = 0;
+  while (true) {
+    int index;
+    {
+      MutexLock lock(&mutex_);
+      index = next_engine_++;
+    }
+    if (index >= engines_.size()) {
+      break;
+    }
+    int64 start_us = system()->GetTimeMicro();
+    think_states_[index] = engines_[index]->Think();
+    slowest_us = max(slowest_us, system()->GetTimeMicro() - start_us);
+  }
+  MutexLock lock(&mutex_);
+  last_slowest_think_us_ = max(last_slowest_think_us_, slowest_us);
+}
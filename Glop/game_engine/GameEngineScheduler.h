@@ -0,0 +1,66 @@
+#ifndef GAMEENGINE_GAMEENGINESCHEDULER_H
+#define GAMEENGINE_GAMEENGINESCHEDULER_H
+
+#include <vector>
+using namespace std;
+
+#include "GameEngine.h"
+#include "../Base.h"
+#include "../Thread.h"
+
+class GameEngineSchedulerThread;
+
+/// Spreads the Think() calls of many GameEngines over a fixed pool of threads, for servers that
+/// host lots of small matches in one process.  ThinkAll() thinks every engine exactly once, with no
+/// engine being thought on two threads at once, and doesn't return until they are all done, so
+/// between calls the engines can be used from the calling thread like any other engine.  Engines
+/// that share a MatchTransport should have it Think()ed just before each ThinkAll().
+///
+/// Engines that are thought on a pool can't share anything that isn't thread-safe.  In particular
+/// each one needs its own GameState and its own network manager, which can come from a shared
+/// MatchTransport.
+class GameEngineScheduler {
+ public:
+  /// Starts num_threads worker threads.  The thread that calls ThinkAll() thinks engines too, so 0
+  /// is allowed, and thinks everything on the calling thread.
+  GameEngineScheduler(int num_threads);
+  ~GameEngineScheduler();
+
+  /// Engines are not owned by the scheduler, and can only be added and removed between calls to
+  /// ThinkAll().
+  void AddEngine(GameEngine* engine);
+  void RemoveEngine(GameEngine* engine);
+  int NumEngines() const { return engines_.size(); }
+  int NumThreads() const { return threads_.size(); }
+
+  /// Calls Think() on every engine once, and returns when they have all finished.
+  void ThinkAll();
+
+  /// What engine's Think() returned during the last ThinkAll(), or kIdle if it hasn't been thought.
+  GameEngineThinkState GetThinkState(GameEngine* engine) const;
+  /// How long the last ThinkAll() took, and the longest that any one engine took during it.
+  int64 LastThinkAllUs() const { return last_think_all_us_; }
+  int64 LastSlowestThinkUs() const { return last_slowest_think_us_; }
+
+ private:
+  friend class GameEngineSchedulerThread;
+
+  // Thinks engines until there are none left in this round.  Called by every thread in the pool.
+  void ThinkEngines();
+
+  vector<GameEngine*> engines_;
+  vector<GameEngineThinkState> think_states_;
+  vector<GameEngineSchedulerThread*> threads_;
+
+  // Engines are handed out one at a time, since one slow engine shouldn't hold up a whole batch.
+  // mutex_ guards the round counters and next_engine_.
+  Mutex mutex_;
+  int round_;
+  int num_finished_;  // Number of workers that are done with this round.
+  int next_engine_;
+  int64 last_think_all_us_;
+  int64 last_slowest_think_us_;
+  DISALLOW_EVIL_CONSTRUCTORS(GameEngineScheduler);
+};
+
+#endif // GAMEENGINE_GAMEENGINESCHEDULER_H
@@ -0,0 +1,77 @@
+#include "GameEngineStats.h"
+
+void StatHistogram::Clear() {
+  for (int i = 0; i < kNumBuckets; i++) {
+    buckets_[i] = 0;
+  }
+  count_ = 0;
+  sum_ = 0;
+  max_ = 0;
+}
+
+int StatHistogram::GetBucket(int64 value) {
+  if (value < 16) {
+    return value < 0 ? 0 : (int)value;
+  }
+  int bit = 4;
+  while (bit < 62 && (value >> (bit + 1)) != 0) {
+    bit++;
+  }
+  int bucket = 16 + (bit - 4) * 4 + (int)((value >> (bit - 2)) & 3);
+  return bucket < kNumBuckets ? bucket : kNumBuckets - 1;
+}
+
+int64 StatHistogram::BucketLowerBound(int bucket) {
+  if (bucket < 16) {
+    return bucket;
+  }
+  int bit = 4 + (bucket - 16) / 4;
+  return int64(4 + (bucket - 16) % 4) << (bit - 2);
+}
+
+int64 StatHistogram::BucketUpperBound(int bucket) {
+  if (bucket < 16) {
+    return bucket;
+  }
+  if (bucket == kNumBuckets - 1) {
+    return 0x7fffffffffffffffLL;
+  }
+  int bit = 4 + (bucket - 16) / 4;
+  return BucketLowerBound(bucket) + (int64(1) << (bit - 2)) - 1;
+}
+
+void StatHistogram::Add(int64 value) {
+  if (value < 0) {
+    value = 0;
+  }
+  buckets_[GetBucket(value)]++;
+  count_++;
+  sum_ += value;
+  if (value > max_) {
+    max_ = value;
+  }
+}
+
+void StatHistogram::Merge(const StatHistogram& other) {
+  for (int i = 0; i < kNumBuckets; i++) {
+    buckets_[i] += other.buckets_[i];
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+  if (other.max_ > max_) {
+    max_ = other.max_;
+  }
+}
+
+int64 StatHistogram::Percentile(double fraction) const {
+  int64 needed = (int64)(fraction * count_ + 0.999999);
+  int64 seen = 0;
+  for (int i = 0; i < kNumBuckets; i++) {
+    seen += buckets_[i];
+    if (seen > 0 && seen >= needed) {
+      int64 upper = BucketUpperBound(i);
+      return upper < max_ ? upper : max_;
+    }
+  }
+  return max_;
+}
@@ -0,0 +1,113 @@
+#ifndef GAMEENGINE_GAMEENGINESTATS_H
+#define GAMEENGINE_GAMEENGINESTATS_H
+
+#include <map>
+#include <vector>
+using namespace std;
+
+#include "P2PNG.h"
+#include "GameConnection.h"
+#include "../Base.h"
+
+/// A histogram that is cheap enough to update on every frame.  Values from 0 to 15 each get their
+/// own bucket, and every power of two above that is split into four buckets, so percentiles are
+/// exact for small values and within 25% for large ones.  Negative values are counted as 0.
+class StatHistogram {
+ public:
+  static const int kNumBuckets = 16 + 32 * 4;
+
+  StatHistogram() { Clear(); }
+
+  void Clear();
+  void Add(int64 value);
+  void Merge(const StatHistogram& other);
+
+  int64 count() const { return count_; }
+  int64 sum() const { return sum_; }
+  int64 max() const { return max_; }
+  double mean() const { return count_ == 0 ? 0 : sum_ / (double)count_; }
+
+  /// Returns a value that at least fraction of the values added are no bigger than.  This is the
+  /// top of the bucket the percentile falls into, so it can overestimate, but never by more than
+  /// the largest value added.
+  int64 Percentile(double fraction) const;
+
+  /// The range of values counted in a bucket.  The last bucket also gets everything too big for
+  /// the others, which is anything from 2^36 on.
+  static int64 BucketLowerBound(int bucket);
+  static int64 BucketUpperBound(int bucket);
+  int64 bucket(int bucket) const { return buckets_[bucket]; }
+
+ private:
+  static int GetBucket(int64 value);
+
+  int64 buckets_[kNumBuckets];
+  int64 count_;
+  int64 sum_;
+  int64 max_;
+};
+
+/// How often the simulation applied one type of event, and how long that took.
+struct EventTypeStats {
+  EventTypeStats() : count(0), total_us(0) {}
+  int64 count;
+  int64 total_us;
+};
+
+/// A snapshot of everything GameEngine measures about itself, filled in by
+/// GameEngine::GetStats().  Every count is a total since the engine was created, so a poller can
+/// subtract consecutive snapshots to get rates.
+struct GameEngineStats {
+  GameEngineStats()
+    : time_ms(0),
+      thinks(0),
+      rethinks(0),
+      confirmed_frames(0),
+      speculative_frames(0),
+      skipped_rollbacks(0),
+      hash_cutoffs(0),
+      predicted_packages(0),
+      mispredictions(0),
+      stalled_thinks(0),
+      deferred_rollbacks(0),
+      desyncs(0) {}
+
+  /// The engine's clock when the snapshot was taken.
+  int time_ms;
+
+  // Simulation.  A frame is confirmed if every engine's events were there when it was simulated,
+  // and speculative otherwise.  thinks is confirmed_frames + speculative_frames.
+  int64 thinks;
+  int64 rethinks;
+  int64 confirmed_frames;
+  int64 speculative_frames;
+  int64 skipped_rollbacks;
+  int64 hash_cutoffs;
+  int64 predicted_packages;
+  int64 mispredictions;
+  int64 stalled_thinks;
+  int64 deferred_rollbacks;
+  int64 desyncs;
+
+  /// Number of states re-simulated by each rollback.
+  StatHistogram rollback_depth;
+  /// Microseconds spent simulating each state, and the part of that spent applying its events.
+  StatHistogram recreate_state_us;
+  StatHistogram apply_events_us;
+  /// Microseconds spent copying each state adopted from a speculative branch.  Adopting goes
+  /// through GameState::SerializeToString, so branches only pay off while this is below
+  /// recreate_state_us.
+  StatHistogram adopt_branch_state_us;
+  /// Cost of applying game events (type > 0), indexed by GameEventFactory::GetEventTypeIndex().
+  /// total_us is only measured if GameEngine::EnableEventTiming() is on.
+  vector<EventTypeStats> event_types;
+
+  // Networking.
+  /// For each other engine, how many ms after their timestep was due its packages arrived.
+  /// Anything that arrives early is counted as 0.
+  map<EngineID, StatHistogram> arrival_lateness_ms;
+  /// Traffic over each connection, in no particular order.
+  vector<GameConnectionStats> connections;
+};
+
+#endif // GAMEENGINE_GAMEENGINESTATS_H
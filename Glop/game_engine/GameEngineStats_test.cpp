@@ -0,0 +1,48 @@
+#include <gtest/gtest.h>
+#include "GameEngineStats.h"
+
+TEST(StatHistogramTest, TestSmallValuesAreExact) {
+  StatHistogram histogram;
+  for (int i = 1; i <= 10; i++) {
+    histogram.Add(i);
+  }
+  histogram.Add(-5);
+  EXPECT_EQ(11, histogram.count());
+  EXPECT_EQ(55, histogram.sum());
+  EXPECT_EQ(10, histogram.max());
+  EXPECT_EQ(0, histogram.Percentile(0));
+  EXPECT_EQ(5, histogram.Percentile(0.5));
+  EXPECT_EQ(9, histogram.Percentile(0.9));
+  EXPECT_EQ(10, histogram.Percentile(1));
+}
+
+TEST(StatHistogramTest, TestBucketsCoverEveryValue) {
+  for (int b = 0; b + 1 < StatHistogram::kNumBuckets; b++) {
+    EXPECT_LE(StatHistogram::BucketLowerBound(b), StatHistogram::BucketUpperBound(b));
+    EXPECT_EQ(StatHistogram::BucketUpperBound(b) + 1, StatHistogram::BucketLowerBound(b + 1));
+  }
+
+  // Large values land in a bucket no more than 25% wider than they are.
+  for (int64 value = 16; value < (int64(1) << 40); value = value * 3 / 2 + 1) {
+    StatHistogram histogram;
+    histogram.Add(value);
+    histogram.Add(value + 1);
+    int64 p = histogram.Percentile(0.5);
+    EXPECT_LE(value, p);
+    EXPECT_GE(value + value / 4, p);
+  }
+}
+
+TEST(StatHistogramTest, TestMergeAddsEverythingUp) {
+  StatHistogram a, b;
+  for (int i = 0; i < 100; i++) {
+    a.Add(i);
+    b.Add(1000 + i);
+  }
+  a.Merge(b);
+  EXPECT_EQ(200, a.count());
+  EXPECT_EQ(1099, a.max());
+  EXPECT_GT(1000, a.Percentile(0.5));
+  EXPECT_LE(1000, a.Percentile(0.51));
+  EXPECT_EQ(1099, a.Percentile(1));
+}
@@ -0,0 +1,559 @@
+// Scale benchmark for GameEngine.  This connects a number of engines through a MockRouter, drives
+// them with scripted input on a virtual clock, and prints one line of JSON with the results, so
+// that runs can be collected and compared between releases.  Usage:
+//
+//   GameEngine_benchmark [--engines=N] [--frames=N] [--latency=MS] [--latency_spread=MS]
+//                        [--jitter=MS] [--loss=PERCENT] [--retransmit=MS] [--bandwidth=BYTES]
+//                        [--seed=N] [--predict] [--time_sync] [--relay] [--rollback_budget=N]
+//                        [--snapshot_interval=N] [--branches=N]
+//
+// --engines is the number of engines, from 2 to 64, and --frames is how many Thinks each of them
+// gets once they are all playing, at 5ms of game time per Think.  Every link gets --latency ms of
+// latency, plus up to --latency_spread more that is picked for each link from --seed.  Once every
+// engine has joined, the links also get up to --jitter ms of random delay per package, lose
+// --loss percent of their packages and resend them after --retransmit ms, and are limited to
+// --bandwidth bytes per second if it is given.  --relay makes the host merge the packages it
+// forwards into one stream per engine.  --rollback_budget limits every engine to re-simulating
+// about N states per Think, and spreads deeper rollbacks over the Thinks after it.
+// --snapshot_interval makes every engine keep only every Nth speculative state, and the
+// "stored_states" result is how many states all of the engines hold at the end of the run.
+// --branches gives every engine N worker threads for speculative branches, and
+// "adopt_state_us" is the average time it took to copy a state out of one, to compare with
+// "recreate_state_us", the average time it took to simulate a state.
+//
+// "allocations" counts every heap allocation made during the measured frames.  Events themselves
+// live in per-timestep arenas, but each one still allocates its protocol buffer on the heap, so
+// this includes at least one allocation per event.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "GameEngine.h"
+#include "GameEvent.h"
+#include "GameState.h"
+#include "TestProtos.pb.h"
+
+#include "../Base.h"
+#include "../System.h"
+#include "../net/MockRouter.h"
+#include "../net/MockNetworkManager.h"
+
+// Every heap allocation in the process goes through here, so that we can count them.  Engines
+// allocate on their async and branch worker threads too, so the count is only ever touched
+// atomically.  Mutex can't be used here, since it allocates.
+static long long num_allocations = 0;
+
+static long long NumAllocations() {
+  return __sync_add_and_fetch(&num_allocations, 0);
+}
+
+void* operator new(size_t size) {
+  __sync_add_and_fetch(&num_allocations, 1);
+  void* ptr = malloc(size == 0 ? 1 : size);
+  if (ptr == NULL) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void* ptr) throw() {
+  free(ptr);
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete[](void* ptr) throw() {
+  free(ptr);
+}
+
+static const int kMsPerThink = 5;
+static const int kMsPerNetFrame = 30;
+static const int kMsPerStateFrame = 10;
+static const int kFirstPort = 65001;
+
+class BenchmarkState : public GameState {
+ public:
+  BenchmarkState(int num_players) {
+    for (int i = 0; i < num_players; i++) {
+      PlayerPosition* pos = state.add_positions();
+      pos->set_x(0);
+      pos->set_y(0);
+    }
+    state.set_applies(0);
+    state.set_thinks(0);
+    hash_ = ComputeHash();
+  }
+
+  virtual bool Think() {
+    for (int i = 0; i < state.positions_size(); i++) {
+      const PlayerPosition& pos = state.positions(i);
+      int x = pos.x() + pos.y() % 3;
+      SetPosition(i, x, pos.y() + x % 5);
+    }
+    state.set_thinks(state.thinks() + 1);
+    return true;
+  }
+
+  virtual GameState* Copy() const {
+    BenchmarkState* new_state = new BenchmarkState(0);
+    CopyInto(new_state);
+    return new_state;
+  }
+
+  virtual bool CopyInto(GameState* dst) const {
+    BenchmarkState* benchmark_dst = static_cast<BenchmarkState*>(dst);
+    benchmark_dst->state.CopyFrom(state);
+    benchmark_dst->hash_ = hash_;
+    return true;
+  }
+
+  virtual void SerializeToString(string* data) const {
+    state.SerializeToString(data);
+  }
+
+  virtual void ParseFromString(const string& data) {
+    state.ParseFromString(data);
+    hash_ = ComputeHash();
+  }
+
+  // The positions' hash is kept up to date as players move, the way a real game would do it.
+  // applies changes with every event, so it goes in as well, or nearly every late package would
+  // look like a hash collision and cost a full Equals().
+  virtual bool Hash(uint32* hash) const {
+    *hash = hash_ ^ MixStateHash(~(uint32)state.applies());
+    return true;
+  }
+
+  void SetPosition(int player, int x, int y) {
+    PlayerPosition* pos = state.mutable_positions(player);
+    hash_ ^= PositionHash(player, pos->x(), pos->y()) ^ PositionHash(player, x, y);
+    pos->set_x(x);
+    pos->set_y(y);
+  }
+
+  TestGameState state;
+
+ private:
+  static uint32 PositionHash(int player, int x, int y) {
+    return MixStateHash(player * 2 + x * 4096) ^ MixStateHash(player * 2 + 1 + y * 4096);
+  }
+
+  uint32 ComputeHash() const {
+    uint32 hash = 0;
+    for (int i = 0; i < state.positions_size(); i++) {
+      hash ^= PositionHash(i, state.positions(i).x(), state.positions(i).y());
+    }
+    return hash;
+  }
+
+  uint32 hash_;
+};
+
+class BenchmarkMoveEvent : public GameEvent {
+ public:
+  BenchmarkMoveEvent() {
+    typed_data_ = new TestEngineMoveEvent;
+    data_ = typed_data_;
+  }
+  ~BenchmarkMoveEvent() {
+    delete typed_data_;
+  }
+  void SetData(int player, int x, int y) {
+    typed_data_->set_player(player);
+    typed_data_->set_x(x);
+    typed_data_->set_y(y);
+  }
+  virtual GameEventResult* ApplyToGameState(GameState* game_state) const {
+    BenchmarkState* benchmark_state = static_cast<BenchmarkState*>(game_state);
+    TestGameState* state = &benchmark_state->state;
+    if (typed_data_->player() < state->positions_size()) {
+      const PlayerPosition& pos = state->positions(typed_data_->player());
+      benchmark_state->SetPosition(
+          typed_data_->player(), pos.x() + typed_data_->x(), pos.y() + typed_data_->y());
+    }
+    state->set_applies(state->applies() + 1);
+    return NULL;
+  }
+ private:
+  TestEngineMoveEvent* typed_data_;
+};
+REGISTER_EVENT(1, BenchmarkMoveEvent);
+
+class BenchmarkFrameCalculator : public GameEngineFrameCalculator {
+ public:
+  BenchmarkFrameCalculator() : time_ms_(0) {}
+  virtual int GetTime() const { return time_ms_; }
+  virtual void SetTime(int time_ms) { time_ms_ = time_ms; }
+ private:
+  int time_ms_;
+};
+
+struct BenchmarkOptions {
+  BenchmarkOptions()
+    : engines(4),
+      frames(2000),
+      latency_ms(20),
+      latency_spread_ms(0),
+      jitter_ms(0),
+      loss_percent(0),
+      retransmit_ms(100),
+      bytes_per_second(0),
+      seed(1),
+      predict(false),
+      time_sync(false),
+      relay(false),
+      rollback_budget(0),
+      snapshot_interval(1),
+      branches(0) {}
+  int engines;
+  int frames;
+  int latency_ms;
+  int latency_spread_ms;
+  int jitter_ms;
+  int loss_percent;
+  int retransmit_ms;
+  int bytes_per_second;
+  int seed;
+  bool predict;
+  bool time_sync;
+  bool relay;
+  int rollback_budget;
+  int snapshot_interval;
+  int branches;
+};
+
+static bool ParseOptions(int argc, char** argv, BenchmarkOptions* options) {
+  for (int i = 1; i < argc; i++) {
+    if (sscanf(argv[i], "--engines=%d", &options->engines) == 1 ||
+        sscanf(argv[i], "--frames=%d", &options->frames) == 1 ||
+        sscanf(argv[i], "--latency=%d", &options->latency_ms) == 1 ||
+        sscanf(argv[i], "--latency_spread=%d", &options->latency_spread_ms) == 1 ||
+        sscanf(argv[i], "--jitter=%d", &options->jitter_ms) == 1 ||
+        sscanf(argv[i], "--loss=%d", &options->loss_percent) == 1 ||
+        sscanf(argv[i], "--retransmit=%d", &options->retransmit_ms) == 1 ||
+        sscanf(argv[i], "--bandwidth=%d", &options->bytes_per_second) == 1 ||
+        sscanf(argv[i], "--seed=%d", &options->seed) == 1 ||
+        sscanf(argv[i], "--rollback_budget=%d", &options->rollback_budget) == 1 ||
+        sscanf(argv[i], "--snapshot_interval=%d", &options->snapshot_interval) == 1 ||
+        sscanf(argv[i], "--branches=%d", &options->branches) == 1) {
+      continue;
+    }
+    if (strcmp(argv[i], "--predict") == 0) {
+      options->predict = true;
+    } else if (strcmp(argv[i], "--time_sync") == 0) {
+      options->time_sync = true;
+    } else if (strcmp(argv[i], "--relay") == 0) {
+      options->relay = true;
+    } else {
+      printf("Unknown option %s\n", argv[i]);
+      return false;
+    }
+  }
+  if (options->engines < 2 || options->engines > 64) {
+    printf("--engines must be between 2 and 64\n");
+    return false;
+  }
+  if (options->loss_percent < 0 || options->loss_percent >= 100 || options->retransmit_ms <= 0) {
+    printf("--loss must be less than 100 and --retransmit must be positive\n");
+    return false;
+  }
+  return options->frames > 0 && options->latency_ms >= 0 && options->latency_spread_ms >= 0 &&
+         options->jitter_ms >= 0 && options->bytes_per_second >= 0 &&
+         options->rollback_budget >= 0 && options->snapshot_interval >= 1 &&
+         options->branches >= 0;
+}
+
+// A small deterministic generator, so that results only depend on the options.
+static unsigned int NextRandom(unsigned int* seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return (*seed >> 16) & 0x7fff;
+}
+
+class Benchmark {
+ public:
+  Benchmark(const BenchmarkOptions& options)
+    : options_(options),
+      time_ms_(0),
+      inputs_(0) {}
+
+  ~Benchmark() {
+    for (int i = 0; i < engines_.size(); i++) {
+      delete engines_[i];
+    }
+  }
+
+  bool Run();
+
+ private:
+  // Gives every engine one Think and then moves the clock forward.
+  void Step(bool scripted_input);
+  bool AddEngine();
+  // Gives every link its latency, and the rest of the network model too if impaired is set.
+  void SetLinkModels(bool impaired);
+  void Report(long long elapsed_us, long long allocations);
+
+  BenchmarkOptions options_;
+  int time_ms_;
+  MockRouter router_;
+  vector<GameEngine*> engines_;
+  vector<MockNetworkManager*> managers_;
+  int inputs_;
+
+  // Totals from before the measured frames, so that setting up doesn't count.
+  long long base_thinks_;
+  long long base_rethinks_;
+  long long base_state_allocations_;
+  long long base_stalled_thinks_;
+  long long base_deferred_rollbacks_;
+  long long base_adopted_branch_states_;
+  StatHistogram base_depths_;
+  StatHistogram base_recreate_us_;
+  StatHistogram base_adopt_us_;
+  int base_packages_;
+  long long base_bytes_;
+  int base_dropped_;
+};
+
+void Benchmark::Step(bool scripted_input) {
+  for (int i = 0; i < engines_.size(); i++) {
+    // Every engine changes its input once per net frame, each on its own schedule.
+    if (scripted_input && (time_ms_ / kMsPerThink + i) % (kMsPerNetFrame / kMsPerThink) == 0) {
+      BenchmarkMoveEvent* event =
+          static_cast<BenchmarkMoveEvent*>(GameEventFactory::GetEventByType(1));
+      event->SetData(i, (time_ms_ / kMsPerNetFrame + i) % 3 - 1, (i * 7 + time_ms_) % 3 - 1);
+      engines_[i]->ApplyEvent(event);
+      inputs_++;
+    }
+    engines_[i]->Think();
+    GameEngineFrameCalculator* calculator = engines_[i]->GetFrameCalculator();
+    calculator->SetTime(calculator->GetTime() + kMsPerThink);
+  }
+  time_ms_ += kMsPerThink;
+  router_.SetTime(time_ms_);
+}
+
+bool Benchmark::AddEngine() {
+  BenchmarkState state(options_.engines);
+  GameEngine* engine;
+  if (engines_.empty()) {
+    engine = new GameEngine(
+        state, 100, kMsPerNetFrame, kMsPerStateFrame, 0);
+    engine->EnableRelay(options_.relay);
+  } else {
+    engine = new GameEngine(state);
+  }
+  engine->InstallFrameCalculator(new BenchmarkFrameCalculator);
+  MockNetworkManager* manager = new MockNetworkManager(&router_);
+  engine->InstallNetworkManager(manager);
+  engine->GetFrameCalculator()->SetTime(time_ms_);
+  if (options_.predict) {
+    engine->InstallEventPredictor(new RepeatLastEventsPredictor);
+  }
+  engine->EnableTimeSync(options_.time_sync);
+  engine->SetRollbackBudget(options_.rollback_budget, 0);
+  engine->SetSnapshotInterval(options_.snapshot_interval);
+  engine->EnableSpeculativeBranches(options_.branches);
+  engine->EnableDesyncDetection(true);
+  engines_.push_back(engine);
+  managers_.push_back(manager);
+
+  int port = kFirstPort + engines_.size() - 1;
+  if (!engine->StartNetworkManager(port)) {
+    return false;
+  }
+  SetLinkModels(false);
+  if (engines_.size() == 1) {
+    return engine->AllowIncomingConnections("benchmark");
+  }
+
+  // Joins are given a generous amount of game time, since the host has to send everything.
+  engine->FindHosts(kFirstPort);
+  for (int i = 0; i < 1000 && engine->AvailableHosts().empty(); i++) {
+    Step(false);
+  }
+  if (engine->AvailableHosts().empty()) {
+    return false;
+  }
+  engine->Connect(engine->AvailableHosts()[0].first, engine->AvailableHosts()[0].second);
+  for (int i = 0; i < 5000; i++) {
+    GameEngineThinkState think_state = engine->Think();
+    if (think_state == kPlaying) {
+      return true;
+    }
+    if (think_state == kConnectionFailed || think_state == kIdle) {
+      return false;
+    }
+    Step(false);
+  }
+  return false;
+}
+
+void Benchmark::SetLinkModels(bool impaired) {
+  unsigned int seed = options_.seed;
+  for (int i = 0; i < managers_.size(); i++) {
+    for (int j = 0; j < managers_.size(); j++) {
+      MockLinkModel model;
+      model.latency_ms = options_.latency_ms;
+      if (options_.latency_spread_ms > 0) {
+        model.latency_ms += NextRandom(&seed) % (options_.latency_spread_ms + 1);
+      }
+      if (impaired) {
+        model.jitter_ms = options_.jitter_ms;
+        model.drop_rate = options_.loss_percent / 100.0;
+        model.retransmit_ms = options_.retransmit_ms;
+        model.bytes_per_second = options_.bytes_per_second;
+      }
+      router_.SetLinkModel(managers_[i]->GetKey(), managers_[j]->GetKey(), model);
+    }
+  }
+}
+
+bool Benchmark::Run() {
+  for (int i = 0; i < options_.engines; i++) {
+    if (!AddEngine()) {
+      printf("Engine %d was unable to join\n", i);
+      return false;
+    }
+  }
+  router_.SetSeed(options_.seed);
+  SetLinkModels(true);
+
+  base_thinks_ = 0;
+  base_rethinks_ = 0;
+  base_state_allocations_ = 0;
+  base_stalled_thinks_ = 0;
+  base_deferred_rollbacks_ = 0;
+  base_adopted_branch_states_ = 0;
+  for (int i = 0; i < engines_.size(); i++) {
+    base_stalled_thinks_ += engines_[i]->NumStalledThinks();
+    base_deferred_rollbacks_ += engines_[i]->NumDeferredRollbacks();
+    base_adopted_branch_states_ += engines_[i]->NumAdoptedBranchStates();
+    base_thinks_ += engines_[i]->NumThinks();
+    base_rethinks_ += engines_[i]->NumRethinks();
+    base_state_allocations_ += engines_[i]->NumStateAllocations();
+    GameEngineStats stats;
+    engines_[i]->GetStats(&stats);
+    base_depths_.Merge(stats.rollback_depth);
+    base_recreate_us_.Merge(stats.recreate_state_us);
+    base_adopt_us_.Merge(stats.adopt_branch_state_us);
+  }
+  base_packages_ = router_.NumPackagesSent();
+  base_bytes_ = router_.NumBytesSent();
+  base_dropped_ = router_.NumPackagesDropped();
+  inputs_ = 0;
+
+  long long allocations = NumAllocations();
+  int64 start_us = system()->GetTimeMicro();
+  for (int i = 0; i < options_.frames; i++) {
+    Step(true);
+  }
+  int64 elapsed_us = system()->GetTimeMicro() - start_us;
+  Report(elapsed_us, NumAllocations() - allocations);
+  return true;
+}
+
+// Returns the top of the first StatHistogram bucket that at least fraction of all rollbacks were no
+// deeper than, given the number of rollbacks in each bucket.
+static int Percentile(const vector<long long>& counts, long long total, double fraction) {
+  long long seen = 0;
+  for (int b = 0; b < counts.size(); b++) {
+    seen += counts[b];
+    if (seen > 0 && seen >= total * fraction) {
+      return StatHistogram::BucketUpperBound(b);
+    }
+  }
+  return 0;
+}
+
+void Benchmark::Report(long long elapsed_us, long long allocations) {
+  long long thinks = -base_thinks_;
+  long long rethinks = -base_rethinks_;
+  long long state_allocations = -base_state_allocations_;
+  long long desyncs = 0;
+  long long stalled_thinks = -base_stalled_thinks_;
+  long long deferred_rollbacks = -base_deferred_rollbacks_;
+  long long stored_states = 0;
+  long long adopted_branch_states = -base_adopted_branch_states_;
+  // Rollbacks from before the run are subtracted out bucket by bucket.
+  vector<long long> depths(StatHistogram::kNumBuckets);
+  for (int b = 0; b < depths.size(); b++) {
+    depths[b] = -base_depths_.bucket(b);
+  }
+  long long recreated_states = -base_recreate_us_.count();
+  long long recreate_us = -base_recreate_us_.sum();
+  long long adopt_copies = -base_adopt_us_.count();
+  long long adopt_us = -base_adopt_us_.sum();
+  for (int i = 0; i < engines_.size(); i++) {
+    thinks += engines_[i]->NumThinks();
+    rethinks += engines_[i]->NumRethinks();
+    state_allocations += engines_[i]->NumStateAllocations();
+    desyncs += engines_[i]->NumDesyncs();
+    stalled_thinks += engines_[i]->NumStalledThinks();
+    deferred_rollbacks += engines_[i]->NumDeferredRollbacks();
+    stored_states += engines_[i]->NumStoredStates();
+    adopted_branch_states += engines_[i]->NumAdoptedBranchStates();
+    GameEngineStats stats;
+    engines_[i]->GetStats(&stats);
+    for (int b = 0; b < depths.size(); b++) {
+      depths[b] += stats.rollback_depth.bucket(b);
+    }
+    recreated_states += stats.recreate_state_us.count();
+    recreate_us += stats.recreate_state_us.sum();
+    adopt_copies += stats.adopt_branch_state_us.count();
+    adopt_us += stats.adopt_branch_state_us.sum();
+  }
+  long long rollbacks = 0;
+  for (int b = 0; b < depths.size(); b++) {
+    rollbacks += depths[b];
+  }
+  double seconds = elapsed_us > 0 ? elapsed_us / 1000000.0 : 1e-6;
+  int state_frames = options_.frames * kMsPerThink / kMsPerStateFrame;
+  printf("{\"engines\": %d, \"frames\": %d, \"latency_ms\": %d, \"latency_spread_ms\": %d, "
+         "\"jitter_ms\": %d, \"loss_percent\": %d, \"retransmit_ms\": %d, "
+         "\"bytes_per_second\": %d, \"seed\": %d, \"predict\": %s, \"time_sync\": %s, "
+         "\"relay\": %s, \"rollback_budget\": %d, \"snapshot_interval\": %d, \"branches\": %d, "
+         "\"elapsed_ms\": %.3f, \"thinks\": %lld, \"rethinks\": %lld, "
+         "\"thinks_per_sec\": %.1f, \"rethinks_per_sec\": %.1f, "
+         "\"rollbacks\": %lld, \"rollback_depth_p50\": %d, \"rollback_depth_p90\": %d, "
+         "\"rollback_depth_p99\": %d, \"rollback_depth_max\": %d, "
+         "\"inputs\": %d, \"packages\": %d, \"dropped\": %d, \"bytes\": %lld, "
+         "\"bytes_per_state_frame\": %.1f, "
+         "\"allocations\": %lld, \"allocations_per_state_frame\": %.1f, "
+         "\"state_allocations\": %lld, \"stalled_thinks\": %lld, \"deferred_rollbacks\": %lld, "
+         "\"stored_states\": %lld, \"adopted_branch_states\": %lld, "
+         "\"recreate_state_us\": %.2f, \"adopt_state_us\": %.2f, \"desyncs\": %lld}\n",
+         options_.engines, options_.frames, options_.latency_ms, options_.latency_spread_ms,
+         options_.jitter_ms, options_.loss_percent, options_.retransmit_ms,
+         options_.bytes_per_second, options_.seed, options_.predict ? "true" : "false",
+         options_.time_sync ? "true" : "false", options_.relay ? "true" : "false",
+         options_.rollback_budget,
+         options_.snapshot_interval, options_.branches, elapsed_us / 1000.0, thinks, rethinks,
+         thinks / seconds, rethinks / seconds,
+         rollbacks, Percentile(depths, rollbacks, 0.5), Percentile(depths, rollbacks, 0.9),
+         Percentile(depths, rollbacks, 0.99), Percentile(depths, rollbacks, 1.0),
+         inputs_, router_.NumPackagesSent() - base_packages_,
+         router_.NumPackagesDropped() - base_dropped_, router_.NumBytesSent() - base_bytes_,
+         (router_.NumBytesSent() - base_bytes_) / (double)state_frames,
+         allocations, allocations / (double)state_frames,
+         state_allocations, stalled_thinks, deferred_rollbacks,
+         stored_states, adopted_branch_states,
+         recreated_states > 0 ? recreate_us / (double)recreated_states : 0.0,
+         adopt_copies > 0 ? adopt_us / (double)adopt_copies : 0.0, desyncs);
+}
+
+int main(int argc, char** argv) {
+  BenchmarkOptions options;
+  if (!ParseOptions(argc, argv, &options)) {
+    return 1;
+  }
+  System::Init();
+  Benchmark benchmark(options);
+  return benchmark.Run() ? 0 : 1;
+}
@@ -3,8 +3,13 @@
 #include "TestProtos.pb.h"
 #include "GameState.h"
 #include "GameConnection.h"
+#include "CowArray.h"
+#include "GameEngineScheduler.h"
+#include "GameReplay.h"
+#include "GameSpectator.h"
 #include "../System.h"
 
+#include "../net/MatchNetworkManager.h"
 #include "../net/MockRouter.h"
 #include "../net/MockNetworkManager.h"
 
@@ -19,16 +24,12 @@ class TestState : public GameState {
 
   virtual bool Think() {
     for (int i = 0; i < state.positions_size(); i++) {
-      state.mutable_positions(i)->set_x(state.positions(i).x() + 1);
-      state.mutable_positions(i)->set_y(state.positions(i).y() + 2);
-      if (state.positions(i).x() < 0) {
-        state.mutable_positions(i)->set_x(0);
-      }
-      if (state.positions(i).y() < 0) {
-        state.mutable_positions(i)->set_y(0);
-      }
+      int x = state.positions(i).x() + 1;
+      int y = state.positions(i).y() + 2;
+      SetPosition(i, x < 0 ? 0 : x, y < 0 ? 0 : y);
     }
     state.set_thinks(state.thinks() + 1);
+    return true;
   };
 
   virtual GameState* Copy() const {
@@ -37,6 +38,11 @@ class TestState : public GameState {
     return new_state;
   }
 
+  virtual bool CopyInto(GameState* dst) const {
+    static_cast<TestState*>(dst)->state.CopyFrom(state);
+    return true;
+  }
+
   virtual void SerializeToString(string* data) const {
     state.SerializeToString(data);
   }
@@ -45,12 +51,18 @@ class TestState : public GameState {
     state.ParseFromString(data);
   }
 
-  void AddPlayer() {
+  virtual void AddPlayer() {
     PlayerPosition* pos = state.add_positions();
     pos->set_x(0);
     pos->set_y(0);
   }
 
+  // Think() and MovePlayerEvent move players through here, so that subclasses can keep track.
+  virtual void SetPosition(int player, int x, int y) {
+    state.mutable_positions(player)->set_x(x);
+    state.mutable_positions(player)->set_y(y);
+  }
+
   TestGameState state;
   static int thinks;
 };
@@ -73,10 +85,9 @@ class MovePlayerEvent : public GameEvent {
   virtual GameEventResult* ApplyToGameState(GameState* game_state) const {
     TestState* state = static_cast<TestState*>(game_state);
     if (state->state.positions_size() > typed_data_->player()) {
-      int x = state->state.positions(typed_data_->player()).x();
-      state->state.mutable_positions(typed_data_->player())->set_x(x + typed_data_->x());
-      int y = state->state.positions(typed_data_->player()).y();
-      state->state.mutable_positions(typed_data_->player())->set_y(y + typed_data_->y());
+      const PlayerPosition& pos = state->state.positions(typed_data_->player());
+      state->SetPosition(
+          typed_data_->player(), pos.x() + typed_data_->x(), pos.y() + typed_data_->y());
     }
     state->state.set_applies(state->state.applies() + 1);
     return NULL;
@@ -251,6 +262,185 @@ TEST(GameEngineTest, TestSkippingManyFramesAtATime) {
   EXPECT_EQ(78, ts.state.positions(0).y());
 }
 
+TEST(GameEngineTest, TestSteadyStateRollbackDoesNotAllocateStates) {
+  TestState s;
+
+  GameEngine engine(s, 50, 30, 10, 0);
+  TestFrameCalculator* frame_calculator = new TestFrameCalculator();
+  engine.InstallFrameCalculator(frame_calculator);
+
+  // Fill up the history window so that there are states to recycle.
+  int i;
+  for (i = 0; i < 1000; i++) {
+    frame_calculator->SetTime(i);
+    engine.Think();
+  }
+  int allocations = engine.NumStateAllocations();
+  int rethinks = engine.NumRethinks();
+  EXPECT_GE(52, allocations);
+  for (; i < 5000; i++) {
+    frame_calculator->SetTime(i);
+    if (i%10==5) {
+      MovePlayerEvent* mpe = NewMovePlayerEvent();
+      mpe->SetData(0, 1, 1);
+      engine.ApplyEvent(mpe);
+    }
+    engine.Think();
+  }
+  EXPECT_LT(rethinks, engine.NumRethinks());
+  EXPECT_EQ(allocations, engine.NumStateAllocations());
+}
+
+// A TestState that leaves CopyInto unimplemented, like most GameStates do.
+class UnrecyclableTestState : public TestState {
+ public:
+  virtual GameState* Copy() const {
+    UnrecyclableTestState* new_state = new UnrecyclableTestState;
+    new_state->state.CopyFrom(state);
+    return new_state;
+  }
+  virtual bool CopyInto(GameState* dst) const {
+    return false;
+  }
+};
+
+TEST(GameEngineTest, TestStatesWithoutCopyIntoAreNotHoarded) {
+  UnrecyclableTestState s;
+
+  GameEngine engine(s, 50, 30, 10, 0);
+  TestFrameCalculator* frame_calculator = new TestFrameCalculator();
+  engine.InstallFrameCalculator(frame_calculator);
+
+  for (int i = 0; i < 20000; i++) {
+    frame_calculator->SetTime(i);
+    if (i%10==5) {
+      MovePlayerEvent* mpe = NewMovePlayerEvent();
+      mpe->SetData(0, 1, 1);
+      engine.ApplyEvent(mpe);
+    }
+    engine.Think();
+    // The history holds 51 states, and the pool never holds more than that.
+    ASSERT_GE(2 * 51, engine.NumStoredStates());
+  }
+}
+
+// A MovePlayerEvent that keeps track of how many instances are alive.
+class CountedMoveEvent : public MovePlayerEvent {
+ public:
+  CountedMoveEvent() { live++; }
+  ~CountedMoveEvent() { live--; }
+  static int live;
+};
+int CountedMoveEvent::live = 0;
+REGISTER_EVENT(3, CountedMoveEvent);
+
+TEST(GameEngineTest, TestEventsAreReleasedWhenTheirTimestepRetires) {
+  TestState s;
+  {
+    GameEngine engine(s, 50, 30, 10, 0);
+    TestFrameCalculator* frame_calculator = new TestFrameCalculator();
+    engine.InstallFrameCalculator(frame_calculator);
+
+    for (int i = 0; i < 5000; i++) {
+      frame_calculator->SetTime(i);
+      if (i % 5 == 0) {
+        CountedMoveEvent* event = NewCountedMoveEvent();
+        event->SetData(0, 1, 1);
+        engine.ApplyEvent(event);
+      }
+      engine.Think();
+      // Two events per timestep, and the event window holds 101 timesteps.
+      ASSERT_GE(2 * 101 + 2, CountedMoveEvent::live);
+    }
+    const TestState& ts = (const TestState&)engine.GetCurrentGameState();
+    // The last event is still waiting to be queued for the next timestep.
+    EXPECT_EQ(500 + 999, ts.state.positions(0).x());
+  }
+  EXPECT_EQ(0, CountedMoveEvent::live);
+}
+
+struct PagedEntity {
+  int x;
+  int y;
+};
+
+// A large state backed by a CowArray.  Each Think only touches one entity, so each timestep's copy
+// should only end up duplicating a single page.
+class PagedTestState : public GameState {
+ public:
+  PagedTestState() : entities(4096), thinks(0) {}
+  virtual ~PagedTestState() {}
+
+  virtual bool Think() {
+    entities.Mutable(thinks % entities.size())->x++;
+    thinks++;
+    return true;
+  }
+
+  virtual GameState* Copy() const {
+    return new PagedTestState(*this);
+  }
+
+  virtual void SerializeToString(string* data) const {
+    data->clear();
+    data->append((const char*)&thinks, sizeof(thinks));
+    entities.AppendToString(data);
+  }
+
+  virtual void ParseFromString(const string& data) {
+    memcpy(&thinks, data.data(), sizeof(thinks));
+    int pos = sizeof(thinks);
+    entities.ParseFromString(data, &pos);
+  }
+
+  CowArray<PagedEntity> entities;
+  int thinks;
+};
+
+// Moves one of a PagedTestState's entities, which copies the page it is on.
+class PagedMoveEvent : public GameEvent {
+ public:
+  PagedMoveEvent() {
+    typed_data_ = new TestEngineMoveEvent;
+    data_ = typed_data_;
+  }
+  ~PagedMoveEvent() {
+    delete typed_data_;
+  }
+  void SetData(int entity, int x, int y) {
+    typed_data_->set_player(entity);
+    typed_data_->set_x(x);
+    typed_data_->set_y(y);
+  }
+  virtual GameEventResult* ApplyToGameState(GameState* game_state) const {
+    PagedTestState* state = static_cast<PagedTestState*>(game_state);
+    PagedEntity* entity = state->entities.Mutable(typed_data_->player());
+    entity->x += typed_data_->x();
+    entity->y += typed_data_->y();
+    return NULL;
+  }
+ private:
+  TestEngineMoveEvent* typed_data_;
+};
+REGISTER_EVENT(4, PagedMoveEvent);
+
+TEST(GameEngineTest, TestCopyOnWriteStatesOnlyCopyMutatedPages) {
+  PagedTestState s;
+
+  GameEngine engine(s, 50, 30, 10, 0);
+  TestFrameCalculator* frame_calculator = new TestFrameCalculator();
+  engine.InstallFrameCalculator(frame_calculator);
+
+  for (int i = 0; i < 1000; i++) {
+    frame_calculator->SetTime(i);
+    engine.Think();
+    const PagedTestState& ps = (const PagedTestState&)engine.GetCurrentGameState();
+    EXPECT_EQ(i/10 + 1, ps.thinks);
+    EXPECT_GE(1, ps.entities.pages_copied());
+    EXPECT_LE(ps.entities.NumPages() - 1, ps.entities.NumSharedPages());
+  }
+}
+
 TEST(GameEngineTest, TestEnginesCanHostAndFindHosts) {
   TestState s;
   s.AddPlayer();
@@ -533,6 +723,72 @@ void ConnectEngines(
   }
 }
 
+// Two engines playing each other on test clocks, for the tests that need a network.  engine1 hosts
+// and engine2 joins it, and then engine1's clock is put lead_ms ahead, so that everything it
+// receives from engine2 arrives that much late.  Both engines need a TestFrameCalculator and a
+// MockNetworkManager on the same MockRouter.  If that router is passed in, its clock is moved along
+// with the engines' once they are playing.
+class EnginePair {
+ public:
+  EnginePair(GameEngine* engine1, GameEngine* engine2, int lead_ms, MockRouter* router = NULL)
+    : engine1_(engine1),
+      engine2_(engine2),
+      router_(router),
+      waiter_(5, 10) {
+    all_engines_.insert(make_pair(engine1, engine1->GetFrameCalculator()));
+    all_engines_.insert(make_pair(engine2, engine2->GetFrameCalculator()));
+    ConnectEngines(engine1, 65001, engine2, 65002, all_engines_, &waiter_);
+    engine1->GetFrameCalculator()->SetTime(engine1->GetFrameCalculator()->GetTime() + lead_ms);
+  }
+
+  GameEngine* engine1() { return engine1_; }
+  GameEngine* engine2() { return engine2_; }
+
+  // Thinks both engines once, 5ms later than the last time, and returns engine2's think state.
+  GameEngineThinkState Think() {
+    return Think(engine2_);
+  }
+
+  // Has a third engine join engine1 on the given port.  Its clock starts where engine2's is, and
+  // from then on it is thought along with the other two.  Returns whether it got to play.
+  bool Join(GameEngine* engine, int port) {
+    engine->GetFrameCalculator()->SetTime(engine2_->GetFrameCalculator()->GetTime());
+    all_engines_.insert(make_pair(engine, engine->GetFrameCalculator()));
+    if (!engine->StartNetworkManager(port)) {
+      return false;
+    }
+    engine->FindHosts(65001);
+    for (int i = 0; i < 1000 && engine->AvailableHosts().empty(); i++) {
+      Think(engine);
+    }
+    if (engine->AvailableHosts().empty()) {
+      return false;
+    }
+    engine->Connect(engine->AvailableHosts()[0].first, engine->AvailableHosts()[0].second);
+    for (int i = 0; i < 1000; i++) {
+      if (Think(engine) == kPlaying) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  GameEngine* engine1_;
+  GameEngine* engine2_;
+  MockRouter* router_;
+  set<pair<GameEngine*, GameEngineFrameCalculator*> > all_engines_;
+  TestTimerWaiter waiter_;
+
+  GameEngineThinkState Think(GameEngine* client) {
+    GameEngineThinkState think_state = ThinkAll(client, all_engines_, &waiter_);
+    if (router_ != NULL) {
+      router_->SetTime(router_->GetTime() + 5);
+    }
+    return think_state;
+  }
+};
+
 #if 0
 TEST(GameEngineTest, TestEnginesCanConnectArbitrarilyX) {
   TestState s;
@@ -726,3 +982,1274 @@ TEST(GameEngineTest, TestEnginesCanConnectArbitrarily) {
   }
 }
 */
+
+TEST(GameEngineTest, TestTemporaryEngineIDsAreRecycled) {
+  TestState s;
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s, 10, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+  GameEngine engine3(s);
+  engine3.InstallFrameCalculator(new TestFrameCalculator());
+  engine3.InstallNetworkManager(new MockNetworkManager(&router));
+
+  EnginePair engines(&engine1, &engine2, 0);
+  EXPECT_EQ(2, engine2.engine_id());
+
+  // Once engine2's NewEngineEvent is out of the history, its temporary id goes to engine3.
+  for (int i = 0; i < 50; i++) {
+    engines.Think();
+  }
+  ASSERT_TRUE(engines.Join(&engine3, 65003));
+  EXPECT_EQ(3, engine3.engine_id());
+}
+
+class NoOpEvent : public GameEvent {
+ public:
+  NoOpEvent() {
+    typed_data_ = new TestEngineMoveEvent;
+    typed_data_->set_player(0);
+    typed_data_->set_x(0);
+    typed_data_->set_y(0);
+    data_ = typed_data_;
+  }
+  ~NoOpEvent() {
+    delete typed_data_;
+  }
+  virtual bool IsNoOp() const {
+    return true;
+  }
+ private:
+  TestEngineMoveEvent* typed_data_;
+};
+REGISTER_EVENT(2, NoOpEvent);
+
+TEST(GameEngineTest, TestLateNoOpEventsDoNotCauseRollbacks) {
+  TestState s;
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+
+  // Put engine1 ahead so that everything it receives from engine2 arrives late.
+  EnginePair engines(&engine1, &engine2, 40);
+  engines.Think();
+
+  int skipped = engine1.NumSkippedRollbacks();
+  int rethinks = engine1.NumRethinks();
+  for (int i = 0; i < 200; i++) {
+    if (i % 3 == 0) {
+      engine2.ApplyEvent(NewNoOpEvent());
+    }
+    engines.Think();
+  }
+  EXPECT_LT(skipped + 50, engine1.NumSkippedRollbacks());
+  // Without skipping, every late package would re-think several frames.  The only rethinks left
+  // are the head frame being re-thought when Think is called twice in the same timestep.
+  EXPECT_GE(rethinks + 200, engine1.NumRethinks());
+
+  // engine2's state should be the same as engine1's at the same timestep once everything settles.
+  for (int i = 0; i < 20; i++) {
+    engines.Think();
+  }
+  engine2.GetFrameCalculator()->SetTime(engine1.GetFrameCalculator()->GetTime());
+  engines.Think();
+  const TestState& ts1 = (const TestState&)engine1.GetCurrentGameState();
+  const TestState& ts2 = (const TestState&)engine2.GetCurrentGameState();
+  EXPECT_EQ(ts1.state.thinks(), ts2.state.thinks());
+}
+
+// A TestState that supports GameState::Hash().  The hash only covers the player positions, and is
+// salted so that tests can simulate engines that have diverged.  It is kept up to date as players
+// move, so Hash() doesn't have to look at the state.
+class HashedTestState : public TestState {
+ public:
+  HashedTestState(uint32 salt) : salt_(salt) {
+    hash_ = ComputeHash();
+  }
+
+  virtual GameState* Copy() const {
+    HashedTestState* new_state = new HashedTestState(salt_);
+    CopyInto(new_state);
+    return new_state;
+  }
+
+  virtual bool CopyInto(GameState* dst) const {
+    HashedTestState* hashed_dst = static_cast<HashedTestState*>(dst);
+    hashed_dst->state.CopyFrom(state);
+    hashed_dst->salt_ = salt_;
+    hashed_dst->hash_ = hash_;
+    return true;
+  }
+
+  virtual void ParseFromString(const string& data) {
+    TestState::ParseFromString(data);
+    hash_ = ComputeHash();
+  }
+
+  virtual void AddPlayer() {
+    TestState::AddPlayer();
+    hash_ ^= PositionHash(state.positions_size() - 1, 0, 0);
+  }
+
+  virtual void SetPosition(int player, int x, int y) {
+    const PlayerPosition& pos = state.positions(player);
+    hash_ ^= PositionHash(player, pos.x(), pos.y()) ^ PositionHash(player, x, y);
+    TestState::SetPosition(player, x, y);
+  }
+
+  virtual bool Hash(uint32* hash) const {
+    *hash = hash_;
+    return true;
+  }
+
+  // applies only counts events for the tests' benefit, so like the hash this only looks at the
+  // positions.
+  virtual bool Equals(const GameState& other) const {
+    const TestGameState& other_state = static_cast<const HashedTestState&>(other).state;
+    if (state.positions_size() != other_state.positions_size()) {
+      return false;
+    }
+    for (int i = 0; i < state.positions_size(); i++) {
+      if (state.positions(i).x() != other_state.positions(i).x() ||
+          state.positions(i).y() != other_state.positions(i).y()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  static uint32 PositionHash(int player, int x, int y) {
+    return MixStateHash(player * 2 + x * 4096) ^ MixStateHash(player * 2 + 1 + y * 4096);
+  }
+
+  // Only needed when the positions come from somewhere other than SetPosition.
+  uint32 ComputeHash() const {
+    uint32 hash = MixStateHash(salt_);
+    for (int i = 0; i < state.positions_size(); i++) {
+      hash ^= PositionHash(i, state.positions(i).x(), state.positions(i).y());
+    }
+    return hash;
+  }
+
+  uint32 salt_;
+  uint32 hash_;
+};
+
+// Thinks both engines frames times, with both players moving, or standing still if still is set.
+// engine1 should be ahead, so that everything it receives from engine2 arrives late.
+void RunHashedEngines(EnginePair* engines, int frames, bool still) {
+  GameEngine* engine1 = engines->engine1();
+  GameEngine* engine2 = engines->engine2();
+  for (int i = 0; i < frames; i++) {
+    if (i % 3 == 0) {
+      MovePlayerEvent* event = NewMovePlayerEvent();
+      event->SetData(1, still ? 0 : 1, 0);
+      engine2->ApplyEvent(event);
+    }
+    if (i % 5 == 0) {
+      MovePlayerEvent* event = NewMovePlayerEvent();
+      event->SetData(0, 0, still ? 0 : -1);
+      engine1->ApplyEvent(event);
+    }
+    engines->Think();
+  }
+}
+
+TEST(GameEngineTest, TestStateHashesMatchBetweenEngines) {
+  HashedTestState s(0);
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  engine1.EnableDesyncDetection(true);
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+  engine2.EnableDesyncDetection(true);
+
+  EnginePair engines(&engine1, &engine2, 40);
+  RunHashedEngines(&engines, 200, false);
+  EXPECT_LT(20, engine1.NumHashesCompared());
+  EXPECT_LT(20, engine2.NumHashesCompared());
+  EXPECT_EQ(0, engine1.NumDesyncs());
+  EXPECT_EQ(0, engine2.NumDesyncs());
+  EXPECT_EQ(-1, engine1.DesyncTimestep());
+  EXPECT_EQ(-1, engine2.DesyncTimestep());
+}
+
+TEST(GameEngineTest, TestStateHashesDetectDesyncs) {
+  HashedTestState s1(0);
+  s1.AddPlayer();
+  // engine2 will build all of its states from this one, so its hashes never match engine1's.
+  HashedTestState s2(1);
+  s2.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s1, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  engine1.EnableDesyncDetection(true);
+  GameEngine engine2(s2);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+  engine2.EnableDesyncDetection(true);
+
+  EnginePair engines(&engine1, &engine2, 40);
+  RunHashedEngines(&engines, 100, false);
+  EXPECT_LT(0, engine1.NumDesyncs());
+  EXPECT_LT(0, engine2.NumDesyncs());
+  EXPECT_LE(0, engine1.DesyncTimestep());
+  EXPECT_LE(0, engine2.DesyncTimestep());
+}
+
+TEST(GameEngineTest, TestUnchangedHashesCutOffRollbacks) {
+  HashedTestState s(0);
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  engine1.EnableDesyncDetection(true);
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+  engine2.EnableDesyncDetection(true);
+
+  // Moving by zero is not a no-op as far as the engine can tell, but it doesn't change the hash.
+  int rethinks = engine1.NumRethinks();
+  EnginePair engines(&engine1, &engine2, 40);
+  RunHashedEngines(&engines, 200, true);
+  EXPECT_LT(20, engine1.NumHashCutoffs());
+  EXPECT_GE(rethinks + 300, engine1.NumRethinks());
+  EXPECT_EQ(0, engine1.NumDesyncs());
+  EXPECT_EQ(0, engine2.NumDesyncs());
+}
+
+// A HashedTestState whose hash never changes, so every re-simulated state collides with the one it
+// replaces.
+class CollidingTestState : public HashedTestState {
+ public:
+  CollidingTestState() : HashedTestState(0) {}
+
+  virtual GameState* Copy() const {
+    CollidingTestState* new_state = new CollidingTestState;
+    CopyInto(new_state);
+    return new_state;
+  }
+
+  virtual bool Hash(uint32* hash) const {
+    *hash = 0;
+    return true;
+  }
+};
+
+TEST(GameEngineTest, TestHashCollisionsDoNotCutOffRollbacks) {
+  CollidingTestState s;
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  engine1.EnableDesyncDetection(true);
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+  engine2.EnableDesyncDetection(true);
+
+  // Every late package moves a player, so no rollback may stop early, even though the hashes all
+  // match.  Desync detection can't notice if one does, but the states would differ.
+  EnginePair engines(&engine1, &engine2, 40);
+  RunHashedEngines(&engines, 200, false);
+  engine2.GetFrameCalculator()->SetTime(engine1.GetFrameCalculator()->GetTime());
+  for (int i = 0; i < 20; i++) {
+    engines.Think();
+  }
+
+  const TestState& ts1 = (const TestState&)engine1.GetCurrentGameState();
+  const TestState& ts2 = (const TestState&)engine2.GetCurrentGameState();
+  EXPECT_EQ(ts1.state.thinks(), ts2.state.thinks());
+  ASSERT_EQ(2, ts1.state.positions_size());
+  ASSERT_EQ(2, ts2.state.positions_size());
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(ts1.state.positions(i).x(), ts2.state.positions(i).x());
+    EXPECT_EQ(ts1.state.positions(i).y(), ts2.state.positions(i).y());
+  }
+}
+
+TEST(GameEngineTest, TestStatsDescribeRollbacksAndTraffic) {
+  HashedTestState s(0);
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+
+  EnginePair engines(&engine1, &engine2, 40);
+  RunHashedEngines(&engines, 200, false);
+  GameEngineStats stats1, stats2;
+  engine1.GetStats(&stats1);
+  engine2.GetStats(&stats2);
+
+  EXPECT_EQ(engine1.NumThinks(), stats1.thinks);
+  EXPECT_EQ(engine1.NumRethinks(), stats1.rethinks);
+  EXPECT_EQ(stats1.thinks, stats1.confirmed_frames + stats1.speculative_frames);
+  EXPECT_EQ(stats1.thinks, stats1.recreate_state_us.count());
+  EXPECT_EQ(stats1.thinks, stats1.apply_events_us.count());
+
+  // engine1 runs ahead, so it simulates engine2's timesteps before their events show up and has to
+  // roll back for them.
+  EXPECT_LT(0, stats1.speculative_frames);
+  EXPECT_LT(0, stats1.confirmed_frames);
+  EXPECT_LT(0, stats1.rollback_depth.count());
+  EXPECT_EQ(stats1.rethinks, stats1.rollback_depth.sum());
+  ASSERT_EQ(1, stats1.arrival_lateness_ms.count(engine2.engine_id()));
+  EXPECT_LE(40, stats1.arrival_lateness_ms[engine2.engine_id()].Percentile(0.5));
+  ASSERT_EQ(1, stats2.arrival_lateness_ms.count(engine1.engine_id()));
+  EXPECT_EQ(0, stats2.arrival_lateness_ms.count(engine2.engine_id()));
+  int move_index = GameEventFactory::GetEventTypeIndex(1);
+  ASSERT_LT(move_index, stats1.event_types.size());
+  EXPECT_LE(40, stats1.event_types[move_index].count);
+  // Event timing is off by default.
+  EXPECT_EQ(0, stats1.event_types[move_index].total_us);
+
+  // Everything engine2 received over the network, engine1 sent.
+  int64 sent = 0, received = 0;
+  for (int i = 0; i < stats1.connections.size(); i++) {
+    if (stats1.connections[i].address != GlopNetworkAddress(0, 0)) {
+      sent += stats1.connections[i].bytes_sent;
+    }
+  }
+  for (int i = 0; i < stats2.connections.size(); i++) {
+    if (stats2.connections[i].address != GlopNetworkAddress(0, 0)) {
+      received += stats2.connections[i].bytes_received;
+      EXPECT_LT(0, stats2.connections[i].packages_received);
+    }
+  }
+  EXPECT_LT(0, received);
+  EXPECT_LE(received, sent);
+}
+
+TEST(GameEngineTest, TestEnginesStayInSyncOverABadNetwork) {
+  HashedTestState s(0);
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  engine1.EnableDesyncDetection(true);
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+  engine2.EnableDesyncDetection(true);
+
+  EnginePair engines(&engine1, &engine2, 0, &router);
+
+  MockLinkModel model;
+  model.latency_ms = 15;
+  model.jitter_ms = 20;
+  model.spike_rate = 0.02;
+  model.spike_ms = 60;
+  model.drop_rate = 0.05;
+  model.retransmit_ms = 40;
+  router.SetSeed(12345);
+  router.SetDefaultLinkModel(model);
+  for (int i = 0; i < 600; i++) {
+    if (i < 400 && i % 3 == 0) {
+      MovePlayerEvent* event = NewMovePlayerEvent();
+      event->SetData(1, 1, 0);
+      engine2.ApplyEvent(event);
+      event = NewMovePlayerEvent();
+      event->SetData(0, 0, 1);
+      engine1.ApplyEvent(event);
+    }
+    engines.Think();
+  }
+  EXPECT_LT(0, router.NumPackagesDropped());
+  EXPECT_LT(0, engine1.NumRethinks());
+  EXPECT_LT(0, engine2.NumRethinks());
+  EXPECT_LT(20, engine1.NumHashesCompared());
+  EXPECT_LT(20, engine2.NumHashesCompared());
+  EXPECT_EQ(0, engine1.NumDesyncs());
+  EXPECT_EQ(0, engine2.NumDesyncs());
+}
+
+// Runs a host and two clients that all send events, and returns how many packages went over the
+// router once they were all playing.
+int RunRelayedEngines(bool relay, int frames, int* desyncs, int* hashes_compared) {
+  HashedTestState s(0);
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine host(s, 50, 30, 10, 0);
+  host.EnableRelay(relay);
+  GameEngine client1(s);
+  GameEngine client2(s);
+  GameEngine* engines[] = {&host, &client1, &client2};
+  for (int i = 0; i < 3; i++) {
+    engines[i]->InstallFrameCalculator(new TestFrameCalculator());
+    engines[i]->InstallNetworkManager(new MockNetworkManager(&router));
+    engines[i]->EnableDesyncDetection(true);
+  }
+  EnginePair first_two(&host, &client1, 0);
+  if (!first_two.Join(&client2, 65003)) {
+    return -1;
+  }
+
+  int base_packages = router.NumPackagesSent();
+  for (int i = 0; i < frames; i++) {
+    if (i % 3 == 0) {
+      for (int j = 0; j < 3; j++) {
+        MovePlayerEvent* event = NewMovePlayerEvent();
+        event->SetData(0, j, 1);
+        engines[j]->ApplyEvent(event);
+      }
+    }
+    first_two.Think();
+  }
+  *desyncs = 0;
+  *hashes_compared = 0;
+  for (int i = 0; i < 3; i++) {
+    *desyncs += engines[i]->NumDesyncs();
+    *hashes_compared += engines[i]->NumHashesCompared();
+  }
+  return router.NumPackagesSent() - base_packages;
+}
+
+TEST(GameEngineTest, TestRelayMergesForwardedPackages) {
+  int desyncs, hashes_compared;
+  int mesh_packages = RunRelayedEngines(false, 300, &desyncs, &hashes_compared);
+  ASSERT_LT(0, mesh_packages);
+  EXPECT_EQ(0, desyncs);
+  int relay_packages = RunRelayedEngines(true, 300, &desyncs, &hashes_compared);
+  ASSERT_LT(0, relay_packages);
+  EXPECT_EQ(0, desyncs);
+  EXPECT_LT(60, hashes_compared);
+
+  // The clients send exactly as much either way, but the host's forwarded packages ride along
+  // with its own instead of going out separately.
+  EXPECT_LT(relay_packages, mesh_packages);
+}
+
+TEST(GameEngineTest, TestEnginesWaitForEnginesThatFallTooFarBehind) {
+  HashedTestState s(0);
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  MockNetworkManager* manager1 = new MockNetworkManager(&router);
+  engine1.InstallNetworkManager(manager1);
+  engine1.EnableDesyncDetection(true);
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  MockNetworkManager* manager2 = new MockNetworkManager(&router);
+  engine2.InstallNetworkManager(manager2);
+  engine2.EnableDesyncDetection(true);
+
+  EnginePair engines(&engine1, &engine2, 0, &router);
+
+  // For a second and a half nothing from engine2 gets through, which is three times as long as
+  // engine1's history.  engine1 stops and waits for it, and then engine2 ends up waiting for
+  // engine1 in turn.
+  router.SetLatency(manager2->GetKey(), manager1->GetKey(), 1500);
+  int start_time = engine1.GetFrameCalculator()->GetTime();
+  for (int i = 0; i < 350; i++) {
+    if (i == 100) {
+      router.SetLatency(manager2->GetKey(), manager1->GetKey(), 0);
+    }
+    engines.Think();
+  }
+  EXPECT_LT(150, engine1.NumStalledThinks());
+  EXPECT_LT(50, engine2.NumStalledThinks());
+  EXPECT_GT(start_time + 1000, engine1.GetFrameCalculator()->GetTime());
+  int hashes = engine1.NumHashesCompared();
+
+  // Once the events arrive, everything carries on.
+  int stalled_thinks = engine1.NumStalledThinks();
+  int stalled_time = engine1.GetFrameCalculator()->GetTime();
+  for (int i = 0; i < 100; i++) {
+    engines.Think();
+  }
+  EXPECT_EQ(stalled_thinks, engine1.NumStalledThinks());
+  EXPECT_EQ(stalled_time + 500, engine1.GetFrameCalculator()->GetTime());
+  EXPECT_LT(hashes + 10, engine1.NumHashesCompared());
+  EXPECT_EQ(0, engine1.NumDesyncs());
+  EXPECT_EQ(0, engine2.NumDesyncs());
+}
+
+TEST(GameEngineTest, TestAsyncEnginesWaitForEnginesThatFallTooFarBehind) {
+  HashedTestState s(0);
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  MockNetworkManager* manager1 = new MockNetworkManager(&router);
+  engine1.InstallNetworkManager(manager1);
+  engine1.EnableDesyncDetection(true);
+  engine1.EnableAsyncRollback(true);
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  MockNetworkManager* manager2 = new MockNetworkManager(&router);
+  engine2.InstallNetworkManager(manager2);
+  engine2.EnableDesyncDetection(true);
+
+  EnginePair engines(&engine1, &engine2, 0, &router);
+
+  // The same as above, except that engine1's history belongs to its worker thread, and its clock
+  // has to stop all the same.
+  router.SetLatency(manager2->GetKey(), manager1->GetKey(), 1500);
+  int start_time = engine1.GetFrameCalculator()->GetTime();
+  for (int i = 0; i < 350; i++) {
+    if (i == 100) {
+      router.SetLatency(manager2->GetKey(), manager1->GetKey(), 0);
+    }
+    if (i % 3 == 0) {
+      MovePlayerEvent* event = NewMovePlayerEvent();
+      event->SetData(0, 1, 0);
+      engine1.ApplyEvent(event);
+    }
+    engines.Think();
+  }
+  EXPECT_LT(150, engine1.NumStalledThinks());
+  EXPECT_GT(start_time + 1000, engine1.GetFrameCalculator()->GetTime());
+  engine1.FlushAsyncRollback();
+  int hashes = engine1.NumHashesCompared();
+
+  for (int i = 0; i < 100; i++) {
+    engines.Think();
+  }
+  engine1.FlushAsyncRollback();
+  EXPECT_LT(hashes + 10, engine1.NumHashesCompared());
+  EXPECT_EQ(0, engine1.NumDesyncs());
+  EXPECT_EQ(0, engine2.NumDesyncs());
+}
+
+TEST(GameEngineTest, TestRollbackBudgetSpreadsDeepRollbacksOverSeveralThinks) {
+  HashedTestState s(0);
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  MockNetworkManager* manager1 = new MockNetworkManager(&router);
+  engine1.InstallNetworkManager(manager1);
+  engine1.EnableDesyncDetection(true);
+  engine1.SetRollbackBudget(3, 0);
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  MockNetworkManager* manager2 = new MockNetworkManager(&router);
+  engine2.InstallNetworkManager(manager2);
+  engine2.EnableDesyncDetection(true);
+
+  EnginePair engines(&engine1, &engine2, 0, &router);
+
+  // Every so often engine2's packages get held up for a fifth of a second, and then all arrive at
+  // once, which would normally mean re-simulating twenty states in one Think.
+  int most_rethinks = 0;
+  for (int i = 0; i < 300; i++) {
+    router.SetLatency(manager2->GetKey(), manager1->GetKey(), i % 100 < 40 ? 200 : 0);
+    if (i % 3 == 0) {
+      MovePlayerEvent* event = NewMovePlayerEvent();
+      event->SetData(1, 1, 0);
+      engine2.ApplyEvent(event);
+    }
+    if (i % 5 == 0) {
+      MovePlayerEvent* event = NewMovePlayerEvent();
+      event->SetData(0, 0, -1);
+      engine1.ApplyEvent(event);
+    }
+    int rethinks = engine1.NumRethinks();
+    engines.Think();
+    most_rethinks = max(most_rethinks, engine1.NumRethinks() - rethinks);
+  }
+  for (int i = 0; i < 50; i++) {
+    engines.Think();
+  }
+  EXPECT_LT(0, engine1.NumDeferredRollbacks());
+  EXPECT_GE(3, most_rethinks);
+  EXPECT_EQ(0, engine2.NumDeferredRollbacks());
+
+  // Once it has caught up, nothing was lost.
+  EXPECT_LT(10, engine1.NumHashesCompared());
+  EXPECT_EQ(0, engine1.NumDesyncs());
+  EXPECT_EQ(0, engine2.NumDesyncs());
+  engine2.GetFrameCalculator()->SetTime(engine1.GetFrameCalculator()->GetTime());
+  engines.Think();
+  const TestState& ts1 = (const TestState&)engine1.GetCurrentGameState();
+  const TestState& ts2 = (const TestState&)engine2.GetCurrentGameState();
+  EXPECT_EQ(ts1.state.thinks(), ts2.state.thinks());
+  ASSERT_EQ(2, ts1.state.positions_size());
+  ASSERT_EQ(2, ts2.state.positions_size());
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(ts1.state.positions(i).x(), ts2.state.positions(i).x());
+    EXPECT_EQ(ts1.state.positions(i).y(), ts2.state.positions(i).y());
+  }
+}
+
+TEST(GameEngineTest, TestSparseSnapshotsRebuildDroppedStates) {
+  HashedTestState s(0);
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  MockNetworkManager* manager1 = new MockNetworkManager(&router);
+  engine1.InstallNetworkManager(manager1);
+  engine1.EnableDesyncDetection(true);
+  engine1.SetSnapshotInterval(8);
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  MockNetworkManager* manager2 = new MockNetworkManager(&router);
+  engine2.InstallNetworkManager(manager2);
+  engine2.EnableDesyncDetection(true);
+
+  EnginePair engines(&engine1, &engine2, 0, &router);
+
+  // Both engines hear from each other a quarter of a second late, so each keeps a couple of dozen
+  // speculative states, and rolls most of them back whenever the other one moves.
+  router.SetLatency(manager1->GetKey(), manager2->GetKey(), 250);
+  router.SetLatency(manager2->GetKey(), manager1->GetKey(), 250);
+  int most_stored1 = 0;
+  int most_stored2 = 0;
+  for (int i = 0; i < 300; i++) {
+    if (i % 3 == 0) {
+      MovePlayerEvent* event = NewMovePlayerEvent();
+      event->SetData(1, 1, 0);
+      engine2.ApplyEvent(event);
+    }
+    if (i % 5 == 0) {
+      MovePlayerEvent* event = NewMovePlayerEvent();
+      event->SetData(0, 0, -1);
+      engine1.ApplyEvent(event);
+    }
+    engines.Think();
+    most_stored1 = max(most_stored1, engine1.NumStoredStates());
+    most_stored2 = max(most_stored2, engine2.NumStoredStates());
+  }
+  EXPECT_LT(0, engine1.NumRethinks());
+  EXPECT_GT(most_stored2 / 2, most_stored1);
+
+  router.SetLatency(manager1->GetKey(), manager2->GetKey(), 0);
+  router.SetLatency(manager2->GetKey(), manager1->GetKey(), 0);
+  for (int i = 0; i < 100; i++) {
+    engines.Think();
+  }
+  EXPECT_LT(10, engine1.NumHashesCompared());
+  EXPECT_EQ(0, engine1.NumDesyncs());
+  EXPECT_EQ(0, engine2.NumDesyncs());
+  engine2.GetFrameCalculator()->SetTime(engine1.GetFrameCalculator()->GetTime());
+  engines.Think();
+  const TestState& ts1 = (const TestState&)engine1.GetCurrentGameState();
+  const TestState& ts2 = (const TestState&)engine2.GetCurrentGameState();
+  EXPECT_EQ(ts1.state.thinks(), ts2.state.thinks());
+  ASSERT_EQ(2, ts1.state.positions_size());
+  ASSERT_EQ(2, ts2.state.positions_size());
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(ts1.state.positions(i).x(), ts2.state.positions(i).x());
+    EXPECT_EQ(ts1.state.positions(i).y(), ts2.state.positions(i).y());
+  }
+}
+
+TEST(GameEngineTest, TestReplaysReproduceTheCompleteStates) {
+  const char* filename = "GameEngine_test_replay.tmp";
+  HashedTestState s(0);
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+  EXPECT_FALSE(engine2.StartRecording(filename, 25));
+  ASSERT_TRUE(engine1.StartRecording(filename, 25));
+
+  // engine1 rolls back constantly, but only complete states make it into the replay.
+  EnginePair engines(&engine1, &engine2, 40);
+  RunHashedEngines(&engines, 200, false);
+  engine1.StopRecording();
+  string expected;
+  engine1.GetCompleteGameState().SerializeToString(&expected);
+
+  GameReplayRunner runner(s);
+  ASSERT_TRUE(runner.Load(filename));
+  EXPECT_EQ(-1, runner.GetFirstTimestep());
+  EXPECT_LE(4, runner.NumKeyframes());
+  EXPECT_EQ(runner.GetLastTimestep() - runner.GetFirstTimestep(), runner.RunToEnd());
+  string replayed;
+  runner.GetState().SerializeToString(&replayed);
+  EXPECT_TRUE(expected == replayed);
+  EXPECT_EQ(2, runner.GetInfo().engine_ids.size());
+
+  // Seeking backwards starts from a keyframe, and ends up where simulating from the start does.
+  StateTimestep middle = runner.GetLastTimestep() / 2 + 3;
+  ASSERT_TRUE(runner.Seek(middle));
+  EXPECT_EQ(middle, runner.GetTimestep());
+  runner.GetState().SerializeToString(&replayed);
+  GameReplayRunner from_start(s);
+  ASSERT_TRUE(from_start.Load(filename));
+  while (from_start.GetTimestep() < middle) {
+    from_start.Step();
+  }
+  from_start.GetState().SerializeToString(&expected);
+  EXPECT_TRUE(expected == replayed);
+  EXPECT_FALSE(runner.Seek(runner.GetLastTimestep() + 1));
+
+  // A replay that was cut off plays back as far as it goes.
+  FILE* file = fopen(filename, "rb");
+  ASSERT_TRUE(file != NULL);
+  string data;
+  char buffer[1024];
+  int size;
+  while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    data.append(buffer, size);
+  }
+  fclose(file);
+  remove(filename);
+  GameReplayRunner truncated(s);
+  ASSERT_TRUE(truncated.LoadFromString(data.substr(0, data.size() - 3)));
+  EXPECT_EQ(runner.GetLastTimestep() - 1, truncated.GetLastTimestep());
+  EXPECT_FALSE(truncated.LoadFromString(data.substr(0, 3)));
+
+  // One with a package from an engine id out of range is rejected.  This is a timestep record with
+  // one package, from engine 300, holding no events.
+  const char corrupt_record[] = {2, 0, 1, (char)0xd8, 4, 0};
+  GameReplayRunner corrupt(s);
+  EXPECT_FALSE(corrupt.LoadFromString(data + string(corrupt_record, sizeof(corrupt_record))));
+}
+
+void ThinkSpectators(
+    GameSpectatorServer* server,
+    GameSpectator* spectator,
+    GameSpectatorServer* relay,
+    GameSpectator* relayed) {
+  server->Think();
+  ASSERT_TRUE(spectator->Think());
+  relay->Think();
+  ASSERT_TRUE(relayed->Think());
+}
+
+TEST(GameEngineTest, TestSpectatorsWatchCompleteStatesThroughARelay) {
+  HashedTestState s(0);
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+  EnginePair engines(&engine1, &engine2, 40);
+  RunHashedEngines(&engines, 60, false);
+
+  // One spectator watches engine1, and another watches through the first.
+  GameSpectatorServer server(new MockNetworkManager(&router), 20);
+  ASSERT_TRUE(server.Start(65100, "watch"));
+  ASSERT_TRUE(engine1.AttachSpectatorServer(&server));
+  GameSpectator spectator(s, new MockNetworkManager(&router));
+  GameSpectatorServer relay(new MockNetworkManager(&router), 20);
+  ASSERT_TRUE(relay.Start(65101, "watch"));
+  spectator.RelayTo(&relay);
+  ASSERT_TRUE(spectator.StartNetworkManager(65102));
+  spectator.FindHosts(65100);
+  GameSpectator relayed(s, new MockNetworkManager(&router));
+  ASSERT_TRUE(relayed.StartNetworkManager(65103));
+  relayed.FindHosts(65101);
+  ThinkSpectators(&server, &spectator, &relay, &relayed);
+  ASSERT_EQ(1, spectator.AvailableHosts().size());
+  spectator.Connect(spectator.AvailableHosts()[0].first);
+
+  for (int i = 0; i < 200; i++) {
+    if (i % 3 == 0) {
+      MovePlayerEvent* event = NewMovePlayerEvent();
+      event->SetData(1, 1, 0);
+      engine2.ApplyEvent(event);
+    }
+    // The second spectator only shows up once the first one has been watching for a while, and
+    // is caught up from a keyframe.
+    if (i == 100) {
+      ASSERT_EQ(1, relayed.AvailableHosts().size());
+      relayed.Connect(relayed.AvailableHosts()[0].first);
+    }
+    engines.Think();
+    ThinkSpectators(&server, &spectator, &relay, &relayed);
+  }
+  ThinkSpectators(&server, &spectator, &relay, &relayed);
+  EXPECT_EQ(1, server.NumSpectators());
+  EXPECT_EQ(1, relay.NumSpectators());
+
+  string expected;
+  engine1.GetCompleteGameState().SerializeToString(&expected);
+  GameReplayRunner* replay = spectator.GetReplay();
+  ASSERT_TRUE(spectator.HasStarted());
+  EXPECT_LE(90, replay->RunToEnd());
+  string watched;
+  replay->GetState().SerializeToString(&watched);
+  EXPECT_TRUE(expected == watched);
+  // The spectators never joined the game.
+  EXPECT_EQ(2, replay->GetInfo().engine_ids.size());
+
+  GameReplayRunner* relayed_replay = relayed.GetReplay();
+  ASSERT_TRUE(relayed.HasStarted());
+  StateTimestep keyframe = relayed_replay->GetFirstTimestep();
+  EXPECT_LT(replay->GetFirstTimestep(), keyframe);
+  EXPECT_EQ(0, (keyframe - replay->GetFirstTimestep()) % 20);
+  EXPECT_EQ(replay->GetLastTimestep(), relayed_replay->GetLastTimestep());
+  relayed_replay->RunToEnd();
+  relayed_replay->GetState().SerializeToString(&watched);
+  EXPECT_TRUE(expected == watched);
+  engine1.AttachSpectatorServer(NULL);
+}
+
+TEST(GameEngineTest, TestAsyncRollbackMatchesSynchronousRollback) {
+  TestState s;
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  engine1.EnableAsyncRollback(true);
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+
+  // Put engine1 ahead so that everything it receives from engine2 arrives late and has to be
+  // re-simulated on engine1's worker thread.  The clocks here run far faster than real time, and
+  // Think() doesn't wait for the worker, so let it keep up the way it would in a real game.
+  EnginePair engines(&engine1, &engine2, 40);
+  for (int i = 0; i < 100; i++) {
+    if (i % 3 == 0) {
+      MovePlayerEvent* event = NewMovePlayerEvent();
+      event->SetData(1, 1, 0);
+      engine2.ApplyEvent(event);
+    }
+    if (i % 5 == 0) {
+      MovePlayerEvent* event = NewMovePlayerEvent();
+      event->SetData(0, 0, -1);
+      engine1.ApplyEvent(event);
+    }
+    engines.Think();
+    engine1.FlushAsyncRollback();
+  }
+  for (int i = 0; i < 20; i++) {
+    engines.Think();
+    engine1.FlushAsyncRollback();
+  }
+  engine2.GetFrameCalculator()->SetTime(engine1.GetFrameCalculator()->GetTime());
+  engines.Think();
+  engine1.FlushAsyncRollback();
+  EXPECT_LT(0, engine1.NumRethinks());
+
+  const TestState& ts1 = (const TestState&)engine1.GetCurrentGameState();
+  const TestState& ts2 = (const TestState&)engine2.GetCurrentGameState();
+  EXPECT_EQ(ts1.state.thinks(), ts2.state.thinks());
+  EXPECT_EQ(ts1.state.applies(), ts2.state.applies());
+  ASSERT_EQ(2, ts1.state.positions_size());
+  ASSERT_EQ(2, ts2.state.positions_size());
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(ts1.state.positions(i).x(), ts2.state.positions(i).x());
+    EXPECT_EQ(ts1.state.positions(i).y(), ts2.state.positions(i).y());
+  }
+}
+
+// Runs two engines where engine2 holds the same input down the whole time, so that every package
+// it sends looks like the last one, and engine1 runs far enough ahead that all of them arrive late.
+void RunSteadyInputEngines(GameEngine* engine1, GameEngine* engine2, int frames) {
+  EnginePair engines(engine1, engine2, 40);
+  for (int i = 0; i < frames; i++) {
+    // Two Thinks per state frame, so this is one event per timestep.
+    if (i % 2 == 0) {
+      MovePlayerEvent* event = NewMovePlayerEvent();
+      event->SetData(1, 1, 0);
+      engine2->ApplyEvent(event);
+    }
+    engines.Think();
+  }
+  for (int i = 0; i < 20; i++) {
+    engines.Think();
+  }
+  engine2->GetFrameCalculator()->SetTime(engine1->GetFrameCalculator()->GetTime());
+  engines.Think();
+}
+
+TEST(GameEngineTest, TestPredictedEventsAvoidRollbacks) {
+  TestState s;
+  s.AddPlayer();
+
+  int unpredicted_rethinks;
+  {
+    MockRouter router;
+    GameEngine engine1(s, 50, 30, 10, 0);
+    engine1.InstallFrameCalculator(new TestFrameCalculator());
+    engine1.InstallNetworkManager(new MockNetworkManager(&router));
+    GameEngine engine2(s);
+    engine2.InstallFrameCalculator(new TestFrameCalculator());
+    engine2.InstallNetworkManager(new MockNetworkManager(&router));
+    RunSteadyInputEngines(&engine1, &engine2, 200);
+    unpredicted_rethinks = engine1.NumRethinks();
+    EXPECT_EQ(0, engine1.NumPredictedPackages());
+  }
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  engine1.InstallEventPredictor(new RepeatLastEventsPredictor);
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+  RunSteadyInputEngines(&engine1, &engine2, 200);
+  EXPECT_LT(100, engine1.NumPredictedPackages());
+  EXPECT_GT(engine1.NumPredictedPackages() / 4, engine1.NumMispredictions());
+  EXPECT_GT(unpredicted_rethinks / 2, engine1.NumRethinks());
+
+  // Predictions must never leak into the final result.
+  const TestState& ts1 = (const TestState&)engine1.GetCurrentGameState();
+  const TestState& ts2 = (const TestState&)engine2.GetCurrentGameState();
+  EXPECT_EQ(ts1.state.thinks(), ts2.state.thinks());
+  EXPECT_EQ(ts1.state.applies(), ts2.state.applies());
+  ASSERT_EQ(2, ts1.state.positions_size());
+  ASSERT_EQ(2, ts2.state.positions_size());
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(ts1.state.positions(i).x(), ts2.state.positions(i).x());
+    EXPECT_EQ(ts1.state.positions(i).y(), ts2.state.positions(i).y());
+  }
+}
+
+TEST(GameEngineTest, TestSpeculativeBranchesAvoidRollbacks) {
+  TestState s;
+  s.AddPlayer();
+
+  int unbranched_rethinks;
+  {
+    MockRouter router;
+    GameEngine engine1(s, 50, 30, 10, 0);
+    engine1.InstallFrameCalculator(new TestFrameCalculator());
+    engine1.InstallNetworkManager(new MockNetworkManager(&router));
+    GameEngine engine2(s);
+    engine2.InstallFrameCalculator(new TestFrameCalculator());
+    engine2.InstallNetworkManager(new MockNetworkManager(&router));
+    RunSteadyInputEngines(&engine1, &engine2, 200);
+    unbranched_rethinks = engine1.NumRethinks();
+  }
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  engine1.EnableSpeculativeBranches(2);
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+
+  // Same as RunSteadyInputEngines, except that the workers always get to finish their branches.
+  EnginePair engines(&engine1, &engine2, 40);
+  for (int i = 0; i < 220; i++) {
+    if (i < 200 && i % 2 == 0) {
+      MovePlayerEvent* event = NewMovePlayerEvent();
+      event->SetData(1, 1, 0);
+      engine2.ApplyEvent(event);
+    }
+    engine1.FlushSpeculativeBranches();
+    engines.Think();
+  }
+  engine2.GetFrameCalculator()->SetTime(engine1.GetFrameCalculator()->GetTime());
+  engines.Think();
+  EXPECT_LT(50, engine1.NumAdoptedBranchStates());
+  EXPECT_GT(unbranched_rethinks / 2, engine1.NumRethinks());
+
+  const TestState& ts1 = (const TestState&)engine1.GetCurrentGameState();
+  const TestState& ts2 = (const TestState&)engine2.GetCurrentGameState();
+  EXPECT_EQ(ts1.state.thinks(), ts2.state.thinks());
+  EXPECT_EQ(ts1.state.applies(), ts2.state.applies());
+  ASSERT_EQ(2, ts1.state.positions_size());
+  ASSERT_EQ(2, ts2.state.positions_size());
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(ts1.state.positions(i).x(), ts2.state.positions(i).x());
+    EXPECT_EQ(ts1.state.positions(i).y(), ts2.state.positions(i).y());
+  }
+}
+
+// Branch states are copied by their worker while the simulation thread copies the history, so
+// this is mostly here for ThreadSanitizer to catch the two sharing CowArray pages.
+TEST(GameEngineTest, TestSpeculativeBranchesWorkWithCopyOnWriteStates) {
+  PagedTestState s;
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  engine1.EnableSpeculativeBranches(2);
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+
+  EnginePair engines(&engine1, &engine2, 40);
+  for (int i = 0; i < 220; i++) {
+    if (i < 200 && i % 2 == 0) {
+      PagedMoveEvent* event = NewPagedMoveEvent();
+      event->SetData(1, 1, 0);
+      engine2.ApplyEvent(event);
+    }
+    // Only wait for the workers some of the time, so that they are also busy during rollbacks.
+    if (i % 3 == 0) {
+      engine1.FlushSpeculativeBranches();
+    }
+    engines.Think();
+  }
+  engine2.GetFrameCalculator()->SetTime(engine1.GetFrameCalculator()->GetTime());
+  engines.Think();
+  EXPECT_LT(0, engine1.NumAdoptedBranchStates());
+
+  const PagedTestState& ps1 = (const PagedTestState&)engine1.GetCurrentGameState();
+  const PagedTestState& ps2 = (const PagedTestState&)engine2.GetCurrentGameState();
+  EXPECT_EQ(ps1.thinks, ps2.thinks);
+  ASSERT_EQ(ps1.entities.size(), ps2.entities.size());
+  for (int i = 0; i < ps1.entities.size(); i++) {
+    ASSERT_EQ(ps1.entities[i].x, ps2.entities[i].x);
+    ASSERT_EQ(ps1.entities[i].y, ps2.entities[i].y);
+  }
+}
+
+// Runs engine1 ahead of engine2 and returns how many timesteps engine1 re-simulated.
+int RunEnginesWithOffsetClocks(GameEngine* engine1, GameEngine* engine2, int frames) {
+  EnginePair engines(engine1, engine2, 40);
+  int rethinks = engine1->NumRethinks();
+  for (int i = 0; i < frames; i++) {
+    if (i % 3 == 0) {
+      MovePlayerEvent* event = NewMovePlayerEvent();
+      event->SetData(1, 1, 0);
+      engine2->ApplyEvent(event);
+    }
+    engines.Think();
+  }
+  return engine1->NumRethinks() - rethinks;
+}
+
+TEST(GameEngineTest, TestTimeSyncBringsClocksTogether) {
+  TestState s;
+  s.AddPlayer();
+
+  int unsynced_rethinks;
+  {
+    MockRouter router;
+    GameEngine engine1(s, 50, 30, 10, 0);
+    engine1.InstallFrameCalculator(new TestFrameCalculator());
+    engine1.InstallNetworkManager(new MockNetworkManager(&router));
+    GameEngine engine2(s);
+    engine2.InstallFrameCalculator(new TestFrameCalculator());
+    engine2.InstallNetworkManager(new MockNetworkManager(&router));
+    unsynced_rethinks = RunEnginesWithOffsetClocks(&engine1, &engine2, 300);
+  }
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  engine1.EnableTimeSync(true);
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+  engine2.EnableTimeSync(true);
+  int synced_rethinks = RunEnginesWithOffsetClocks(&engine1, &engine2, 300);
+  EXPECT_LT(0, engine1.RoundTripTime(engine2.engine_id()));
+  EXPECT_LT(0, engine2.RoundTripTime(engine1.engine_id()));
+  int difference =
+      engine1.GetFrameCalculator()->GetTime() - engine2.GetFrameCalculator()->GetTime();
+  EXPECT_GT(10, abs(difference));
+  EXPECT_GT(unsynced_rethinks, synced_rethinks);
+}
+
+TEST(GameEngineTest, TestAdaptiveDelayRaisesTheDelayForLatePackages) {
+  TestState s;
+  s.AddPlayer();
+
+  int fixed_rethinks;
+  {
+    MockRouter router;
+    GameEngine engine1(s, 50, 30, 10, 0);
+    engine1.InstallFrameCalculator(new TestFrameCalculator());
+    engine1.InstallNetworkManager(new MockNetworkManager(&router));
+    GameEngine engine2(s);
+    engine2.InstallFrameCalculator(new TestFrameCalculator());
+    engine2.InstallNetworkManager(new MockNetworkManager(&router));
+    fixed_rethinks = RunEnginesWithOffsetClocks(&engine1, &engine2, 300);
+  }
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  engine1.InstallNetworkManager(new MockNetworkManager(&router));
+  engine1.EnableAdaptiveDelay(true, 0, 25);
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  engine2.InstallNetworkManager(new MockNetworkManager(&router));
+  int adaptive_rethinks = RunEnginesWithOffsetClocks(&engine1, &engine2, 300);
+
+  // engine1 is far enough ahead that it wants more delay, and engine2 follows along.
+  EXPECT_LT(0, engine1.ms_delay());
+  EXPECT_GE(25, engine1.ms_delay());
+  EXPECT_EQ(engine1.ms_delay(), engine2.ms_delay());
+  EXPECT_LE(1, engine1.NumDelayChanges());
+  EXPECT_EQ(engine1.NumDelayChanges(), engine2.NumDelayChanges());
+  EXPECT_GT(fixed_rethinks, adaptive_rethinks);
+}
+
+TEST(GameEngineTest, TestLateDelayChangesAreStillMade) {
+  TestState s;
+  s.AddPlayer();
+
+  MockRouter router;
+  GameEngine engine1(s, 50, 30, 10, 0);
+  engine1.InstallFrameCalculator(new TestFrameCalculator());
+  MockNetworkManager* manager1 = new MockNetworkManager(&router);
+  engine1.InstallNetworkManager(manager1);
+  GameEngine engine2(s);
+  engine2.InstallFrameCalculator(new TestFrameCalculator());
+  MockNetworkManager* manager2 = new MockNetworkManager(&router);
+  engine2.InstallNetworkManager(manager2);
+
+  EnginePair engines(&engine1, &engine2, 40, &router);
+
+  // Everything engine1 sends takes longer to get to engine2 than engine1 announces its delay
+  // changes ahead of time, so engine2 only hears about them after they were due.
+  router.SetLatency(manager1->GetKey(), manager2->GetKey(), 400);
+  engine1.EnableAdaptiveDelay(true, 0, 25);
+  for (int i = 0; i < 400; i++) {
+    if (i == 300) {
+      router.SetLatency(manager1->GetKey(), manager2->GetKey(), 0);
+    }
+    if (i % 3 == 0) {
+      MovePlayerEvent* event = NewMovePlayerEvent();
+      event->SetData(1, 1, 0);
+      engine2.ApplyEvent(event);
+    }
+    engines.Think();
+  }
+  EXPECT_LE(1, engine1.NumDelayChanges());
+  EXPECT_EQ(engine1.ms_delay(), engine2.ms_delay());
+  EXPECT_EQ(engine1.NumDelayChanges(), engine2.NumDelayChanges());
+}
+
+// Advances every engine's clock, then thinks both transports and all of the engines.
+void ThinkMatches(
+    const vector<GameEngine*>& engines,
+    MatchTransport* server,
+    MatchTransport* client,
+    GameEngineScheduler* scheduler) {
+  for (int i = 0; i < engines.size(); i++) {
+    GameEngineFrameCalculator* calculator = engines[i]->GetFrameCalculator();
+    calculator->SetTime(calculator->GetTime() + 5);
+  }
+  server->Think();
+  client->Think();
+  scheduler->ThinkAll();
+}
+
+TEST(GameEngineTest, TestSchedulerRunsManyMatchesOverOneTransport) {
+  HashedTestState s(0);
+  s.AddPlayer();
+  const int kMatches = 8;
+
+  MockRouter router;
+  MatchTransport server(new MockNetworkManager(&router));
+  MatchTransport client(new MockNetworkManager(&router));
+  GameEngineScheduler scheduler(3);
+  vector<GameEngine*> hosts, guests, engines;
+  for (int i = 0; i < kMatches; i++) {
+    hosts.push_back(new GameEngine(s, 50, 30, 10, 0));
+    guests.push_back(new GameEngine(s));
+    engines.push_back(hosts[i]);
+    engines.push_back(guests[i]);
+    hosts[i]->InstallNetworkManager(server.NewMatch(i));
+    guests[i]->InstallNetworkManager(client.NewMatch(i));
+    for (int j = 0; j < 2; j++) {
+      GameEngine* engine = j == 0 ? hosts[i] : guests[i];
+      engine->InstallFrameCalculator(new TestFrameCalculator());
+      engine->EnableDesyncDetection(true);
+      scheduler.AddEngine(engine);
+    }
+    ASSERT_TRUE(hosts[i]->StartNetworkManager(65001));
+    hosts[i]->AllowIncomingConnections(string(1, 'a' + i));
+    ASSERT_TRUE(guests[i]->StartNetworkManager(65002));
+    guests[i]->FindHosts(65001);
+  }
+
+  ThinkMatches(engines, &server, &client, &scheduler);
+  for (int i = 0; i < kMatches; i++) {
+    vector<pair<GlopNetworkAddress, string> > found = guests[i]->AvailableHosts();
+    ASSERT_EQ(1, found.size());
+    EXPECT_EQ(string(1, 'a' + i), found[0].second);
+    guests[i]->Connect(found[0].first, found[0].second);
+  }
+  for (int frame = 0; frame < 50; frame++) {
+    ThinkMatches(engines, &server, &client, &scheduler);
+  }
+  for (int i = 0; i < kMatches; i++) {
+    ASSERT_EQ(kPlaying, scheduler.GetThinkState(guests[i]));
+  }
+
+  // Each match's guest moves at its own speed, so any crosstalk between matches would show up.
+  for (int frame = 0; frame < 200; frame++) {
+    if (frame % 3 == 0) {
+      for (int i = 0; i < kMatches; i++) {
+        MovePlayerEvent* event = NewMovePlayerEvent();
+        event->SetData(1, i + 1, 0);
+        guests[i]->ApplyEvent(event);
+      }
+    }
+    ThinkMatches(engines, &server, &client, &scheduler);
+  }
+  for (int frame = 0; frame < 20; frame++) {
+    ThinkMatches(engines, &server, &client, &scheduler);
+  }
+  for (int i = 0; i < kMatches; i++) {
+    guests[i]->GetFrameCalculator()->SetTime(hosts[i]->GetFrameCalculator()->GetTime());
+  }
+  ThinkMatches(engines, &server, &client, &scheduler);
+  EXPECT_LT(0, scheduler.LastThinkAllUs());
+
+  set<int> distances;
+  for (int i = 0; i < kMatches; i++) {
+    EXPECT_LT(10, hosts[i]->NumHashesCompared());
+    EXPECT_EQ(0, hosts[i]->NumDesyncs());
+    EXPECT_EQ(0, guests[i]->NumDesyncs());
+    const TestState& host_state = (const TestState&)hosts[i]->GetCurrentGameState();
+    const TestState& guest_state = (const TestState&)guests[i]->GetCurrentGameState();
+    ASSERT_EQ(2, host_state.state.positions_size());
+    ASSERT_EQ(2, guest_state.state.positions_size());
+    EXPECT_EQ(host_state.state.positions(1).x(), guest_state.state.positions(1).x());
+    distances.insert(host_state.state.positions(1).x());
+  }
+  EXPECT_EQ(kMatches, distances.size());
+
+  for (int i = 0; i < engines.size(); i++) {
+    delete engines[i];
+  }
+  EXPECT_EQ(0, server.NumMatches());
+}
@@ -1,8 +1,47 @@
 #include "GameEvent.h"
 #include "../Base.h"
 
-Mutex* GameEventFactory::mutex_;
-map<int, GameEvent* (*)()>* GameEventFactory::event_constructors_;
+#include <string.h>
+
+// These are zero-initialized before any dynamic initialization runs, so REGISTER_EVENTs in other
+// translation units can safely use them no matter which order the statics are constructed in.
+GameEventFactory::EventConstructor* GameEventFactory::event_constructors_;
+int GameEventFactory::min_event_type_;
+int GameEventFactory::num_event_types_;
+bool GameEventFactory::frozen_;
+
+GameEventFactory::GameEventFactory(
+    int event_type,
+    GameEvent* (*event_constructor)(void*),
+    int event_size) {
+  // Registering after Freeze() would mean reallocating the table out from under threads that are
+  // reading it.
+  ASSERT(!frozen_);
+  if (num_event_types_ == 0) {
+    min_event_type_ = event_type;
+  }
+  int min_type = event_type < min_event_type_ ? event_type : min_event_type_;
+  int max_type = min_event_type_ + num_event_types_ - 1;
+  if (event_type > max_type) {
+    max_type = event_type;
+  }
+  int num_types = max_type - min_type + 1;
+  if (min_type != min_event_type_ || num_types != num_event_types_) {
+    EventConstructor* constructors = new EventConstructor[num_types];
+    memset(constructors, 0, num_types * sizeof(EventConstructor));
+    if (num_event_types_ > 0) {
+      memcpy(constructors + (min_event_type_ - min_type), event_constructors_,
+             num_event_types_ * sizeof(EventConstructor));
+    }
+    delete[] event_constructors_;
+    event_constructors_ = constructors;
+    min_event_type_ = min_type;
+    num_event_types_ = num_types;
+  }
+  EventConstructor& constructor = event_constructors_[event_type - min_event_type_];
+  constructor.construct = event_constructor;
+  constructor.size = event_size;
+}
 
 void GameEventFactory::Serialize(const GameEvent* event, string* str) {
   ASSERT(str->size() == 0);
@@ -18,7 +57,7 @@ void GameEventFactory::Serialize(const GameEvent* event, string* str) {
   event->data_->AppendToString(str);
 }
 
-GameEvent* GameEventFactory::Deserialize(const string& str) {
+GameEvent* GameEventFactory::Deserialize(const string& str, GameEventArena* arena) {
   if (str.size() < 4) {
     printf("Tried to deserialize a string of length %d\n", str.size());
     assert(false);
@@ -28,11 +67,27 @@ GameEvent* GameEventFactory::Deserialize(const string& str) {
   type |= ((unsigned char)str[1]) <<  8;
   type |= ((unsigned char)str[2]) << 16;
   type |= ((unsigned char)str[3]) << 24;
-  GameEvent* event = GetEventByType(type);
+  GameEvent* event = GetEventByType(type, arena);
+  event->data_->ParseFromArray(str.data() + 4, str.size() - 4);
+  return event;
+}
 
-  /// \todo jwills - This could suck if we don't have a copy-on-write implementation of string, look
-  /// into proto buffers a bit more and see if there is some way to parse from an arbitrary point in
-  /// a string
-  event->data_->ParseFromString(str.substr(4));
+GameEvent* GameEventFactory::Deserialize(
+    int event_type,
+    const char* data,
+    int size,
+    GameEventArena* arena) {
+  if (!IsRegisteredEventType(event_type)) {
+    return NULL;
+  }
+  GameEvent* event = GetEventByType(event_type, arena);
+  // Missing required fields were never treated as an error here, so only reject malformed bytes.
+  if (!event->data_->ParsePartialFromArray(data, size)) {
+    // An event in an arena is destroyed when the arena is cleared.
+    if (arena == NULL) {
+      delete event;
+    }
+    return NULL;
+  }
   return event;
 }
@@ -3,21 +3,18 @@
 
 #include <google/protobuf/message.h>
 
-#include "../Thread.h"
 #include "../Base.h"
 #include "P2PNG.h"
+#include "GameEventArena.h"
 
+#include <new>
 #include <string>
-#include <map>
 using namespace std;
 
 class GameState;
 struct GameEngineInfo;
 class GameEngine;
 
-/// \todo jwills - We could potentially make GameEventResult contain a bool that says whether or not
-/// the game state was actually modified.  This might help prevent excessive computations during a
-/// backtrack in certain sorts of games.
 /// This serves as a way for the ApplyToGameState function to return information that can be used by
 /// the *CosmeticEffects functions.
 /// Why use this instead of a void* you ask?  This way we can pass this object as a const reference
@@ -37,7 +34,8 @@ class GameEventResult {
 /// available to the registered class.  Additionally, the registered class should never be
 /// instantiated except through calls to GameEventFactory::GetEventByType(type), where type is the
 /// ID passed to REGISTER_EVENT, or throught the convenience function NewFooType(), which has the
-/// exact same effect.
+/// exact same effect.  Events can also be constructed inside of a GameEventArena by passing one to
+/// GetEventByType, in which case the arena owns the event and it must not be deleted.
 /// All data in a GameEvent object should be contained within the data_ member variable, which a
 /// subclass can instantiate as any protocol buffer.
 class GameEvent {
@@ -76,6 +74,13 @@ class GameEvent {
 
   virtual void ApplyToGameEngineInfo(GameEngineInfo* info) const {}
 
+  /// Events can override this to report that applying them would not modify anything, for example
+  /// an input event with no buttons pressed.  When a late batch of events consists entirely of
+  /// no-ops the GameEngine knows the state it already computed for that timestep is still correct,
+  /// and skips backtracking.  Only return true if ApplyToGameState and ApplyToGameEngineInfo are
+  /// guaranteed to leave every possible GameState and GameEngineInfo untouched.
+  virtual bool IsNoOp() const { return false; }
+
   const google::protobuf::Message& GetData() const {return *data_;}
 
   int type() const {return type_;}
@@ -109,48 +114,88 @@ class GameEventFactory {
   /// The REGISTER_EVENT macro instantiates a static GameEventFactory so that this constructor will
   /// be called during static initialization, so that all GameEvents will be registered before we
   /// hit main().
-  GameEventFactory(int event_type, GameEvent* (*event_constructor)()) {
-    if (event_constructors_ == NULL) {
-      event_constructors_ = new map<int, GameEvent* (*)()>;
-      mutex_ = new Mutex;
-    }
-    MutexLock lock(mutex_);
-    (*event_constructors_)[event_type] = event_constructor;
-  }
+  /// event_constructor constructs the event in the memory it is given, or with new if that is NULL.
+  /// event_size is the size of the event class.
+  GameEventFactory(int event_type, GameEvent* (*event_constructor)(void*), int event_size);
+
+  /// Stops any more events from being registered, so that the table of registered events can be
+  /// read from several threads without a lock.  This must be called before starting any thread
+  /// that creates events.  GameEngine and GameEngineScheduler call it when they are constructed.
+  static void Freeze() { frozen_ = true; }
 
   /// Registered GameEvents can be instantiated with this method by passing in the ID that was used
-  /// to register the event.
-  static GameEvent* GetEventByType(int event_type) {
-    assert(event_constructors_ != NULL);
-    assert(event_constructors_->count(event_type));
-    map<int, GameEvent* (*)()>::iterator it = event_constructors_->begin();
-    GameEvent* event = (*event_constructors_)[event_type]();
+  /// to register the event.  If arena is not NULL the event is constructed in it and owned by it.
+  /// Lookups are a bounds check and an array index, and never take a lock.
+  static GameEvent* GetEventByType(int event_type, GameEventArena* arena = NULL) {
+    assert(IsRegisteredEventType(event_type));
+    const EventConstructor& constructor = event_constructors_[event_type - min_event_type_];
+    GameEvent* event;
+    if (arena == NULL) {
+      event = constructor.construct(NULL);
+    } else {
+      event = constructor.construct(arena->Allocate(constructor.size));
+      arena->Own(event);
+    }
     event->set_type(event_type);
     return event;
   }
 
+  /// Returns whether an event was registered with this type.  Code that decodes event types from
+  /// the network should check this before calling GetEventByType, which asserts on unknown types.
+  static bool IsRegisteredEventType(int event_type) {
+    int index = event_type - min_event_type_;
+    return index >= 0 && index < num_event_types_ && event_constructors_[index].construct != NULL;
+  }
+
+  /// Registered types are stored densely, from the lowest one up.  This returns where event_type is
+  /// in that order, from 0 to NumEventTypes() - 1, so that callers can keep per-type tables in a
+  /// flat array instead of a map.  event_type must be registered.
+  static int GetEventTypeIndex(int event_type) { return event_type - min_event_type_; }
+  static int NumEventTypes() { return num_event_types_; }
+
   /// Serializes the event into str.  str must be empty.
   static void Serialize(const GameEvent* event, string* str);
 
-  /// Instantiates the appropriate GameEvent subclass and deserializes str into that event.
-  static GameEvent* Deserialize(const string& str);
+  /// Instantiates the appropriate GameEvent subclass and deserializes str into that event.  If
+  /// arena is not NULL the event is constructed in it and owned by it.
+  static GameEvent* Deserialize(const string& str, GameEventArena* arena = NULL);
+
+  /// Instantiates a GameEvent of the given type and parses the size bytes at data into its protocol
+  /// buffer.  This is for formats that store the type separately, like the one GameConnection uses,
+  /// and it parses straight out of the caller's buffer without copying it.  Returns NULL if the
+  /// type is not registered or the data does not parse.
+  static GameEvent* Deserialize(
+      int event_type, const char* data, int size, GameEventArena* arena = NULL);
 
   /// Primarily for testing to make sure that an event is of the expected type.
   static int GetGameEventType(const GameEvent* event) {return event->type_;}
 
  private:
+  struct EventConstructor {
+    GameEvent* (*construct)(void*);
+    int size;
+  };
+
   GameEventFactory() {}
-  static Mutex* mutex_;
-  static map<int, GameEvent* (*)()>* event_constructors_;
+  // Indexed by event type - min_event_type_.  Types that were never registered have a NULL
+  // construct.  This is only written during static initialization, so it is a plain array rather
+  // than a container that would itself need to be constructed before the first REGISTER_EVENT.
+  static EventConstructor* event_constructors_;
+  static int min_event_type_;
+  static int num_event_types_;
+  static bool frozen_;
   DISALLOW_EVIL_CONSTRUCTORS(GameEventFactory);
 };
 
 #define REGISTER_EVENT(EVENT_TYPE, EVENT_CLASS)                                    \
-inline GameEvent* __ ## EVENT_CLASS ## __create() {                                \
-  return new EVENT_CLASS;                                                          \
+inline GameEvent* __ ## EVENT_CLASS ## __create(void* memory) {                    \
+  if (memory == NULL) {                                                            \
+    return new EVENT_CLASS;                                                        \
+  }                                                                                \
+  return new (memory) EVENT_CLASS;                                                 \
 }                                                                                  \
 static GameEventFactory __ ## EVENT_CLASS ##                                       \
-    __creator(EVENT_TYPE, &__ ## EVENT_CLASS ## __create);                         \
+    __creator(EVENT_TYPE, &__ ## EVENT_CLASS ## __create, sizeof(EVENT_CLASS));    \
 EVENT_CLASS* New ## EVENT_CLASS() {                                                \
   return static_cast<EVENT_CLASS*>(GameEventFactory::GetEventByType(EVENT_TYPE));  \
 }
@@ -0,0 +1,104 @@
+#include "GameEventArena.h"
+#include "GameEvent.h"
+
+GameEventArena::GameEventArena() : current_block_(0), block_offset_(0) {}
+
+GameEventArena::~GameEventArena() {
+  Clear();
+  for (int i = 0; i < blocks_.size(); i++) {
+    delete[] blocks_[i];
+  }
+}
+
+void* GameEventArena::Allocate(size_t size) {
+  // Keep everything aligned well enough for any GameEvent subclass.
+  const size_t kAlignment = sizeof(void*) * 2;
+  size = (size + kAlignment - 1) & ~(kAlignment - 1);
+  if (size > kBlockSize) {
+    oversized_.push_back(new char[size]);
+    return oversized_.back();
+  }
+  if (current_block_ < blocks_.size() && block_offset_ + size > kBlockSize) {
+    current_block_++;
+    block_offset_ = 0;
+  }
+  if (current_block_ == blocks_.size()) {
+    blocks_.push_back(new char[kBlockSize]);
+  }
+  void* memory = blocks_[current_block_] + block_offset_;
+  block_offset_ += size;
+  return memory;
+}
+
+void GameEventArena::Clear() {
+  for (int i = 0; i < placed_events_.size(); i++) {
+    placed_events_[i]->~GameEvent();
+  }
+  placed_events_.clear();
+  for (int i = 0; i < adopted_events_.size(); i++) {
+    delete adopted_events_[i];
+  }
+  adopted_events_.clear();
+  for (int i = 0; i < oversized_.size(); i++) {
+    delete[] oversized_[i];
+  }
+  oversized_.clear();
+  current_block_ = 0;
+  block_offset_ = 0;
+}
+
+GameEventArenaWindow::~GameEventArenaWindow() {
+  DeleteArenas();
+}
+
+void GameEventArenaWindow::DeleteArenas() {
+  if (arenas_.size() > 0) {
+    for (StateTimestep t = arenas_.GetFirstIndex(); t <= arenas_.GetLastIndex(); t++) {
+      delete arenas_[t];
+    }
+  }
+}
+
+void GameEventArenaWindow::Reset(int size, StateTimestep first_timestep) {
+  DeleteArenas();
+  scratch_.Clear();
+  arenas_ = MovingWindow<GameEventArena*>(size, first_timestep);
+  for (StateTimestep t = arenas_.GetFirstIndex(); t <= arenas_.GetLastIndex(); t++) {
+    arenas_[t] = new GameEventArena;
+  }
+}
+
+GameEventArena* GameEventArenaWindow::GetEventArena(StateTimestep state_timestep) {
+  if (arenas_.size() <= 0) {
+    return NULL;
+  }
+  if (state_timestep > arenas_.GetLastIndex()) {
+    return NULL;
+  }
+  if (state_timestep < arenas_.GetFirstIndex()) {
+    return &scratch_;
+  }
+  return arenas_[state_timestep];
+}
+
+void GameEventArenaWindow::Adopt(StateTimestep state_timestep, const vector<GameEvent*>& events) {
+  GameEventArena* arena = GetEventArena(state_timestep);
+  if (arena == NULL) {
+    return;
+  }
+  for (int i = 0; i < events.size(); i++) {
+    arena->Adopt(events[i]);
+  }
+}
+
+void GameEventArenaWindow::RetireThrough(StateTimestep state_timestep) {
+  if (arenas_.size() <= 0) {
+    return;
+  }
+  while (arenas_.GetFirstIndex() <= state_timestep) {
+    GameEventArena* retired;
+    arenas_.Advance(&retired);
+    retired->Clear();
+    arenas_[arenas_.GetLastIndex()] = retired;
+  }
+}
@@ -0,0 +1,113 @@
+#ifndef GAMEENGINE_GAMEEVENTARENA_H
+#define GAMEENGINE_GAMEEVENTARENA_H
+
+#include <stddef.h>
+
+#include <vector>
+using namespace std;
+
+#include "P2PNG.h"
+#include "MovingWindow.h"
+#include "../Base.h"
+
+class GameEvent;
+
+/// A GameEventArena owns a group of GameEvents that all die at the same time, which in the
+/// GameEngine means all of the events for a single timestep.  Events are constructed in place in
+/// large blocks of memory by GameEventFactory, and Clear() destroys all of them at once and rewinds
+/// the arena without giving the blocks back, so an arena that is reused for timestep after
+/// timestep stops calling malloc once it has grown to fit a typical timestep.
+/// Events that were already allocated on the heap, like the ones passed to GameEngine::ApplyEvent,
+/// can be handed to an arena with Adopt() so that they are deleted along with everything else.
+/// Note that only the GameEvent objects themselves live in the arena; their protocol buffers are
+/// still allocated on the heap by the event's constructor.
+class GameEventArena {
+ public:
+  GameEventArena();
+  ~GameEventArena();
+
+  /// Returns memory for an object of the given size.  It is only freed by Clear() or the
+  /// destructor, and the destructor of whatever is constructed there is only run if it is passed to
+  /// Own().
+  void* Allocate(size_t size);
+
+  /// Registers an event that was constructed in memory returned by Allocate(), so that its
+  /// destructor is called when the arena is cleared.
+  void Own(GameEvent* event) { placed_events_.push_back(event); }
+
+  /// Takes ownership of an event that was allocated with new.
+  void Adopt(GameEvent* event) { adopted_events_.push_back(event); }
+
+  /// Destroys every event in the arena and makes all of its memory available again.
+  void Clear();
+
+  /// Number of events currently owned by the arena, whether placed or adopted.
+  int NumEvents() const { return placed_events_.size() + adopted_events_.size(); }
+
+  /// Number of blocks of memory the arena is holding on to.
+  int NumBlocks() const { return blocks_.size(); }
+
+ private:
+  static const size_t kBlockSize = 4096;
+
+  vector<char*> blocks_;
+  int current_block_;
+  size_t block_offset_;
+  vector<char*> oversized_;  // Allocations bigger than kBlockSize, freed by Clear().
+  vector<GameEvent*> placed_events_;
+  vector<GameEvent*> adopted_events_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(GameEventArena);
+};
+
+/// Lets the code that decodes events decide which arena they should go in based on their timestep.
+class GameEventArenaSource {
+ public:
+  virtual ~GameEventArenaSource() {}
+
+  /// Returns the arena that events for state_timestep should be allocated from, or NULL if they
+  /// should be allocated on the heap.
+  virtual GameEventArena* GetEventArena(StateTimestep state_timestep) = 0;
+};
+
+/// Keeps one GameEventArena for every timestep in a window that moves along with the GameEngine's
+/// history.  When timesteps are retired from the front of the window their arenas are cleared and
+/// reused for the new timesteps at the back.  Events for timesteps that have already left the
+/// window go into a scratch arena that the owner clears once it knows nothing refers to them any
+/// more, so they must never be stored anywhere.  Events for timesteps the window hasn't reached yet
+/// go on the heap, and the owner hands them to the window with Adopt() once it gets there.
+class GameEventArenaWindow : public GameEventArenaSource {
+ public:
+  GameEventArenaWindow() {}
+  virtual ~GameEventArenaWindow();
+
+  /// Destroys every event in the window and moves it to cover size timesteps starting at
+  /// first_timestep.
+  void Reset(int size, StateTimestep first_timestep);
+
+  /// Returns NULL until Reset() has been called, and for timesteps past the end of the window.
+  virtual GameEventArena* GetEventArena(StateTimestep state_timestep);
+
+  /// Hands every event in events over to the arena for state_timestep.  Used for events that were
+  /// allocated on the heap.
+  void Adopt(StateTimestep state_timestep, const vector<GameEvent*>& events);
+
+  /// Clears the arenas of all timesteps up to and including state_timestep and advances the window
+  /// past them.
+  void RetireThrough(StateTimestep state_timestep);
+
+  void ClearScratch() { scratch_.Clear(); }
+
+  StateTimestep GetFirstIndex() const { return arenas_.GetFirstIndex(); }
+  StateTimestep GetLastIndex() const { return arenas_.GetLastIndex(); }
+
+ private:
+  void DeleteArenas();
+
+  MovingWindow<GameEventArena*> arenas_;
+  GameEventArena scratch_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(GameEventArenaWindow);
+};
+
+#endif // GAMEENGINE_GAMEEVENTARENA_H
@@ -0,0 +1,105 @@
+#include <gtest/gtest.h>
+#include "GameEvent.h"
+#include "GameEventArena.h"
+#include "TestProtos.pb.h"
+
+// Keeps track of how many of these events are alive so that we can tell when arenas destroy them.
+class CountedEvent : public GameEvent {
+ public:
+  CountedEvent() {
+    typed_data_ = new Foo;
+    data_ = typed_data_;
+    live++;
+  }
+  ~CountedEvent() {
+    delete typed_data_;
+    live--;
+  }
+  Foo* GetData() {
+    return typed_data_;
+  }
+  static int live;
+ private:
+  Foo* typed_data_;
+};
+int CountedEvent::live = 0;
+REGISTER_EVENT(300, CountedEvent);
+
+TEST(GameEventArenaTest, TestClearDestroysEveryEvent) {
+  GameEventArena arena;
+  for (int i = 0; i < 1000; i++) {
+    GameEventFactory::GetEventByType(300, &arena);
+  }
+  arena.Adopt(NewCountedEvent());
+  EXPECT_EQ(1001, CountedEvent::live);
+  EXPECT_EQ(1001, arena.NumEvents());
+  arena.Clear();
+  EXPECT_EQ(0, CountedEvent::live);
+  EXPECT_EQ(0, arena.NumEvents());
+}
+
+TEST(GameEventArenaTest, TestBlocksAreReusedAfterClear) {
+  GameEventArena arena;
+  for (int i = 0; i < 1000; i++) {
+    GameEventFactory::GetEventByType(300, &arena);
+  }
+  int blocks = arena.NumBlocks();
+  EXPECT_LT(1, blocks);
+  for (int j = 0; j < 10; j++) {
+    arena.Clear();
+    for (int i = 0; i < 1000; i++) {
+      GameEventFactory::GetEventByType(300, &arena);
+    }
+    EXPECT_EQ(blocks, arena.NumBlocks());
+  }
+  arena.Clear();
+  EXPECT_EQ(0, CountedEvent::live);
+}
+
+TEST(GameEventArenaTest, TestEventsCanBeDeserializedIntoAnArena) {
+  CountedEvent* event = NewCountedEvent();
+  event->GetData()->set_foo(17);
+  event->GetData()->set_bar(-4);
+  string s;
+  GameEventFactory::Serialize(event, &s);
+  delete event;
+
+  GameEventArena arena;
+  CountedEvent* copy = (CountedEvent*)GameEventFactory::Deserialize(s, &arena);
+  EXPECT_EQ(300, GameEventFactory::GetGameEventType(copy));
+  EXPECT_EQ(17, copy->GetData()->foo());
+  EXPECT_EQ(-4, copy->GetData()->bar());
+  EXPECT_EQ(1, arena.NumEvents());
+  arena.Clear();
+  EXPECT_EQ(0, CountedEvent::live);
+}
+
+TEST(GameEventArenaTest, TestWindowRetiresTimesteps) {
+  GameEventArenaWindow window;
+  EXPECT_TRUE(window.GetEventArena(0) == NULL);
+
+  window.Reset(10, 5);
+  GameEventArena* scratch = window.GetEventArena(4);
+  EXPECT_TRUE(scratch != NULL);
+  EXPECT_TRUE(window.GetEventArena(15) == NULL);
+  for (StateTimestep t = 5; t < 15; t++) {
+    EXPECT_TRUE(window.GetEventArena(t) != scratch);
+    GameEventFactory::GetEventByType(300, window.GetEventArena(t));
+    window.Adopt(t, vector<GameEvent*>(1, NewCountedEvent()));
+  }
+  EXPECT_EQ(20, CountedEvent::live);
+
+  window.RetireThrough(7);
+  EXPECT_EQ(8, window.GetFirstIndex());
+  EXPECT_EQ(14, CountedEvent::live);
+  EXPECT_TRUE(window.GetEventArena(7) == scratch);
+  EXPECT_EQ(0, window.GetEventArena(17)->NumEvents());
+
+  GameEventFactory::GetEventByType(300, scratch);
+  EXPECT_EQ(15, CountedEvent::live);
+  window.ClearScratch();
+  EXPECT_EQ(14, CountedEvent::live);
+
+  window.Reset(10, 0);
+  EXPECT_EQ(0, CountedEvent::live);
+}
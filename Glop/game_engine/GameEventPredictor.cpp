@@ -0,0 +1,18 @@
+#include "GameEventPredictor.h"
+#include "GameEvent.h"
+
+void RepeatLastEventsPredictor::PredictEvents(
+    EngineID engine_id,
+    StateTimestep state_timestep,
+    StateTimestep last_timestep,
+    const vector<GameEvent*>& last_events,
+    vector<GameEvent*>* predicted) {
+  for (int i = 0; i < last_events.size(); i++) {
+    if (last_events[i]->type() <= 0) {
+      continue;
+    }
+    string data;
+    GameEventFactory::Serialize(last_events[i], &data);
+    predicted->push_back(GameEventFactory::Deserialize(data));
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef GAMEENGINE_GAMEEVENTPREDICTOR_H
+#define GAMEENGINE_GAMEEVENTPREDICTOR_H
+
+#include <vector>
+using namespace std;
+
+#include "P2PNG.h"
+
+class GameEvent;
+
+/// A GameEventPredictor guesses which events another engine is going to send for a timestep that
+/// the GameEngine needs to simulate before those events have arrived.  The engine simulates with
+/// the guess, and when the real events show up it only has to roll back if they are different.
+/// Games whose events describe the current state of a player's input rather than one-off actions
+/// will usually want to predict that the input hasn't changed, which is what
+/// RepeatLastEventsPredictor does.
+///
+/// Predictions are made on whichever thread is running the simulation, so a predictor must not
+/// touch anything outside of itself and the events it is given.
+class GameEventPredictor {
+ public:
+  virtual ~GameEventPredictor() {}
+
+  /// Appends the predicted events for engine_id at state_timestep to predicted.  last_events is
+  /// the most recent package that actually arrived from that engine, for last_timestep, or empty
+  /// if last_timestep is -1 because nothing from that engine is left in the history.  Predicted
+  /// events must be created through GameEventFactory, must be game events (type > 0), and belong to
+  /// the engine afterwards.
+  virtual void PredictEvents(
+      EngineID engine_id,
+      StateTimestep state_timestep,
+      StateTimestep last_timestep,
+      const vector<GameEvent*>& last_events,
+      vector<GameEvent*>* predicted) = 0;
+};
+
+/// Predicts that every engine sends the same game events it sent in its last package.  Engine-level
+/// events are never repeated.
+class RepeatLastEventsPredictor : public GameEventPredictor {
+ public:
+  virtual void PredictEvents(
+      EngineID engine_id,
+      StateTimestep state_timestep,
+      StateTimestep last_timestep,
+      const vector<GameEvent*>& last_events,
+      vector<GameEvent*>* predicted);
+};
+
+#endif // GAMEENGINE_GAMEEVENTPREDICTOR_H
@@ -104,3 +104,29 @@ TEST(GameEventTest, TestEventsSerializeAndDeserializeNegativeValuedEventTypesCor
   GameEvent* event = GameEventFactory::Deserialize(s);
   EXPECT_EQ(-100, event->type());
 }
+
+TEST(GameEventTest, TestEventsDeserializeFromTheMiddleOfABuffer) {
+  FooEvent* foo_event = NewFooEvent();
+  foo_event->GetData()->set_foo(9);
+  foo_event->GetData()->set_bar(-7);
+  string buffer = "prefix";
+  foo_event->GetData()->AppendToString(&buffer);
+  int size = buffer.size() - 6;
+  buffer += "suffix";
+  delete foo_event;
+
+  GameEvent* event = GameEventFactory::Deserialize(128, buffer.data() + 6, size);
+  ASSERT_TRUE(event != NULL);
+  EXPECT_EQ(128, event->type());
+  const Foo& foo = static_cast<const Foo&>(event->GetData());
+  EXPECT_EQ(9, foo.foo());
+  EXPECT_EQ(-7, foo.bar());
+  delete event;
+
+  // Types that were never registered and bytes that are not a protocol buffer are both rejected.
+  EXPECT_TRUE(GameEventFactory::IsRegisteredEventType(-100));
+  EXPECT_FALSE(GameEventFactory::IsRegisteredEventType(0));
+  EXPECT_FALSE(GameEventFactory::IsRegisteredEventType(-101));
+  EXPECT_TRUE(GameEventFactory::Deserialize(0, buffer.data() + 6, size) == NULL);
+  EXPECT_TRUE(GameEventFactory::Deserialize(128, "\xff\xff\xff", 3) == NULL);
+}
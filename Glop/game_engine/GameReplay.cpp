@@ -0,0 +1,378 @@
+#include "GameReplay.h"
+#include "GameEvent.h"
+#include "GameState.h"
+#include "Varint.h"
+
+#include "../Base.h"
+
+static const char kReplayMagic[] = "GREP";
+static const char kReplayVersion = 1;
+
+enum ReplayRecordType {
+  kReplayState = 1,
+  kReplayTimestep = 2,
+};
+
+void AppendReplayHeader(string* data) {
+  data->append(kReplayMagic, 4);
+  data->push_back(kReplayVersion);
+}
+
+void AppendReplayState(const GameEngineInfo& info, const GameState& state, string* data) {
+  string state_data;
+  state.SerializeToString(&state_data);
+  AppendVarint(kReplayState, data);
+  AppendVarint(ZigZag(info.state_timestep), data);
+  AppendVarint(info.engine_ids.size(), data);
+  EngineSet::const_iterator it;
+  for (it = info.engine_ids.begin(); it != info.engine_ids.end(); it++) {
+    AppendVarint(ZigZag(*it), data);
+  }
+  AppendVarint(state_data.size(), data);
+  *data += state_data;
+}
+
+void AppendReplayTimestep(
+    StateTimestep state_timestep,
+    const TimestepEvents& events,
+    string* data) {
+  AppendVarint(kReplayTimestep, data);
+  AppendVarint(ZigZag(state_timestep), data);
+  AppendVarint(events.NumPackages(), data);
+  for (int i = 0; i < events.NumPackages(); i++) {
+    const TimestepEvents::Package& package = events.GetPackage(i);
+    AppendVarint(ZigZag(package.engine_id), data);
+    AppendVarint(package.end - package.begin, data);
+    for (int j = package.begin; j < package.end; j++) {
+      const google::protobuf::Message& message = events.GetRecord(j).event->GetData();
+      AppendVarint(ZigZag(events.GetRecord(j).type), data);
+      AppendVarint(message.ByteSize(), data);
+      message.AppendToString(data);
+    }
+  }
+}
+
+GameReplayWriter::GameReplayWriter(const string& filename, int keyframe_interval)
+  : file_(fopen(filename.c_str(), "wb")),
+    keyframe_interval_(keyframe_interval),
+    first_timestep_(-1),
+    last_timestep_(-1) {
+  if (file_ == NULL) {
+    printf("Unable to open %s to record a replay\n", filename.c_str());
+    return;
+  }
+  record_.clear();
+  AppendReplayHeader(&record_);
+  WriteRecord();
+}
+
+GameReplayWriter::~GameReplayWriter() {
+  if (file_ != NULL) {
+    fclose(file_);
+  }
+}
+
+void GameReplayWriter::WriteInitialState(const GameEngineInfo& info, const GameState& state) {
+  first_timestep_ = info.state_timestep;
+  last_timestep_ = info.state_timestep;
+  WriteState(info, state);
+}
+
+void GameReplayWriter::WriteTimestep(
+    const TimestepEvents& events,
+    const GameEngineInfo& info,
+    const GameState& state) {
+  last_timestep_++;
+  ASSERT(info.state_timestep == last_timestep_);
+  record_.clear();
+  AppendReplayTimestep(last_timestep_, events, &record_);
+  WriteRecord();
+  if (keyframe_interval_ > 0 && (last_timestep_ - first_timestep_) % keyframe_interval_ == 0) {
+    WriteState(info, state);
+  }
+}
+
+void GameReplayWriter::WriteState(const GameEngineInfo& info, const GameState& state) {
+  record_.clear();
+  AppendReplayState(info, state, &record_);
+  WriteRecord();
+  // Everything up to a keyframe survives a crash.
+  if (file_ != NULL) {
+    fflush(file_);
+  }
+}
+
+void GameReplayWriter::WriteRecord() {
+  if (file_ != NULL) {
+    fwrite(record_.data(), 1, record_.size(), file_);
+  }
+}
+
+// Reading helpers.  These all advance *pos past whatever they read, and return false if the data
+// ends first.
+static bool ReadSigned(const string& data, int* pos, int64* value) {
+  uint64 raw;
+  if (!ReadVarint(data, pos, &raw)) {
+    return false;
+  }
+  *value = UnZigZag(raw);
+  return true;
+}
+
+static bool ReadBytes(const string& data, int* pos, int* start, int* size) {
+  uint64 raw_size;
+  if (!ReadVarint(data, pos, &raw_size) || raw_size > data.size() - *pos) {
+    return false;
+  }
+  *start = *pos;
+  *size = raw_size;
+  *pos += raw_size;
+  return true;
+}
+
+// Reads the type and timestep of the record at *pos and skips over the rest of it, checking that
+// it is well formed on the way.  Sets *corrupt if it returns false because the record is bad
+// rather than because the data ends early.
+static bool SkipRecord(
+    const string& data,
+    int* pos,
+    uint64* type,
+    int64* state_timestep,
+    bool* corrupt) {
+  *corrupt = false;
+  if (!ReadVarint(data, pos, type) || !ReadSigned(data, pos, state_timestep)) {
+    return false;
+  }
+  int start, size;
+  uint64 count;
+  int64 value;
+  if (*type == kReplayState) {
+    if (!ReadVarint(data, pos, &count)) {
+      return false;
+    }
+    for (uint64 i = 0; i < count; i++) {
+      if (!ReadSigned(data, pos, &value)) {
+        return false;
+      }
+      if (value < 0 || value >= kMaxEngineIDs) {
+        *corrupt = true;
+        return false;
+      }
+    }
+    return ReadBytes(data, pos, &start, &size);
+  }
+  if (*type == kReplayTimestep) {
+    if (!ReadVarint(data, pos, &count)) {
+      return false;
+    }
+    for (uint64 i = 0; i < count; i++) {
+      uint64 num_events;
+      if (!ReadSigned(data, pos, &value) || !ReadVarint(data, pos, &num_events)) {
+        return false;
+      }
+      if (value < 0 || value >= kMaxEngineIDs) {
+        *corrupt = true;
+        return false;
+      }
+      for (uint64 j = 0; j < num_events; j++) {
+        if (!ReadSigned(data, pos, &value)) {
+          return false;
+        }
+        if (!GameEventFactory::IsRegisteredEventType(value)) {
+          *corrupt = true;
+          return false;
+        }
+        if (!ReadBytes(data, pos, &start, &size)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+  *corrupt = true;
+  return false;
+}
+
+bool SkipReplayRecord(const string& data, int* pos, bool* is_state) {
+  uint64 type;
+  int64 state_timestep;
+  bool corrupt;
+  if (!SkipRecord(data, pos, &type, &state_timestep, &corrupt)) {
+    return false;
+  }
+  *is_state = type == kReplayState;
+  return true;
+}
+
+GameReplayRunner::GameReplayRunner(const GameState& reference)
+  : reference_(reference.Copy()),
+    state_(reference.Copy()),
+    parsed_size_(0),
+    first_timestep_(-1) {
+}
+
+GameReplayRunner::~GameReplayRunner() {
+  delete state_;
+  delete reference_;
+}
+
+bool GameReplayRunner::Load(const string& filename) {
+  FILE* file = fopen(filename.c_str(), "rb");
+  if (file == NULL) {
+    return false;
+  }
+  string data;
+  char buffer[64 * 1024];
+  int size;
+  while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    data.append(buffer, size);
+  }
+  fclose(file);
+  return LoadFromString(data);
+}
+
+bool GameReplayRunner::LoadFromString(const string& data) {
+  data_.clear();
+  parsed_size_ = 0;
+  timestep_offsets_.clear();
+  keyframes_.clear();
+  if (!AppendData(data)) {
+    return false;
+  }
+  if (parsed_size_ < data_.size()) {
+    printf("Ignoring the last %d bytes of a replay\n", (int)(data_.size() - parsed_size_));
+  }
+  return !keyframes_.empty();
+}
+
+bool GameReplayRunner::AppendData(const string& data) {
+  data_ += data;
+  if (parsed_size_ == 0) {
+    if (data_.size() < kReplayHeaderSize) {
+      return true;
+    }
+    if (data_.compare(0, 4, kReplayMagic) != 0 || data_[4] != kReplayVersion) {
+      return false;
+    }
+    parsed_size_ = kReplayHeaderSize;
+  }
+  // Anything after a record that is cut off or out of order stays unparsed, in case the rest of it
+  // is still on its way.
+  while (parsed_size_ < data_.size()) {
+    int pos = parsed_size_;
+    uint64 type;
+    int64 state_timestep;
+    bool corrupt;
+    if (!SkipRecord(data_, &pos, &type, &state_timestep, &corrupt)) {
+      if (corrupt) {
+        return false;
+      }
+      break;
+    }
+    if (type == kReplayState) {
+      if (keyframes_.empty()) {
+        first_timestep_ = state_timestep;
+      } else if (state_timestep != GetLastTimestep()) {
+        break;
+      }
+      keyframes_.push_back(make_pair((StateTimestep)state_timestep, parsed_size_));
+      if (keyframes_.size() == 1) {
+        RestoreState(parsed_size_);
+      }
+    } else {
+      if (keyframes_.empty() || state_timestep != GetLastTimestep() + 1) {
+        break;
+      }
+      timestep_offsets_.push_back(parsed_size_);
+    }
+    parsed_size_ = pos;
+  }
+  return true;
+}
+
+void GameReplayRunner::RestoreState(int offset) {
+  // Records were all checked by Load, so there's no need to check anything here.
+  int pos = offset;
+  uint64 type, count;
+  int64 value;
+  ReadVarint(data_, &pos, &type);
+  ReadSigned(data_, &pos, &value);
+  info_.state_timestep = value;
+  info_.engine_ids.clear();
+  ReadVarint(data_, &pos, &count);
+  for (uint64 i = 0; i < count; i++) {
+    ReadSigned(data_, &pos, &value);
+    info_.engine_ids.insert(value);
+  }
+  int start, size;
+  ReadBytes(data_, &pos, &start, &size);
+  state_->ParseFromString(data_.substr(start, size));
+}
+
+bool GameReplayRunner::Step() {
+  if (GetTimestep() >= GetLastTimestep()) {
+    return false;
+  }
+  arena_.Clear();
+  events_.clear();
+  int pos = timestep_offsets_[GetTimestep() - first_timestep_];
+  uint64 type, count;
+  int64 state_timestep;
+  ReadVarint(data_, &pos, &type);
+  ReadSigned(data_, &pos, &state_timestep);
+  ReadVarint(data_, &pos, &count);
+  for (uint64 i = 0; i < count; i++) {
+    int64 engine_id;
+    uint64 num_events;
+    ReadSigned(data_, &pos, &engine_id);
+    ReadVarint(data_, &pos, &num_events);
+    package_.clear();
+    for (uint64 j = 0; j < num_events; j++) {
+      int64 event_type;
+      int start, size;
+      ReadSigned(data_, &pos, &event_type);
+      ReadBytes(data_, &pos, &start, &size);
+      GameEvent* event =
+          GameEventFactory::Deserialize(event_type, data_.data() + start, size, &arena_);
+      if (event == NULL) {
+        printf("Dropped a corrupt event of type %d from a replay\n", (int)event_type);
+        continue;
+      }
+      package_.push_back(event);
+    }
+    events_.SetPackage(engine_id, package_);
+  }
+
+  // This is exactly what GameEngine::RecreateState does to the state before it.
+  info_.state_timestep = state_timestep;
+  GameEngine::ApplyEventsToGameState(state_timestep, events_, state_, &info_);
+  state_->Think();
+  return true;
+}
+
+int GameReplayRunner::RunToEnd() {
+  int count = 0;
+  while (Step()) {
+    count++;
+  }
+  return count;
+}
+
+bool GameReplayRunner::Seek(StateTimestep state_timestep) {
+  if (keyframes_.empty() ||
+      state_timestep < first_timestep_ ||
+      state_timestep > GetLastTimestep()) {
+    return false;
+  }
+  int keyframe = keyframes_.size() - 1;
+  while (keyframes_[keyframe].first > state_timestep) {
+    keyframe--;
+  }
+  if (GetTimestep() > state_timestep || GetTimestep() < keyframes_[keyframe].first) {
+    RestoreState(keyframes_[keyframe].second);
+  }
+  while (GetTimestep() < state_timestep) {
+    Step();
+  }
+  return true;
+}
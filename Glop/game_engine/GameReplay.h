@@ -0,0 +1,140 @@
+#ifndef GAMEENGINE_GAMEREPLAY_H
+#define GAMEENGINE_GAMEREPLAY_H
+
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "P2PNG.h"
+#include "GameEngine.h"
+#include "GameEventArena.h"
+
+class GameEvent;
+class GameState;
+
+/// A replay is everything needed to re-simulate a game without any networking: a starting
+/// GameState, followed by the events of every timestep after it, in the order the timesteps were
+/// completed.  Every so often the writer also drops in a keyframe, which is a copy of the state at
+/// that timestep, so that a GameReplayRunner can jump into the middle of a long replay without
+/// simulating everything before it.
+///
+/// The file is append-only and every record stands on its own, so a replay that was cut off by a
+/// crash is still good up to its last complete record.  The format is:
+///   "GREP", version byte
+///   state record:    kReplayState, zigzag timestep, engine count, zigzag engine ids,
+///                    state size, serialized state
+///   timestep record: kReplayTimestep, zigzag timestep, package count, and then for each package
+///                    zigzag engine id, event count, and for each event zigzag type, size, data
+/// where every number is a varint.  The first state record is the starting state, and the ones
+/// after it are keyframes.
+class GameReplayWriter {
+ public:
+  /// Creates filename, or truncates it if it already exists.  A keyframe is written after every
+  /// keyframe_interval timesteps, or never if keyframe_interval is 0.
+  GameReplayWriter(const string& filename, int keyframe_interval);
+  ~GameReplayWriter();
+
+  /// Returns false if the file could not be opened, in which case nothing is written.
+  bool IsOpen() const { return file_ != NULL; }
+
+  /// Writes the starting state.  This must be called once, before anything else.
+  void WriteInitialState(const GameEngineInfo& info, const GameState& state);
+
+  /// Writes the events for the timestep after the last one written.  info and state are the result
+  /// of simulating that timestep, and are only used if it is time for a keyframe.
+  void WriteTimestep(
+      const TimestepEvents& events,
+      const GameEngineInfo& info,
+      const GameState& state);
+
+ private:
+  void WriteState(const GameEngineInfo& info, const GameState& state);
+  void WriteRecord();
+
+  FILE* file_;
+  int keyframe_interval_;
+  StateTimestep first_timestep_;
+  StateTimestep last_timestep_;
+  string record_;  // Reused for every record so that writing doesn't allocate once it's grown.
+  DISALLOW_EVIL_CONSTRUCTORS(GameReplayWriter);
+};
+
+/// A replay can also be sent as a stream while the game is going on, which is how spectators watch
+/// a game live (see GameSpectator.h).  These append the header, or a single record, to data.
+void AppendReplayHeader(string* data);
+void AppendReplayState(const GameEngineInfo& info, const GameState& state, string* data);
+void AppendReplayTimestep(
+    StateTimestep state_timestep,
+    const TimestepEvents& events,
+    string* data);
+/// Moves *pos past the record that starts there, and sets *is_state if it is a state record.
+/// Returns false if the record is corrupt or data ends before it does.
+bool SkipReplayRecord(const string& data, int* pos, bool* is_state);
+/// The size of the header that every replay starts with.
+const int kReplayHeaderSize = 5;
+
+/// Plays back a replay by running its events through GameState::Think as fast as possible.  This
+/// uses exactly the same code to apply events as GameEngine does, so a replay of a game reproduces
+/// every complete state of that game.
+class GameReplayRunner {
+ public:
+  /// reference is used to create the GameState that the replay runs on.
+  GameReplayRunner(const GameState& reference);
+  ~GameReplayRunner();
+
+  /// Loads a replay and rewinds to its starting state.  Returns false if it is not a replay, has a
+  /// corrupt record, or does not have a starting state.  An incomplete record at the end is
+  /// ignored.
+  bool Load(const string& filename);
+  bool LoadFromString(const string& data);
+
+  /// Adds more of a replay that is still being recorded, such as a spectator stream, to the end of
+  /// the one that is loaded.  The first data added must start with the header, and the first
+  /// complete state record in it becomes the starting state.  Records can be split over any number
+  /// of calls.  Returns false if the data is not a replay or has a corrupt record.
+  bool AppendData(const string& data);
+
+  /// The timestep of the starting state, and of the last timestep in the replay.
+  StateTimestep GetFirstTimestep() const { return first_timestep_; }
+  StateTimestep GetLastTimestep() const { return first_timestep_ + timestep_offsets_.size(); }
+  int NumKeyframes() const { return keyframes_.size() - 1; }
+
+  /// The current state and the timestep it is at.
+  const GameState& GetState() const { return *state_; }
+  const GameEngineInfo& GetInfo() const { return info_; }
+  StateTimestep GetTimestep() const { return info_.state_timestep; }
+
+  /// Simulates the next timestep.  Returns false if the replay is over.
+  bool Step();
+
+  /// Simulates everything that is left, and returns the number of timesteps that took.
+  int RunToEnd();
+
+  /// Moves to state_timestep, by restoring the last keyframe at or before it and simulating
+  /// forward from there, unless simulating forward from the current state is less work.  Returns
+  /// false if state_timestep is not in the replay.
+  bool Seek(StateTimestep state_timestep);
+
+ private:
+  void RestoreState(int offset);
+
+  GameState* reference_;
+  GameState* state_;
+  GameEngineInfo info_;
+
+  string data_;
+  int parsed_size_;  // How much of data_ has been split into records, including the header.
+  StateTimestep first_timestep_;
+  vector<int> timestep_offsets_;               // Offset of the record for first_timestep_ + 1 + i.
+  vector<pair<StateTimestep, int> > keyframes_;  // Starting state first, then in timestep order.
+
+  // Events only live until the next Step(), so they all come out of one arena.
+  GameEventArena arena_;
+  TimestepEvents events_;
+  vector<GameEvent*> package_;  // Scratch space for reading each package.
+  DISALLOW_EVIL_CONSTRUCTORS(GameReplayRunner);
+};
+
+#endif // GAMEENGINE_GAMEREPLAY_H
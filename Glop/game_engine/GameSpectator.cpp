@@ -0,0 +1,180 @@
+#include "GameSpectator.h"
+#include "GameState.h"
+
+GameSpectatorServer::GameSpectatorServer(
+    NetworkManagerInterface* network_manager,
+    int keyframe_interval)
+  : network_manager_(network_manager),
+    keyframe_interval_(keyframe_interval),
+    timesteps_since_keyframe_(0),
+    stream_started_(false) {
+}
+
+GameSpectatorServer::~GameSpectatorServer() {
+  delete network_manager_;
+}
+
+bool GameSpectatorServer::Start(int port, const string& host_data) {
+  if (!network_manager_->Startup(port)) {
+    return false;
+  }
+  network_manager_->StartHosting(host_data);
+  return true;
+}
+
+void GameSpectatorServer::Think() {
+  network_manager_->Think();
+
+  // Spectators don't have anything to say.
+  GlopNetworkAddress gna;
+  string data;
+  while (network_manager_->ReceiveData(&gna, &data)) {}
+
+  vector<GlopNetworkAddress> connections = network_manager_->GetConnections();
+  bool new_spectators = false;
+  for (int i = 0; i < connections.size(); i++) {
+    if (!spectators_.count(connections[i])) {
+      new_spectators = true;
+    }
+  }
+
+  // catch_up_ already has everything in pending_, so new spectators only get the one message.
+  string pending, catch_up;
+  {
+    MutexLock lock(&mutex_);
+    pending.swap(pending_);
+    if (new_spectators) {
+      catch_up = catch_up_;
+    }
+  }
+  set<GlopNetworkAddress> spectators;
+  for (int i = 0; i < connections.size(); i++) {
+    if (spectators_.count(connections[i])) {
+      if (!pending.empty()) {
+        network_manager_->SendData(connections[i], pending);
+      }
+      spectators.insert(connections[i]);
+    } else if (!catch_up.empty()) {
+      network_manager_->SendData(connections[i], catch_up);
+      spectators.insert(connections[i]);
+    }
+  }
+  spectators_.swap(spectators);
+}
+
+void GameSpectatorServer::AddInitialState(const GameEngineInfo& info, const GameState& state) {
+  MutexLock lock(&mutex_);
+  int start = catch_up_.size();
+  AppendReplayState(info, state, &catch_up_);
+  AddRecord(start, true);
+}
+
+void GameSpectatorServer::AddTimestep(
+    const TimestepEvents& events,
+    const GameEngineInfo& info,
+    const GameState& state) {
+  MutexLock lock(&mutex_);
+  int start = catch_up_.size();
+  AppendReplayTimestep(info.state_timestep, events, &catch_up_);
+  AddRecord(start, false);
+  timesteps_since_keyframe_++;
+  if (keyframe_interval_ > 0 && timesteps_since_keyframe_ == keyframe_interval_) {
+    start = catch_up_.size();
+    AppendReplayState(info, state, &catch_up_);
+    AddRecord(start, true);
+  }
+}
+
+void GameSpectatorServer::AddStream(const string& data) {
+  MutexLock lock(&mutex_);
+  stream_ += data;
+  int pos = 0;
+  if (!stream_started_) {
+    if (stream_.size() < kReplayHeaderSize) {
+      return;
+    }
+    pos = kReplayHeaderSize;
+    stream_started_ = true;
+  }
+  while (pos < stream_.size()) {
+    int end = pos;
+    bool is_state;
+    if (!SkipReplayRecord(stream_, &end, &is_state)) {
+      break;
+    }
+    int start = catch_up_.size();
+    catch_up_.append(stream_, pos, end - pos);
+    AddRecord(start, is_state);
+    pos = end;
+  }
+  stream_.erase(0, pos);
+}
+
+void GameSpectatorServer::AddRecord(int start, bool is_state) {
+  // The records before a keyframe are never needed again, since everyone that is already watching
+  // has been sent them.
+  if (is_state) {
+    string header;
+    AppendReplayHeader(&header);
+    catch_up_.replace(0, start, header);
+    start = header.size();
+    timesteps_since_keyframe_ = 0;
+  }
+  pending_.append(catch_up_, start, string::npos);
+}
+
+GameSpectator::GameSpectator(const GameState& reference, NetworkManagerInterface* network_manager)
+  : network_manager_(network_manager),
+    server_(0, 0),
+    connected_(false),
+    replay_(reference),
+    relay_(NULL) {
+}
+
+GameSpectator::~GameSpectator() {
+  delete network_manager_;
+}
+
+bool GameSpectator::StartNetworkManager(int port) {
+  return network_manager_->Startup(port);
+}
+
+void GameSpectator::FindHosts(int port) {
+  network_manager_->FindHosts(port);
+}
+
+vector<pair<GlopNetworkAddress, string> > GameSpectator::AvailableHosts() const {
+  return network_manager_->AvailableHosts();
+}
+
+void GameSpectator::Connect(GlopNetworkAddress gna) {
+  server_ = gna;
+  connected_ = true;
+  network_manager_->Connect(gna);
+}
+
+bool GameSpectator::IsConnected() const {
+  vector<GlopNetworkAddress> connections = network_manager_->GetConnections();
+  for (int i = 0; i < connections.size(); i++) {
+    if (connections[i] == server_) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool GameSpectator::Think() {
+  network_manager_->Think();
+  if (!connected_) {
+    return true;
+  }
+  string data;
+  bool ok = true;
+  while (network_manager_->ReceiveData(server_, &data)) {
+    ok = replay_.AppendData(data) && ok;
+    if (relay_ != NULL) {
+      relay_->AddStream(data);
+    }
+  }
+  return ok;
+}
@@ -0,0 +1,117 @@
+#ifndef GAMEENGINE_GAMESPECTATOR_H
+#define GAMEENGINE_GAMESPECTATOR_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "P2PNG.h"
+#include "GameEngine.h"
+#include "GameReplay.h"
+#include "../Base.h"
+#include "../Thread.h"
+#include "../net/NetworkManagerInterface.h"
+
+class GameEvent;
+class GameState;
+
+/// Spectators watch a game live without being part of it.  A GameSpectatorServer is attached to one
+/// engine in the game, normally the host or a dedicated relay, and streams out every timestep once
+/// it is complete, in the same format as a replay.  Spectators never connect to the engines, so
+/// they are never waited on for completeness and never cause a rollback, and the players' upload
+/// doesn't change no matter how many of them there are.  A GameSpectator can pass on the stream it
+/// receives to a server of its own, so a large audience can be fanned out through a tree of
+/// spectators instead of all of them hanging off one engine.
+///
+/// Spectators that connect partway through start from the latest keyframe, so the server keeps
+/// every record since then around to catch them up.
+class GameSpectatorServer {
+ public:
+  /// Takes ownership of network_manager, which must not be the one that any engine is using.  The
+  /// state is sent as a keyframe every keyframe_interval timesteps.  If keyframe_interval is 0,
+  /// only the starting state is, and late spectators are sent everything since then.
+  GameSpectatorServer(NetworkManagerInterface* network_manager, int keyframe_interval);
+  ~GameSpectatorServer();
+
+  /// Starts accepting spectators on port, who can find us by way of host_data.
+  bool Start(int port, const string& host_data);
+
+  /// Sends everything that was added since the last Think() to the spectators, and catches up any
+  /// that have connected since then.  This must be called regularly by whoever owns the server.
+  void Think();
+
+  /// Number of spectators that are being sent the stream.
+  int NumSpectators() const { return spectators_.size(); }
+
+  /// These add to the stream, and are safe to call from any thread.  GameEngine calls the first
+  /// two, and a GameSpectator that is relaying calls AddStream with everything it receives, in
+  /// which case the keyframes are whatever the server upstream sent.
+  void AddInitialState(const GameEngineInfo& info, const GameState& state);
+  void AddTimestep(
+      const TimestepEvents& events,
+      const GameEngineInfo& info,
+      const GameState& state);
+  void AddStream(const string& data);
+
+ private:
+  // Adds the record at the end of catch_up_ to pending_, starting a new catch_up_ if it is a state.
+  // mutex_ must be held.
+  void AddRecord(int start, bool is_state);
+
+  NetworkManagerInterface* network_manager_;
+  int keyframe_interval_;
+  set<GlopNetworkAddress> spectators_;  // Only touched by Think().
+
+  // mutex_ guards everything below.  catch_up_ is the header, the latest keyframe and everything
+  // after it, and pending_ is everything that hasn't been sent to the existing spectators yet.
+  Mutex mutex_;
+  string catch_up_;
+  string pending_;
+  int timesteps_since_keyframe_;
+  string stream_;  // Part of a record passed to AddStream that the rest of hasn't arrived yet.
+  bool stream_started_;
+  DISALLOW_EVIL_CONSTRUCTORS(GameSpectatorServer);
+};
+
+/// Watches a game by way of a GameSpectatorServer.  Everything received goes into a
+/// GameReplayRunner, which can be stepped up to the newest timestep or kept a little behind it for
+/// smoother playback, and which can be sought and saved just like any other replay.
+class GameSpectator {
+ public:
+  /// reference is used to create the GameState that the game is played back on.  Takes ownership
+  /// of network_manager.
+  GameSpectator(const GameState& reference, NetworkManagerInterface* network_manager);
+  ~GameSpectator();
+
+  /// These work like the GameEngine functions of the same name.
+  bool StartNetworkManager(int port);
+  void FindHosts(int port);
+  vector<pair<GlopNetworkAddress, string> > AvailableHosts() const;
+  void Connect(GlopNetworkAddress gna);
+  bool IsConnected() const;
+
+  /// Passes on everything received to server, so that more spectators can watch through this one.
+  /// The server isn't owned by the spectator.  This must be called before Connect(), since the
+  /// server needs the stream from its start.
+  void RelayTo(GameSpectatorServer* server) { relay_ = server; }
+
+  /// Receives whatever has arrived.  Returns false if it isn't a spectator stream.
+  bool Think();
+
+  /// The game so far.  GetLastTimestep() is the newest complete timestep that has arrived.
+  GameReplayRunner* GetReplay() { return &replay_; }
+  /// Whether the starting state has arrived yet.  Nothing in the replay is valid until it has.
+  bool HasStarted() const { return replay_.NumKeyframes() >= 0; }
+
+ private:
+  NetworkManagerInterface* network_manager_;
+  GlopNetworkAddress server_;
+  bool connected_;
+  GameReplayRunner replay_;
+  GameSpectatorServer* relay_;
+  DISALLOW_EVIL_CONSTRUCTORS(GameSpectator);
+};
+
+#endif // GAMEENGINE_GAMESPECTATOR_H
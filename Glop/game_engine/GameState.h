@@ -7,6 +7,19 @@
 using namespace std;
 
 #include "P2PNG.h"
+#include "../Base.h"
+
+/// Scrambles a value before it is folded into a state hash.  Hashes that are maintained with
+/// hash ^= MixStateHash(x) can be updated incrementally: when x changes to y, apply
+/// hash ^= MixStateHash(x) ^ MixStateHash(y) instead of rehashing the whole state.
+inline uint32 MixStateHash(uint32 value) {
+  value ^= value >> 16;
+  value *= 0x85ebca6b;
+  value ^= value >> 13;
+  value *= 0xc2b2ae35;
+  value ^= value >> 16;
+  return value;
+}
 
 class GameState {
  public:
@@ -15,7 +28,38 @@ class GameState {
 
   virtual bool Think() = 0;
 
+  /// Returns a new GameState identical to this one.  The GameEngine calls this once for every
+  /// timestep it simulates or re-simulates, and keeps max_frames + 1 of the copies around, so large
+  /// states should make it cheap: store bulk data in CowArrays (see CowArray.h) so that a copy
+  /// shares everything with the original and only the parts written afterwards get duplicated.
   virtual GameState* Copy() const = 0;
+
+  /// Optionally overwrites dst with a copy of this state, reusing whatever memory dst already owns.
+  /// dst is always a state that was originally created by Copy() on a state of the same type.  The
+  /// GameEngine recycles the states that fall out of its history through this method, so that
+  /// steady-state rollback never has to allocate a new GameState.  Returns false if this is not
+  /// supported, in which case the engine falls back to Copy().
+  virtual bool CopyInto(GameState* dst) const { return false; }
+
+  /// Optionally stores a checksum of the entire state in hash and returns true.  The GameEngine
+  /// uses this to detect desyncs between engines and to stop backtracking early when re-simulating
+  /// a timestep did not change anything.  It is called at least once per simulated timestep, so it
+  /// should just return a value that is maintained incrementally by the events and Think() (see
+  /// MixStateHash), rather than walking the whole state.
+  virtual bool Hash(uint32* hash) const { return false; }
+
+  /// Returns whether this state is identical to other, which is always a state of the same type.
+  /// The GameEngine only calls this when a re-simulated state has the same Hash() as the state it
+  /// replaced, to make sure that isn't a collision before it skips re-simulating the states after
+  /// it.  The default compares the serialized states, which is slow but only happens about once
+  /// per rollback.  States that can tell more cheaply should override it.
+  virtual bool Equals(const GameState& other) const {
+    string data, other_data;
+    SerializeToString(&data);
+    other.SerializeToString(&other_data);
+    return data == other_data;
+  }
+
   virtual void SerializeToString(string* data) const = 0;
   virtual void ParseFromString(const string& data) = 0;
 };
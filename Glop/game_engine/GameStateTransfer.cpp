@@ -0,0 +1,78 @@
+#include "GameStateTransfer.h"
+#include "GameState.h"
+
+#include "../Thread.h"
+
+#include <zlib.h>
+
+class GameStateTransferThread : public Thread {
+ public:
+  GameStateTransferThread(GameStateTransfer* transfer) : transfer_(transfer) {}
+ protected:
+  virtual void Run() {
+    transfer_->Compress();
+  }
+ private:
+  GameStateTransfer* transfer_;
+};
+
+GameStateTransfer::GameStateTransfer(const GameState* snapshot)
+  : snapshot_(snapshot),
+    thread_(new GameStateTransferThread(this)),
+    raw_size_(0),
+    sent_bytes_(0),
+    done_(false) {
+  thread_->Start();
+}
+
+GameStateTransfer::~GameStateTransfer() {
+  thread_->Join();
+  delete thread_;
+}
+
+bool GameStateTransfer::IsReady() const {
+  MutexLock lock(&mutex_);
+  return done_;
+}
+
+void GameStateTransfer::Compress() {
+  string raw;
+  snapshot_->SerializeToString(&raw);
+  raw_size_ = raw.size();
+  uLongf size = compressBound(raw.size());
+  compressed_.resize(size);
+  int result = compress2(
+      (Bytef*)&compressed_[0], &size, (const Bytef*)raw.data(), raw.size(), Z_DEFAULT_COMPRESSION);
+  // This can only fail if zlib runs out of memory, since the buffer is always big enough.
+  ASSERT(result == Z_OK);
+  compressed_.resize(size);
+  MutexLock lock(&mutex_);
+  done_ = true;
+}
+
+bool GameStateTransfer::NextChunk(int max_bytes, string* chunk) {
+  if (!IsReady() || sent_bytes_ == compressed_.size()) {
+    return false;
+  }
+  int size = compressed_.size() - sent_bytes_;
+  if (size > max_bytes) {
+    size = max_bytes;
+  }
+  chunk->assign(compressed_, sent_bytes_, size);
+  sent_bytes_ += size;
+  return true;
+}
+
+bool GameStateTransfer::Decompress(const string& compressed, int raw_size, string* raw) {
+  if (raw_size < 0) {
+    return false;
+  }
+  raw->resize(raw_size);
+  if (raw_size == 0) {
+    return compressed.size() > 0;
+  }
+  uLongf size = raw_size;
+  int result = uncompress(
+      (Bytef*)&(*raw)[0], &size, (const Bytef*)compressed.data(), compressed.size());
+  return result == Z_OK && size == raw_size;
+}
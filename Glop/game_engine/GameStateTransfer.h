@@ -0,0 +1,68 @@
+#ifndef GAMEENGINE_GAMESTATETRANSFER_H
+#define GAMEENGINE_GAMESTATETRANSFER_H
+
+#include <string>
+using namespace std;
+
+#include "../Base.h"
+#include "../Thread.h"
+
+class GameState;
+class GameStateTransferThread;
+
+/// A GameStateTransfer gets a GameState ready to be sent to an engine that is joining a game
+/// without stalling the engine that sends it.  The state is serialized and compressed with zlib on
+/// a background thread, and once that is done the compressed data is handed out in chunks of
+/// whatever size the caller likes, so that it can be spread out over several frames.
+///
+/// The snapshot given to the constructor is read from the background thread, so nothing may write
+/// to it until IsReady() returns true.  It is never deleted or modified by the transfer; that is up
+/// to the caller, and must happen on the caller's thread since GameStates may share data, like the
+/// pages of a CowArray, with the states the caller is still simulating.
+class GameStateTransfer {
+ public:
+  explicit GameStateTransfer(const GameState* snapshot);
+
+  /// Waits for the background thread if it is still running.
+  ~GameStateTransfer();
+
+  /// Returns true once the compressed data is available.  After that the snapshot is no longer
+  /// used, and the caller may read the results and reuse the snapshot without any more locking.
+  bool IsReady() const;
+
+  /// Sets chunk to the next max_bytes or fewer bytes of the compressed data.  Returns false, and
+  /// leaves chunk alone, if the transfer is not ready or every byte has already been handed out.
+  bool NextChunk(int max_bytes, string* chunk);
+
+  /// Returns true once every byte has been handed out by NextChunk.
+  bool IsFinished() const { return IsReady() && sent_bytes_ == compressed_.size(); }
+
+  /// Sizes of the serialized state before and after compression.  Only valid once IsReady().
+  int raw_size() const { return raw_size_; }
+  int compressed_size() const { return compressed_.size(); }
+
+  /// Undoes the compression done by a transfer.  raw_size is the raw_size() of the transfer.
+  /// Returns false if the data is corrupt.
+  static bool Decompress(const string& compressed, int raw_size, string* raw);
+
+ private:
+  friend class GameStateTransferThread;
+
+  // Runs on the background thread.
+  void Compress();
+
+  const GameState* snapshot_;
+  GameStateTransferThread* thread_;
+  int raw_size_;
+  string compressed_;
+  int sent_bytes_;
+
+  // Compress() sets done_ after everything else it writes, and the thread that called IsReady()
+  // only touches raw_size_, compressed_ and the snapshot once it has seen it.
+  mutable Mutex mutex_;
+  bool done_;  // Guarded by mutex_.
+
+  DISALLOW_EVIL_CONSTRUCTORS(GameStateTransfer);
+};
+
+#endif // GAMEENGINE_GAMESTATETRANSFER_H
@@ -0,0 +1,67 @@
+#include <gtest/gtest.h>
+#include "GameStateTransfer.h"
+#include "GameState.h"
+#include "../System.h"
+
+// A state that is just a big blob of bytes.
+class BlobState : public GameState {
+ public:
+  virtual bool Think() { return true; }
+  virtual GameState* Copy() const {
+    BlobState* state = new BlobState;
+    state->blob = blob;
+    return state;
+  }
+  virtual void SerializeToString(string* data) const {
+    *data = blob;
+  }
+  virtual void ParseFromString(const string& data) {
+    blob = data;
+  }
+  string blob;
+};
+
+class GlopEnvironment : public testing::Environment {
+ public:
+  GlopEnvironment() {
+    testing::AddGlobalTestEnvironment(this);
+  }
+  virtual void SetUp() {
+    System::Init();
+  }
+};
+static GlopEnvironment* env = new GlopEnvironment;
+
+TEST(GameStateTransferTest, TestStatesSurviveBeingChunked) {
+  BlobState state;
+  for (int i = 0; i < 100000; i++) {
+    state.blob += (char)('a' + (i * i) % 7);
+  }
+  GameStateTransfer transfer(&state);
+  string chunk;
+  while (!transfer.IsReady()) {
+    EXPECT_FALSE(transfer.NextChunk(1000, &chunk));
+    system()->Sleep(1);
+  }
+  EXPECT_EQ(state.blob.size(), transfer.raw_size());
+  EXPECT_LT(transfer.compressed_size(), transfer.raw_size() / 4);
+
+  string compressed;
+  int chunks = 0;
+  while (transfer.NextChunk(1000, &chunk)) {
+    EXPECT_LE(chunk.size(), 1000);
+    compressed += chunk;
+    chunks++;
+  }
+  EXPECT_TRUE(transfer.IsFinished());
+  EXPECT_EQ((transfer.compressed_size() + 999) / 1000, chunks);
+
+  string raw;
+  ASSERT_TRUE(GameStateTransfer::Decompress(compressed, transfer.raw_size(), &raw));
+  EXPECT_TRUE(raw == state.blob);
+
+  // Missing a chunk or lying about the size is caught.
+  EXPECT_FALSE(GameStateTransfer::Decompress(
+      compressed.substr(0, compressed.size() - 1), transfer.raw_size(), &raw));
+  EXPECT_FALSE(GameStateTransfer::Decompress(compressed, transfer.raw_size() + 1, &raw));
+}
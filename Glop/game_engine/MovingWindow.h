@@ -8,7 +8,7 @@
 template <class T>
 class MovingWindow {
  public:
-  MovingWindow() : size_(-1), first_index_(-1), data_(NULL) {
+  MovingWindow() : data_(NULL), size_(-1), first_index_(-1) {
     
   }
 
@@ -28,12 +28,17 @@ class MovingWindow {
     first_index_ = window.first_index_;
   }
   MovingWindow& operator=(const MovingWindow& window) {
+    if (this == &window) {
+      return *this;
+    }
+    delete[] data_;
     size_ = window.size_;
     data_ = new T[size_];
     for (int i = 0; i < size_; i++) {
       new (&data_[i]) T(window.data_[i]);
     }
     first_index_ = window.first_index_;
+    return *this;
   }
 
   ~MovingWindow() {
@@ -75,6 +80,15 @@ class MovingWindow {
     new (&data_[((first_index_ % size_) + size_ - 1) % size_]) T();
   }
 
+  /// Same as Advance(), except that instead of destroying the element that leaves the window it is
+  /// handed back through retired.  This lets windows of pointers recycle whatever they point to.
+  void Advance(T* retired) {
+    T& first = data_[((first_index_ % size_) + size_) % size_];
+    *retired = first;
+    first = T();
+    Advance();
+  }
+
   int GetFirstIndex() const { return first_index_; }
   int GetLastIndex() const { return first_index_ + size_ - 1; }
   int size() const { return size_; }
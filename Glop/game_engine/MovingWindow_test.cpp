@@ -62,3 +62,17 @@ TEST(MovingWindowText, TestMovingForALongTime) {
     }
   }
 }
+
+TEST(MovingWindowText, TestAdvanceHandsBackRetiredElement) {
+  MovingWindow<int*> mv(3, 0);
+  int values[3];
+  for (int i = 0; i < 3; i++) {
+    mv[i] = &values[i];
+  }
+  int* retired = NULL;
+  mv.Advance(&retired);
+  EXPECT_EQ(&values[0], retired);
+  EXPECT_EQ(1, mv.GetFirstIndex());
+  EXPECT_EQ(NULL, mv[mv.GetLastIndex()]);
+  EXPECT_EQ(&values[1], mv[1]);
+}
@@ -0,0 +1,69 @@
+#include "TimestepEvents.h"
+#include "GameEvent.h"
+
+void TimestepEvents::GetEvents(EngineID engine_id, vector<GameEvent*>* events) const {
+  int index = FindPackage(engine_id);
+  if (index == packages_.size() || packages_[index].engine_id != engine_id) {
+    return;
+  }
+  for (int i = packages_[index].begin; i < packages_[index].end; i++) {
+    events->push_back(records_[i].event);
+  }
+}
+
+void TimestepEvents::SetPackage(EngineID engine_id, const vector<GameEvent*>& events) {
+  int index = FindPackage(engine_id);
+  int old_size = 0;
+  if (index < packages_.size() && packages_[index].engine_id == engine_id) {
+    old_size = packages_[index].end - packages_[index].begin;
+  } else {
+    int begin = index < packages_.size() ? packages_[index].begin : records_.size();
+    Package package = {engine_id, begin, begin};
+    packages_.insert(packages_.begin() + index, package);
+    engine_ids_.insert(engine_id);
+  }
+
+  // Resize the package's run of records in place, then fix up the packages after it.
+  int begin = packages_[index].begin;
+  int delta = (int)events.size() - old_size;
+  if (delta > 0) {
+    Record blank = {engine_id, 0, NULL};
+    records_.insert(records_.begin() + begin + old_size, delta, blank);
+  } else if (delta < 0) {
+    records_.erase(records_.begin() + begin + events.size(), records_.begin() + begin + old_size);
+  }
+  for (int i = 0; i < events.size(); i++) {
+    Record& record = records_[begin + i];
+    record.engine_id = engine_id;
+    record.type = events[i]->type();
+    record.event = events[i];
+  }
+  packages_[index].end = begin + events.size();
+  for (int i = index + 1; i < packages_.size(); i++) {
+    packages_[i].begin += delta;
+    packages_[i].end += delta;
+  }
+}
+
+void TimestepEvents::clear() {
+  packages_.clear();
+  records_.clear();
+  engine_ids_.clear();
+}
+
+void TimestepEvents::swap(TimestepEvents& other) {
+  packages_.swap(other.packages_);
+  records_.swap(other.records_);
+  EngineSet engine_ids = engine_ids_;
+  engine_ids_ = other.engine_ids_;
+  other.engine_ids_ = engine_ids;
+}
+
+int TimestepEvents::FindPackage(EngineID engine_id) const {
+  // Packages mostly arrive in engine order, so search from the back.
+  int index = packages_.size();
+  while (index > 0 && packages_[index - 1].engine_id >= engine_id) {
+    index--;
+  }
+  return index;
+}
@@ -0,0 +1,69 @@
+#ifndef GAMEENGINE_TIMESTEPEVENTS_H
+#define GAMEENGINE_TIMESTEPEVENTS_H
+
+#include <vector>
+using namespace std;
+
+#include "P2PNG.h"
+#include "EngineSet.h"
+#include "../Base.h"
+
+class GameEvent;
+
+/// All of the packages of events that apply to one timestep, stored as one flat table rather than a
+/// map of vectors.  Every event gets a record holding its engine and its type, and the records are
+/// kept sorted by engine, so a package is just a run of consecutive records.  Applying a timestep
+/// is then a linear scan over two small arrays, and the engine-level events can be picked out
+/// without touching the events themselves, which matters when a deep rollback re-applies dozens of
+/// timesteps in a row.  The events are not owned by the table; in the GameEngine they live in the
+/// timestep's GameEventArena.
+///
+/// A table that is cleared and refilled keeps its memory, so the engine recycles one per timestep
+/// and stops allocating once they have grown to fit a typical timestep.
+class TimestepEvents {
+ public:
+  struct Record {
+    EngineID engine_id;
+    int type;  // Same as event->type(), kept here so scans don't need to dereference the event.
+    GameEvent* event;
+  };
+  /// The records of engine_id's package are [begin, end).  Packages can be empty.
+  struct Package {
+    EngineID engine_id;
+    int begin;
+    int end;
+  };
+
+  TimestepEvents() {}
+
+  /// Packages are in engine order.
+  int NumPackages() const { return packages_.size(); }
+  const Package& GetPackage(int index) const { return packages_[index]; }
+  int NumRecords() const { return records_.size(); }
+  const Record& GetRecord(int index) const { return records_[index]; }
+
+  /// The engines that have a package here, even if it is empty.
+  const EngineSet& engine_ids() const { return engine_ids_; }
+  bool HasPackage(EngineID engine_id) const { return engine_ids_.count(engine_id) > 0; }
+  bool empty() const { return packages_.empty(); }
+
+  /// Appends the events in engine_id's package to events.
+  void GetEvents(EngineID engine_id, vector<GameEvent*>* events) const;
+
+  /// Adds a package for engine_id, replacing the one that was there, if any.
+  void SetPackage(EngineID engine_id, const vector<GameEvent*>& events);
+
+  /// Removes every package without giving back any memory.
+  void clear();
+  void swap(TimestepEvents& other);
+
+ private:
+  // Index of the first package whose engine is at least engine_id.
+  int FindPackage(EngineID engine_id) const;
+
+  vector<Package> packages_;
+  vector<Record> records_;
+  EngineSet engine_ids_;
+};
+
+#endif // GAMEENGINE_TIMESTEPEVENTS_H
@@ -0,0 +1,126 @@
+#include <gtest/gtest.h>
+#include "GameEvent.h"
+#include "TimestepEvents.h"
+#include "TestProtos.pb.h"
+
+class TableTestEvent : public GameEvent {
+ public:
+  TableTestEvent() {
+    typed_data_ = new Foo;
+    data_ = typed_data_;
+  }
+  ~TableTestEvent() {
+    delete typed_data_;
+  }
+  Foo* GetData() {
+    return typed_data_;
+  }
+ private:
+  Foo* typed_data_;
+};
+REGISTER_EVENT(310, TableTestEvent);
+
+class TimestepEventsTest : public testing::Test {
+ protected:
+  ~TimestepEventsTest() {
+    for (int i = 0; i < events_.size(); i++) {
+      delete events_[i];
+    }
+  }
+
+  vector<GameEvent*> MakePackage(int size) {
+    vector<GameEvent*> package;
+    for (int i = 0; i < size; i++) {
+      events_.push_back(NewTableTestEvent());
+      package.push_back(events_.back());
+    }
+    return package;
+  }
+
+  // Checks that the records are exactly the packages laid end to end in engine order.
+  void ExpectConsistent(const TimestepEvents& table) {
+    int next = 0;
+    EngineSet engine_ids;
+    for (int i = 0; i < table.NumPackages(); i++) {
+      const TimestepEvents::Package& package = table.GetPackage(i);
+      if (i > 0) {
+        EXPECT_LT(table.GetPackage(i - 1).engine_id, package.engine_id);
+      }
+      EXPECT_EQ(next, package.begin);
+      for (int j = package.begin; j < package.end; j++) {
+        EXPECT_EQ(package.engine_id, table.GetRecord(j).engine_id);
+        EXPECT_EQ(table.GetRecord(j).event->type(), table.GetRecord(j).type);
+      }
+      next = package.end;
+      engine_ids.insert(package.engine_id);
+    }
+    EXPECT_EQ(next, table.NumRecords());
+    EXPECT_TRUE(engine_ids == table.engine_ids());
+  }
+
+  vector<GameEvent*> events_;
+};
+
+TEST_F(TimestepEventsTest, TestPackagesAreSortedByEngine) {
+  TimestepEvents table;
+  EXPECT_TRUE(table.empty());
+  vector<GameEvent*> five = MakePackage(2), one = MakePackage(3), three = MakePackage(1);
+  table.SetPackage(5, five);
+  table.SetPackage(1, one);
+  table.SetPackage(3, three);
+  table.SetPackage(7, vector<GameEvent*>());
+  ExpectConsistent(table);
+  ASSERT_EQ(4, table.NumPackages());
+  EXPECT_EQ(1, table.GetPackage(0).engine_id);
+  EXPECT_EQ(7, table.GetPackage(3).engine_id);
+  EXPECT_EQ(0, table.GetPackage(3).end - table.GetPackage(3).begin);
+  EXPECT_TRUE(table.HasPackage(7));
+  EXPECT_FALSE(table.HasPackage(2));
+
+  vector<GameEvent*> events;
+  table.GetEvents(5, &events);
+  EXPECT_TRUE(events == five);
+  events.clear();
+  table.GetEvents(2, &events);
+  EXPECT_TRUE(events.empty());
+}
+
+TEST_F(TimestepEventsTest, TestReplacingAPackage) {
+  TimestepEvents table;
+  vector<GameEvent*> first = MakePackage(1), middle = MakePackage(2), last = MakePackage(3);
+  table.SetPackage(0, first);
+  table.SetPackage(4, middle);
+  table.SetPackage(9, last);
+
+  vector<GameEvent*> bigger = MakePackage(4);
+  table.SetPackage(4, bigger);
+  ExpectConsistent(table);
+  vector<GameEvent*> events;
+  table.GetEvents(4, &events);
+  EXPECT_TRUE(events == bigger);
+  events.clear();
+  table.GetEvents(9, &events);
+  EXPECT_TRUE(events == last);
+
+  table.SetPackage(4, vector<GameEvent*>());
+  ExpectConsistent(table);
+  EXPECT_EQ(4, table.NumRecords());
+  EXPECT_EQ(3, table.NumPackages());
+}
+
+TEST_F(TimestepEventsTest, TestClearAndSwap) {
+  TimestepEvents a, b;
+  a.SetPackage(2, MakePackage(2));
+  b.SetPackage(3, MakePackage(1));
+  b.SetPackage(6, MakePackage(1));
+  a.swap(b);
+  ExpectConsistent(a);
+  ExpectConsistent(b);
+  EXPECT_EQ(2, a.NumPackages());
+  EXPECT_TRUE(b.HasPackage(2));
+  EXPECT_FALSE(b.HasPackage(3));
+  a.clear();
+  EXPECT_TRUE(a.empty());
+  EXPECT_EQ(0, a.NumRecords());
+  EXPECT_TRUE(a.engine_ids().empty());
+}
@@ -0,0 +1,44 @@
+#ifndef GAMEENGINE_VARINT_H
+#define GAMEENGINE_VARINT_H
+
+#include <string>
+using namespace std;
+
+#include "../Base.h"
+
+// Varint helpers for the compact binary formats used by GameConnection and GameReplay.  Signed
+// values are zigzagged first so that small negative numbers stay small.
+
+inline uint64 ZigZag(int64 value) {
+  return (uint64(value) << 1) ^ uint64(value >> 63);
+}
+
+inline int64 UnZigZag(uint64 value) {
+  return int64(value >> 1) ^ -int64(value & 1);
+}
+
+inline void AppendVarint(uint64 value, string* data) {
+  while (value >= 0x80) {
+    data->push_back((char)((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  data->push_back((char)value);
+}
+
+// Reads a varint starting at *pos and advances *pos past it.  Returns false if data ends first.
+inline bool ReadVarint(const string& data, int* pos, uint64* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (*pos >= data.size()) {
+      return false;
+    }
+    unsigned char byte = data[(*pos)++];
+    *value |= uint64(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#endif // GAMEENGINE_VARINT_H
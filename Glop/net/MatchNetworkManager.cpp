@@ -0,0 +1,334 @@
+#include "MatchNetworkManager.h"
+
+static const int kHeaderSize = 5;
+
+static void AppendInt(int value, string* data) {
+  for (int i = 0; i < 4; i++) {
+    data->push_back((char)((value >> (i * 8)) & 0xff));
+  }
+}
+
+static int ReadInt(const string& data, int pos) {
+  unsigned int value = 0;
+  for (int i = 0; i < 4; i++) {
+    value |= (unsigned int)(unsigned char)data[pos + i] << (i * 8);
+  }
+  return (int)value;
+}
+
+MatchTransport::MatchTransport(NetworkManagerInterface* network_manager)
+  : network_manager_(network_manager),
+    started_(false) {
+}
+
+MatchTransport::~MatchTransport() {
+  // Every MatchNetworkManager points back at us, so they all have to be gone by now.
+  ASSERT(matches_.empty());
+  delete network_manager_;
+}
+
+bool MatchTransport::Startup(int port) {
+  MutexLock lock(&mutex_);
+  if (!started_) {
+    started_ = network_manager_->Startup(port);
+  }
+  return started_;
+}
+
+MatchNetworkManager* MatchTransport::NewMatch(MatchID match_id) {
+  MutexLock lock(&mutex_);
+  if (matches_.count(match_id)) {
+    return NULL;
+  }
+  MatchNetworkManager* match = new MatchNetworkManager(this, match_id);
+  matches_[match_id] = match;
+  return match;
+}
+
+int MatchTransport::NumMatches() const {
+  MutexLock lock(&mutex_);
+  return matches_.size();
+}
+
+void MatchTransport::WriteHeader(MatchID match_id, MessageType type, string* data) {
+  AppendInt(match_id, data);
+  data->push_back((char)type);
+}
+
+void MatchTransport::SendControl(MatchID match_id, MessageType type, GlopNetworkAddress gna) {
+  string data;
+  WriteHeader(match_id, type, &data);
+  network_manager_->SendData(gna, data);
+}
+
+void MatchTransport::Think() {
+  MutexLock lock(&mutex_);
+  network_manager_->Think();
+
+  // Connections that went away take every match that was using them along, including any that
+  // were about to start using them.
+  vector<GlopNetworkAddress> connections = network_manager_->GetConnections();
+  set<GlopNetworkAddress> live(connections.begin(), connections.end());
+  set<GlopNetworkAddress>::iterator gna_it;
+  for (gna_it = live_connections_.begin(); gna_it != live_connections_.end(); gna_it++) {
+    if (live.count(*gna_it)) {
+      continue;
+    }
+    map<MatchID, MatchNetworkManager*>::iterator it;
+    for (it = matches_.begin(); it != matches_.end(); it++) {
+      it->second->connections_.erase(*gna_it);
+      pending_connects_.erase(make_pair(it->first, *gna_it));
+    }
+    connection_users_.erase(*gna_it);
+  }
+  live_connections_ = live;
+
+  // Matches that were waiting on a connection find out about it once it is made, and tell the
+  // other end that they are using it.
+  set<pair<MatchID, GlopNetworkAddress> >::iterator pending_it = pending_connects_.begin();
+  while (pending_it != pending_connects_.end()) {
+    if (!live.count(pending_it->second)) {
+      pending_it++;
+      continue;
+    }
+    SendControl(pending_it->first, kJoin, pending_it->second);
+    matches_[pending_it->first]->connections_.insert(pending_it->second);
+    pending_connects_.erase(pending_it++);
+  }
+
+  GlopNetworkAddress gna;
+  string data;
+  while (network_manager_->ReceiveData(&gna, &data)) {
+    if (data.size() < kHeaderSize) {
+      continue;
+    }
+    map<MatchID, MatchNetworkManager*>::iterator it = matches_.find(ReadInt(data, 0));
+    if (it == matches_.end()) {
+      continue;
+    }
+    MatchNetworkManager* match = it->second;
+    switch (data[4]) {
+      case kData:
+        match->incoming_data_.push_back(make_pair(gna, data.substr(kHeaderSize)));
+        break;
+      case kJoin:
+        if (match->connections_.insert(gna).second) {
+          connection_users_[gna]++;
+        }
+        break;
+      case kLeave:
+        if (match->connections_.erase(gna)) {
+          ReleaseConnection(gna);
+        }
+        break;
+    }
+  }
+}
+
+void MatchTransport::RemoveMatch(MatchID match_id) {
+  MutexLock lock(&mutex_);
+  MatchNetworkManager* match = matches_[match_id];
+  while (!match->connections_.empty()) {
+    DropConnection(match_id, *match->connections_.begin());
+  }
+  set<pair<MatchID, GlopNetworkAddress> >::iterator it = pending_connects_.begin();
+  while (it != pending_connects_.end()) {
+    pair<MatchID, GlopNetworkAddress> pending = *it++;
+    if (pending.first == match_id) {
+      DropConnection(match_id, pending.second);
+    }
+  }
+  if (host_data_.erase(match_id)) {
+    UpdateHosting();
+  }
+  matches_.erase(match_id);
+}
+
+void MatchTransport::SetHostData(MatchID match_id, const string* data) {
+  MutexLock lock(&mutex_);
+  if (data == NULL) {
+    if (!host_data_.erase(match_id)) {
+      return;
+    }
+  } else {
+    host_data_[match_id] = *data;
+  }
+  UpdateHosting();
+}
+
+void MatchTransport::UpdateHosting() {
+  if (host_data_.empty()) {
+    network_manager_->StopHosting();
+    return;
+  }
+  // Every match's advertisement goes out in one message, as a list of (match, length, data).
+  string all_data;
+  map<MatchID, string>::iterator it;
+  for (it = host_data_.begin(); it != host_data_.end(); it++) {
+    AppendInt(it->first, &all_data);
+    AppendInt(it->second.size(), &all_data);
+    all_data += it->second;
+  }
+  network_manager_->StartHosting(all_data);
+}
+
+void MatchTransport::Connect(MatchID match_id, GlopNetworkAddress gna) {
+  MutexLock lock(&mutex_);
+  if (matches_[match_id]->connections_.count(gna) ||
+      pending_connects_.count(make_pair(match_id, gna))) {
+    return;
+  }
+  if (connection_users_[gna]++ == 0 && !live_connections_.count(gna)) {
+    network_manager_->Connect(gna);
+  }
+  // If the connection is already there, Think() sends our kJoin over it right away.
+  pending_connects_.insert(make_pair(match_id, gna));
+}
+
+void MatchTransport::Disconnect(MatchID match_id, GlopNetworkAddress gna) {
+  MutexLock lock(&mutex_);
+  DropConnection(match_id, gna);
+}
+
+void MatchTransport::DropConnection(MatchID match_id, GlopNetworkAddress gna) {
+  if (matches_[match_id]->connections_.erase(gna)) {
+    SendControl(match_id, kLeave, gna);
+  } else if (!pending_connects_.erase(make_pair(match_id, gna))) {
+    return;
+  }
+  ReleaseConnection(gna);
+}
+
+void MatchTransport::ReleaseConnection(GlopNetworkAddress gna) {
+  if (--connection_users_[gna] == 0) {
+    connection_users_.erase(gna);
+    network_manager_->Disconnect(gna);
+  }
+}
+
+void MatchTransport::SendData(MatchID match_id, GlopNetworkAddress gna, const string& data) {
+  string message;
+  message.reserve(kHeaderSize + data.size());
+  WriteHeader(match_id, kData, &message);
+  message += data;
+  MutexLock lock(&mutex_);
+  network_manager_->SendData(gna, message);
+}
+
+MatchNetworkManager::MatchNetworkManager(MatchTransport* transport, MatchID match_id)
+  : transport_(transport),
+    match_id_(match_id) {
+}
+
+MatchNetworkManager::~MatchNetworkManager() {
+  transport_->RemoveMatch(match_id_);
+}
+
+bool MatchNetworkManager::Startup(int port) {
+  return transport_->Startup(port);
+}
+
+void MatchNetworkManager::StartHosting(const string& data) {
+  transport_->SetHostData(match_id_, &data);
+}
+
+void MatchNetworkManager::StopHosting() {
+  transport_->SetHostData(match_id_, NULL);
+}
+
+void MatchNetworkManager::FindHosts(int port) {
+  MutexLock lock(&transport_->mutex_);
+  transport_->network_manager_->FindHosts(port);
+}
+
+void MatchNetworkManager::ClearHosts() {
+  MutexLock lock(&transport_->mutex_);
+  transport_->network_manager_->ClearHosts();
+}
+
+vector<pair<GlopNetworkAddress, string> > MatchNetworkManager::AvailableHosts() const {
+  vector<pair<GlopNetworkAddress, string> > hosts;
+  {
+    MutexLock lock(&transport_->mutex_);
+    hosts = transport_->network_manager_->AvailableHosts();
+  }
+  // Hosts that aren't using a MatchTransport, or whose advertisement is cut off, don't parse, and
+  // are skipped.
+  vector<pair<GlopNetworkAddress, string> > ret;
+  for (int i = 0; i < hosts.size(); i++) {
+    const string& data = hosts[i].second;
+    int pos = 0;
+    while (pos + 8 <= data.size()) {
+      MatchID match_id = ReadInt(data, pos);
+      int size = ReadInt(data, pos + 4);
+      pos += 8;
+      if (size < 0 || size > data.size() - pos) {
+        break;
+      }
+      if (match_id == match_id_) {
+        ret.push_back(make_pair(hosts[i].first, data.substr(pos, size)));
+      }
+      pos += size;
+    }
+  }
+  return ret;
+}
+
+void MatchNetworkManager::Connect(GlopNetworkAddress gna) {
+  transport_->Connect(match_id_, gna);
+}
+
+void MatchNetworkManager::Disconnect(GlopNetworkAddress gna) {
+  transport_->Disconnect(match_id_, gna);
+}
+
+vector<GlopNetworkAddress> MatchNetworkManager::GetConnections() const {
+  MutexLock lock(&transport_->mutex_);
+  return vector<GlopNetworkAddress>(connections_.begin(), connections_.end());
+}
+
+void MatchNetworkManager::SendData(GlopNetworkAddress gna, const string& data) {
+  transport_->SendData(match_id_, gna, data);
+}
+
+bool MatchNetworkManager::ReceiveData(GlopNetworkAddress* gna, string* data) {
+  MutexLock lock(&transport_->mutex_);
+  if (incoming_data_.empty()) {
+    return false;
+  }
+  *gna = incoming_data_.front().first;
+  data->swap(incoming_data_.front().second);
+  incoming_data_.pop_front();
+  return true;
+}
+
+bool MatchNetworkManager::ReceiveData(GlopNetworkAddress gna, string* data) {
+  MutexLock lock(&transport_->mutex_);
+  list<pair<GlopNetworkAddress, string> >::iterator it;
+  for (it = incoming_data_.begin(); it != incoming_data_.end(); it++) {
+    if (it->first == gna) {
+      data->swap(it->second);
+      incoming_data_.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool MatchNetworkManager::ReceiveData(GlopNetworkAddress* gna, const string& data) {
+  MutexLock lock(&transport_->mutex_);
+  list<pair<GlopNetworkAddress, string> >::iterator it;
+  for (it = incoming_data_.begin(); it != incoming_data_.end(); it++) {
+    if (it->second == data) {
+      *gna = it->first;
+      incoming_data_.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+int MatchNetworkManager::PendingData() const {
+  MutexLock lock(&transport_->mutex_);
+  return incoming_data_.size();
+}
@@ -0,0 +1,132 @@
+#ifndef GLOP_NET_MATCH_NETWORK_MANAGER_H__
+#define GLOP_NET_MATCH_NETWORK_MANAGER_H__
+
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "NetworkManagerInterface.h"
+#include "../Thread.h"
+
+typedef int MatchID;
+
+class MatchNetworkManager;
+
+// Lets many matches in one process share a single NetworkManagerInterface, so that hosting a
+// hundred small games costs one socket rather than a hundred.  Each match gets its own
+// MatchNetworkManager, which looks like a whole network manager to the GameEngine it is installed
+// in, but only sees the hosts, connections and data that belong to its match.
+//
+// Every message is prefixed with a 5 byte header naming the match it belongs to.  A match learns
+// about a connection when the other end announces that it is in the same match, so two processes
+// that both use a MatchTransport can have any number of matches going between them over one
+// connection.  Both ends have to agree on the MatchID, which is normally handed out by whatever
+// does the matchmaking.
+//
+// The transport owns the underlying network manager.  Think() must be called once per frame by
+// whoever owns the transport, before the engines think; MatchNetworkManager::Think() does nothing,
+// so that a hundred engines don't all pump the same socket.  Everything else is safe to call from
+// any thread, since the engines sharing a transport are usually spread over a thread pool.
+class MatchTransport {
+ public:
+  MatchTransport(NetworkManagerInterface* network_manager);
+  ~MatchTransport();
+
+  // Starts the underlying network manager, if it hasn't been already.
+  bool Startup(int port);
+
+  // Returns a new network manager for match_id, which belongs to the caller (usually by way of
+  // GameEngine::InstallNetworkManager).  There can be only one per MatchID at a time, and it must
+  // be deleted before the transport is.
+  MatchNetworkManager* NewMatch(MatchID match_id);
+
+  // Pumps the underlying network manager and hands the data it received to the matches.
+  void Think();
+
+  int NumMatches() const;
+
+ private:
+  friend class MatchNetworkManager;
+
+  enum MessageType {
+    kData = 0,
+    kJoin = 1,   // The sender has a connection to us in this match.
+    kLeave = 2,  // The sender has disconnected from us in this match.
+  };
+  static void WriteHeader(MatchID match_id, MessageType type, string* data);
+
+  // Called by MatchNetworkManager, with mutex_ not held.
+  void RemoveMatch(MatchID match_id);
+  void SetHostData(MatchID match_id, const string* data);
+  void Connect(MatchID match_id, GlopNetworkAddress gna);
+  void Disconnect(MatchID match_id, GlopNetworkAddress gna);
+  void SendData(MatchID match_id, GlopNetworkAddress gna, const string& data);
+
+  // These all need mutex_ to be held.
+  void SendControl(MatchID match_id, MessageType type, GlopNetworkAddress gna);
+  void UpdateHosting();
+  void DropConnection(MatchID match_id, GlopNetworkAddress gna);
+  void ReleaseConnection(GlopNetworkAddress gna);  // One less match is using gna.
+
+  NetworkManagerInterface* network_manager_;
+  bool started_;
+  mutable Mutex mutex_;
+  map<MatchID, MatchNetworkManager*> matches_;
+  map<MatchID, string> host_data_;
+  // How many matches are using each connection of the underlying network manager, so that it is
+  // only dropped once none of them are.
+  map<GlopNetworkAddress, int> connection_users_;
+  // Connections requested by a match that the underlying manager hasn't finished making yet.
+  set<pair<MatchID, GlopNetworkAddress> > pending_connects_;
+  set<GlopNetworkAddress> live_connections_;
+};
+
+// The view of a MatchTransport that one match's GameEngine gets.  See MatchTransport.
+class MatchNetworkManager : public NetworkManagerInterface {
+ public:
+  virtual ~MatchNetworkManager();
+
+  MatchID match_id() const { return match_id_; }
+
+  virtual bool Startup(int port);
+
+  // Hosts from every match are advertised together by the underlying manager, and FindHosts only
+  // turns up hosts of the same MatchID.  RakNet limits the size of the advertisement, so matches
+  // that want to be found this way should keep their message short.
+  virtual void StartHosting(const string& data);
+  virtual void StopHosting();
+
+  virtual void FindHosts(int port);
+  virtual void ClearHosts();
+  virtual vector<pair<GlopNetworkAddress, string> > AvailableHosts() const;
+  virtual void Connect(GlopNetworkAddress gna);
+  virtual void Disconnect(GlopNetworkAddress gna);
+  virtual vector<GlopNetworkAddress> GetConnections() const;
+
+  virtual void SendData(GlopNetworkAddress gna, const string& data);
+  virtual bool ReceiveData(GlopNetworkAddress* gna, string* data);
+  virtual bool ReceiveData(GlopNetworkAddress gna, string* data);
+  virtual bool ReceiveData(GlopNetworkAddress* gna, const string& data);
+
+  virtual int PendingData() const;
+
+  virtual void Think() {}
+
+ private:
+  friend class MatchTransport;
+  MatchNetworkManager(MatchTransport* transport, MatchID match_id);
+
+  MatchTransport* transport_;
+  MatchID match_id_;
+
+  // All of this is guarded by the transport's mutex_, since the transport fills it in.
+  set<GlopNetworkAddress> connections_;
+  // This is a std::list because List moves its elements around with realloc, which strings don't
+  // survive.
+  list<pair<GlopNetworkAddress, string> > incoming_data_;
+};
+
+#endif // GLOP_NET_MATCH_NETWORK_MANAGER_H__
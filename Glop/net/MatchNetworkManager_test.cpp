@@ -0,0 +1,83 @@
+#include <gtest/gtest.h>
+#include "MatchNetworkManager.h"
+#include "MockNetworkManager.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+TEST(MatchNetTest, TestMatchesOnlySeeTheirOwnHostsAndData) {
+  MockRouter router;
+  MatchTransport server(new MockNetworkManager(&router));
+  MatchTransport client(new MockNetworkManager(&router));
+  ASSERT_TRUE(server.Startup(65000));
+  ASSERT_TRUE(client.Startup(65001));
+
+  vector<MatchNetworkManager*> hosts, guests;
+  for (int i = 0; i < 3; i++) {
+    hosts.push_back(server.NewMatch(i));
+    guests.push_back(client.NewMatch(i));
+    hosts[i]->StartHosting(string(1, 'a' + i));
+    guests[i]->FindHosts(65000);
+  }
+  EXPECT_TRUE(server.NewMatch(0) == NULL);
+  EXPECT_EQ(3, server.NumMatches());
+
+  server.Think();
+  client.Think();
+  for (int i = 0; i < 3; i++) {
+    vector<pair<GlopNetworkAddress, string> > found = guests[i]->AvailableHosts();
+    ASSERT_EQ(1, found.size());
+    EXPECT_EQ(string(1, 'a' + i), found[0].second);
+    guests[i]->Connect(found[0].first);
+  }
+
+  // Every match shares the one real connection, and only hears about it once the other end has
+  // joined the match.
+  for (int i = 0; i < 2; i++) {
+    server.Think();
+    client.Think();
+  }
+  for (int i = 0; i < 3; i++) {
+    ASSERT_EQ(1, guests[i]->GetConnections().size());
+    ASSERT_EQ(1, hosts[i]->GetConnections().size());
+  }
+  GlopNetworkAddress server_gna = guests[0]->GetConnections()[0];
+  GlopNetworkAddress client_gna = hosts[0]->GetConnections()[0];
+
+  for (int i = 0; i < 3; i++) {
+    guests[i]->SendData(server_gna, string(i + 1, 'x'));
+    hosts[i]->SendData(client_gna, string(i + 1, 'y'));
+  }
+  server.Think();
+  client.Think();
+  for (int i = 0; i < 3; i++) {
+    GlopNetworkAddress gna;
+    string data;
+    ASSERT_EQ(1, hosts[i]->PendingData());
+    ASSERT_TRUE(hosts[i]->ReceiveData(&gna, &data));
+    EXPECT_TRUE(gna == client_gna);
+    EXPECT_EQ(string(i + 1, 'x'), data);
+    ASSERT_TRUE(guests[i]->ReceiveData(server_gna, &data));
+    EXPECT_EQ(string(i + 1, 'y'), data);
+    EXPECT_FALSE(guests[i]->ReceiveData(server_gna, &data));
+  }
+
+  // Leaving a match drops it on the other end without touching the other matches, and the real
+  // connection only goes away with the last of them.
+  delete guests[1];
+  server.Think();
+  EXPECT_EQ(0, hosts[1]->GetConnections().size());
+  EXPECT_EQ(1, hosts[0]->GetConnections().size());
+  delete guests[0];
+  delete guests[2];
+  server.Think();
+  client.Think();
+  EXPECT_EQ(0, hosts[0]->GetConnections().size());
+  EXPECT_EQ(0, hosts[2]->GetConnections().size());
+  EXPECT_EQ(0, router.GetConnections(0).size());
+
+  for (int i = 0; i < 3; i++) {
+    delete hosts[i];
+  }
+  EXPECT_EQ(0, server.NumMatches());
+}
@@ -63,7 +63,7 @@ void MockNetworkManager::SendData(GlopNetworkAddress gna, const string& data) {
 }
 
 bool MockNetworkManager::ReceiveData(GlopNetworkAddress* gna, string* data) {
-  List<pair<GlopNetworkAddress, string> >::iterator it;
+  list<pair<GlopNetworkAddress, string> >::iterator it;
   for (it = incoming_data_.begin(); it != incoming_data_.end(); it++) {
     *gna = it->first;
     *data = it->second;
@@ -74,7 +74,7 @@ bool MockNetworkManager::ReceiveData(GlopNetworkAddress* gna, string* data) {
 }
 
 bool MockNetworkManager::ReceiveData(GlopNetworkAddress gna, string* data) {
-  List<pair<GlopNetworkAddress, string> >::iterator it;
+  list<pair<GlopNetworkAddress, string> >::iterator it;
   for (it = incoming_data_.begin(); it != incoming_data_.end(); it++) {
     if (it->first == gna) {
       *data = it->second;
@@ -86,7 +86,7 @@ bool MockNetworkManager::ReceiveData(GlopNetworkAddress gna, string* data) {
 }
 
 bool MockNetworkManager::ReceiveData(GlopNetworkAddress* gna, const string& data) {
-  List<pair<GlopNetworkAddress, string> >::iterator it;
+  list<pair<GlopNetworkAddress, string> >::iterator it;
   for (it = incoming_data_.begin(); it != incoming_data_.end(); it++) {
     if (it->second == data) {
       *gna = it->first;
@@ -1,6 +1,7 @@
 #ifndef GLOP_NET_MOCK_NETWORK_MANAGER_H__
 #define GLOP_NET_MOCK_NETWORK_MANAGER_H__
 
+#include <list>
 #include <string>
 #include <vector>
 #include <map>
@@ -40,13 +41,18 @@ class MockNetworkManager : public NetworkManagerInterface {
 
   virtual void Think();
 
+  // The key that the router knows this manager by, for configuring its links.
+  RouterKey GetKey() const { return key_; }
+
  private:
   MockRouter* router_;
   RouterKey key_;
   int port_;
   int search_port_;
   map<GlopNetworkAddress, string> hosts_;
-  List<pair<GlopNetworkAddress, string> > incoming_data_;
+  // This is a std::list because List moves its elements around with realloc, which strings don't
+  // survive.
+  list<pair<GlopNetworkAddress, string> > incoming_data_;
 };
 
 
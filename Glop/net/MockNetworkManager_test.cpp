@@ -1,6 +1,9 @@
 #include <gtest/gtest.h>
 #include "MockNetworkManager.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+
 // Simply makes sure that a manager closes all of its open connections when it is destroyed.
 TEST(MockNetTest, TestNetworkManagersConstructAndDeconstructProperly) {
   MockRouter router;
@@ -111,6 +114,130 @@ TEST(MockNetTest, TestClientCanSendMultiplePacketsToHostThatAllArrive) {
   EXPECT_EQ(3, data_set.size()) << "Unexpected data received";
 }
 
+TEST(MockNetTest, TestDataArrivesAfterTheLatencyOfItsLink) {
+  MockRouter router;
+  MockNetworkManager host(&router);
+  MockNetworkManager client(&router);
+
+  vector<MockNetworkManager*> all;
+  all.push_back(&host);
+  all.push_back(&client);
+
+  host.Startup(65000);
+  client.Startup(65001);
+  host.StartHosting("A");
+  client.FindHosts(65000);
+  ThinkAll(all);
+  client.Connect(client.AvailableHosts()[0].first);
+  ThinkAll(all);
+  GlopNetworkAddress host_gna = client.GetConnections()[0];
+  GlopNetworkAddress client_gna = host.GetConnections()[0];
+
+  // Only the client -> host direction is slow.
+  router.SetLatency(client.GetKey(), host.GetKey(), 50);
+  client.SendData(host_gna, "slow");
+  client.SendData(host_gna, "slower");
+  host.SendData(client_gna, "fast");
+  EXPECT_EQ(3, router.NumPackagesSent());
+  EXPECT_EQ(14, router.NumBytesSent());
+
+  ThinkAll(all);
+  EXPECT_EQ(0, host.PendingData());
+  EXPECT_EQ(1, client.PendingData());
+
+  router.SetTime(49);
+  ThinkAll(all);
+  EXPECT_EQ(0, host.PendingData());
+
+  router.SetTime(50);
+  ThinkAll(all);
+  ASSERT_EQ(2, host.PendingData());
+  string data;
+  ASSERT_TRUE(host.ReceiveData(client_gna, &data));
+  EXPECT_EQ("slow", data);
+  ASSERT_TRUE(host.ReceiveData(client_gna, &data));
+  EXPECT_EQ("slower", data);
+}
+// Sends count numbered packages from one end of a link to the other, one per ms, and returns the
+// time each of them arrived at, in the order they arrived.
+vector<pair<int, string> > SendOverLink(const MockLinkModel& model, unsigned int seed, int count) {
+  MockRouter router;
+  router.SetSeed(seed);
+  RouterKey from = router.GetKey(65000);
+  RouterKey to = router.GetKey(65001);
+  router.Connect(from, GlopNetworkAddress(to, 65001));
+  router.SetLinkModel(from, to, model);
+  vector<pair<int, string> > arrivals;
+  for (int time_ms = 0; time_ms < 10000; time_ms++) {
+    router.SetTime(time_ms);
+    if (time_ms < count) {
+      char data[16];
+      sprintf(data, "%d", time_ms);
+      router.SendData(from, GlopNetworkAddress(to, 65001), data);
+    }
+    GlopNetworkAddress gna;
+    string data;
+    while (router.ReceiveData(to, &gna, &data)) {
+      arrivals.push_back(make_pair(time_ms, data));
+    }
+  }
+  return arrivals;
+}
+
+TEST(MockNetTest, TestLinkModelsAreDeterministic) {
+  MockLinkModel model;
+  model.latency_ms = 20;
+  model.jitter_ms = 30;
+  model.spike_rate = 0.05;
+  model.spike_ms = 100;
+  model.reorder_rate = 0.2;
+  vector<pair<int, string> > arrivals = SendOverLink(model, 7, 100);
+  ASSERT_EQ(100, arrivals.size());
+  EXPECT_TRUE(arrivals == SendOverLink(model, 7, 100));
+  EXPECT_FALSE(arrivals == SendOverLink(model, 8, 100));
+
+  // Some packages overtook others, and nothing arrived before the latency was up.
+  int out_of_order = 0;
+  for (int i = 0; i < arrivals.size(); i++) {
+    EXPECT_LE(atoi(arrivals[i].second.c_str()) + 20, arrivals[i].first);
+    if (i > 0 && atoi(arrivals[i].second.c_str()) < atoi(arrivals[i - 1].second.c_str())) {
+      out_of_order++;
+    }
+  }
+  EXPECT_LT(0, out_of_order);
+
+  // Without reordering, jitter only ever holds packages up.
+  model.reorder_rate = 0;
+  arrivals = SendOverLink(model, 7, 100);
+  for (int i = 0; i < arrivals.size(); i++) {
+    EXPECT_EQ(i, atoi(arrivals[i].second.c_str()));
+  }
+}
+
+TEST(MockNetTest, TestLinkModelsDropAndLimitBandwidth) {
+  MockLinkModel model;
+  model.drop_rate = 0.3;
+  vector<pair<int, string> > arrivals = SendOverLink(model, 3, 100);
+  EXPECT_LT(50, arrivals.size());
+  EXPECT_GT(90, arrivals.size());
+
+  // Retransmitted packages all make it, but hold up the ones behind them.
+  model.retransmit_ms = 50;
+  arrivals = SendOverLink(model, 3, 100);
+  ASSERT_EQ(100, arrivals.size());
+  EXPECT_LT(100, arrivals.back().first);
+  for (int i = 0; i < arrivals.size(); i++) {
+    EXPECT_EQ(i, atoi(arrivals[i].second.c_str()));
+  }
+
+  // At 100 bytes per second, "0" to "9" take 10ms each and "10" to "99" take 20ms each.
+  MockLinkModel slow;
+  slow.bytes_per_second = 100;
+  arrivals = SendOverLink(slow, 1, 100);
+  ASSERT_EQ(100, arrivals.size());
+  EXPECT_EQ(10, arrivals[0].first);
+  EXPECT_EQ(1900, arrivals.back().first);
+}
 
 TEST(MockNetTest, TestThatStartAndStopHostingWork) {
   MockRouter router;
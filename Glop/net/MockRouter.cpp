@@ -1,8 +1,15 @@
 #include "MockRouter.h"
 
-MockRouter::MockRouter() : next_key_(0) { }
+MockRouter::MockRouter()
+  : seed_(1),
+    next_key_(0),
+    time_ms_(0),
+    num_packages_sent_(0),
+    num_bytes_sent_(0),
+    num_packages_dropped_(0) { }
 
 RouterKey MockRouter::GetKey(int port) {
+  MutexLock lock(&mutex_);
   RouterKey key = next_key_;
   next_key_++;
   GlopNetworkAddress gna = GlopNetworkAddress(key, port);
@@ -12,6 +19,7 @@ RouterKey MockRouter::GetKey(int port) {
 }
 
 void MockRouter::Connect(RouterKey key, GlopNetworkAddress gna) {
+  MutexLock lock(&mutex_);
   // assert that we don't already have the connection
   if (gna_to_key_.count(gna)) {
     connections_[key].insert(gna);
@@ -20,6 +28,7 @@ void MockRouter::Connect(RouterKey key, GlopNetworkAddress gna) {
 }
 
 void MockRouter::Disconnect(RouterKey key, GlopNetworkAddress gna) {
+  MutexLock lock(&mutex_);
   // assert something sensible here
   // TODO: Remove this key's gna from other data structures
   connections_[key].erase(gna);
@@ -27,6 +36,7 @@ void MockRouter::Disconnect(RouterKey key, GlopNetworkAddress gna) {
 }
 
 vector<GlopNetworkAddress> MockRouter::GetConnections(RouterKey key) const {
+  MutexLock lock(&mutex_);
   if (!connections_.count(key)) {
     return vector<GlopNetworkAddress>();
   }
@@ -36,31 +46,143 @@ vector<GlopNetworkAddress> MockRouter::GetConnections(RouterKey key) const {
 }
 
 void MockRouter::SendData(RouterKey key, GlopNetworkAddress gna, const string& data) {
+  MutexLock lock(&mutex_);
   // assert instead of using an if here
-  if (connections_[key].count(gna)) {
-    sent_data_[gna_to_key_[gna]].push_back(make_pair(key_to_gna_[key], data));
+  if (!connections_[key].count(gna)) {
+    return;
   }
+  RouterKey destination = gna_to_key_[gna];
+  num_packages_sent_++;
+  num_bytes_sent_ += data.size();
+  Package package;
+  package.arrival_ms = ScheduleArrival(&links_[make_pair(key, destination)], data.size());
+  if (package.arrival_ms < 0) {
+    return;
+  }
+  package.source = key_to_gna_[key];
+  package.data = data;
+
+  // Keep each destination's packages sorted by arrival time, with ties in the order they were
+  // sent.  Almost everything goes at the end.
+  list<Package>& packages = sent_data_[destination];
+  list<Package>::iterator it = packages.end();
+  while (it != packages.begin()) {
+    list<Package>::iterator prev = it;
+    prev--;
+    if (prev->arrival_ms <= package.arrival_ms) {
+      break;
+    }
+    it = prev;
+  }
+  packages.insert(it, package);
+}
+
+int MockRouter::ScheduleArrival(Link* link, int size) {
+  const MockLinkModel& model = link->has_model ? link->model : default_model_;
+  int send_ms = time_ms_;
+  while (true) {
+    // The package goes out once the link has finished with everything ahead of it.
+    if (model.bytes_per_second > 0) {
+      if (link->busy_until_ms > send_ms) {
+        send_ms = link->busy_until_ms;
+      }
+      send_ms += (size * 1000LL + model.bytes_per_second - 1) / model.bytes_per_second;
+      link->busy_until_ms = send_ms;
+    }
+    if (model.drop_rate <= 0 || NextRandom() >= model.drop_rate) {
+      break;
+    }
+    num_packages_dropped_++;
+    if (model.retransmit_ms <= 0) {
+      return -1;
+    }
+    send_ms += model.retransmit_ms;
+  }
+
+  int arrival_ms = send_ms + model.latency_ms;
+  if (model.jitter_ms > 0) {
+    arrival_ms += (int)(NextRandom() * (model.jitter_ms + 1));
+  }
+  if (model.spike_rate > 0 && NextRandom() < model.spike_rate) {
+    arrival_ms += model.spike_ms;
+  }
+  if (model.reorder_rate > 0 && NextRandom() < model.reorder_rate) {
+    return arrival_ms;
+  }
+  if (arrival_ms < link->last_arrival_ms) {
+    arrival_ms = link->last_arrival_ms;
+  }
+  link->last_arrival_ms = arrival_ms;
+  return arrival_ms;
+}
+
+// A plain linear congruential generator, so that runs are repeatable on every platform.
+double MockRouter::NextRandom() {
+  seed_ = seed_ * 1103515245 + 12345;
+  return ((seed_ >> 8) & 0xffffff) / (double)0x1000000;
 }
 
 bool MockRouter::ReceiveData(RouterKey key, GlopNetworkAddress* gna, string* data) {
-  if (sent_data_[key].size() == 0) {
+  MutexLock lock(&mutex_);
+  list<Package>& packages = sent_data_[key];
+  if (packages.empty() || packages.front().arrival_ms > time_ms_) {
     return false;
   }
-  *gna = sent_data_[key].front().first;
-  *data = sent_data_[key].front().second;
-  sent_data_[key].pop_front();
+  *gna = packages.front().source;
+  *data = packages.front().data;
+  packages.pop_front();
   return true;
 }
 
+void MockRouter::SetTime(int time_ms) {
+  MutexLock lock(&mutex_);
+  time_ms_ = time_ms;
+}
+
+int MockRouter::GetTime() const {
+  MutexLock lock(&mutex_);
+  return time_ms_;
+}
+
+void MockRouter::SetSeed(unsigned int seed) {
+  MutexLock lock(&mutex_);
+  seed_ = seed;
+}
+
+void MockRouter::SetDefaultLinkModel(const MockLinkModel& model) {
+  MutexLock lock(&mutex_);
+  default_model_ = model;
+}
+
+void MockRouter::SetLinkModel(RouterKey from, RouterKey to, const MockLinkModel& model) {
+  MutexLock lock(&mutex_);
+  Link& link = links_[make_pair(from, to)];
+  link.has_model = true;
+  link.model = model;
+}
+
+void MockRouter::SetLatency(RouterKey from, RouterKey to, int latency_ms) {
+  MutexLock lock(&mutex_);
+  Link& link = links_[make_pair(from, to)];
+  if (!link.has_model) {
+    link.has_model = true;
+    link.model = default_model_;
+  }
+  link.model.latency_ms = latency_ms;
+}
+
 void MockRouter::StartHosting(RouterKey key, const string& data) {
+  MutexLock lock(&mutex_);
   hosts_[key] = data;
 }
 
 void MockRouter::StopHosting(RouterKey key) {
+  MutexLock lock(&mutex_);
   hosts_.erase(key);
 }
 
 vector<pair<GlopNetworkAddress, string> > MockRouter::AvailableHosts(int port) const {
+  MutexLock lock(&mutex_);
   vector<pair<GlopNetworkAddress, string> > ret;
   map<RouterKey, string>::const_iterator it;
   for (it = hosts_.begin(); it != hosts_.end(); it++) {
@@ -74,3 +196,18 @@ vector<pair<GlopNetworkAddress, string> > MockRouter::AvailableHosts(int port) c
   }
   return ret;
 }
+
+int MockRouter::NumPackagesSent() const {
+  MutexLock lock(&mutex_);
+  return num_packages_sent_;
+}
+
+long long MockRouter::NumBytesSent() const {
+  MutexLock lock(&mutex_);
+  return num_bytes_sent_;
+}
+
+int MockRouter::NumPackagesDropped() const {
+  MutexLock lock(&mutex_);
+  return num_packages_dropped_;
+}
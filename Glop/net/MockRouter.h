@@ -2,7 +2,9 @@
 #define GLOP_NET_MOCK_ROUTER_H__
 
 #include "NetworkManagerInterface.h"
+#include "../Thread.h"
 
+#include <list>
 #include <map>
 #include <set>
 #include <string>
@@ -11,6 +13,44 @@ using namespace std;
 
 typedef int RouterKey;
 
+// Describes how a one-way link between two router keys behaves.  The default link is perfect:
+// everything arrives instantly, in order, and nothing is lost.
+struct MockLinkModel {
+  MockLinkModel()
+    : latency_ms(0),
+      jitter_ms(0),
+      spike_rate(0),
+      spike_ms(0),
+      reorder_rate(0),
+      drop_rate(0),
+      retransmit_ms(0),
+      bytes_per_second(0) {}
+
+  // Every package takes latency_ms plus a uniformly random 0 to jitter_ms to arrive, and with
+  // probability spike_rate another spike_ms on top of that.
+  int latency_ms;
+  int jitter_ms;
+  double spike_rate;
+  int spike_ms;
+
+  // Packages normally arrive in the order they were sent, which means that a delayed package holds
+  // up everything behind it.  With probability reorder_rate a package is allowed to overtake.
+  double reorder_rate;
+
+  // Each time a package is sent it is lost with probability drop_rate.  If retransmit_ms is 0 it is
+  // gone for good, and otherwise it is sent again retransmit_ms later, the way a reliable
+  // transport would.  GameEngine needs reliable delivery, so drops without retransmits are only
+  // useful for testing the layers below it.
+  double drop_rate;
+  int retransmit_ms;
+
+  // Limits the link to this many bytes per second, or 0 for no limit.  Packages queue up behind
+  // each other while the link is busy.
+  int bytes_per_second;
+};
+
+// Routes data between MockNetworkManagers as if they were on a network.  Every method is safe to
+// call from any thread, so engines that are thought on a thread pool can share a router.
 class MockRouter {
  public:
   MockRouter();
@@ -25,13 +65,56 @@ class MockRouter {
   void StopHosting(RouterKey key);
   vector<pair<GlopNetworkAddress, string> > AvailableHosts(int port) const;
 
+  // The router has its own clock, which only moves when SetTime is called.  Data sent over a link
+  // is not received until the clock reaches the time that the link's model says it arrives.  All
+  // of the randomness in the models comes from the router's seed, so the same sends at the same
+  // times always arrive at the same times.
+  void SetTime(int time_ms);
+  int GetTime() const;
+  void SetSeed(unsigned int seed);
+  void SetLinkModel(RouterKey from, RouterKey to, const MockLinkModel& model);
+  // Used for every link that hasn't been given its own model.
+  void SetDefaultLinkModel(const MockLinkModel& model);
+  void SetLatency(RouterKey from, RouterKey to, int latency_ms);
+
+  // Totals over everything that has been sent through the router.
+  int NumPackagesSent() const;
+  long long NumBytesSent() const;
+  // Number of times a package was lost, including ones that were retransmitted afterwards.
+  int NumPackagesDropped() const;
+
  private:
+  struct Package {
+    GlopNetworkAddress source;
+    string data;
+    int arrival_ms;
+  };
+  struct Link {
+    Link() : has_model(false), busy_until_ms(0), last_arrival_ms(0) {}
+    bool has_model;
+    MockLinkModel model;
+    int busy_until_ms;    // When the link has finished sending everything queued on it.
+    int last_arrival_ms;  // When the last package sent over the link arrives.
+  };
+
+  // Returns when a package of the given size sent now over link arrives, or -1 if it is lost.
+  int ScheduleArrival(Link* link, int size);
+  double NextRandom();
+
+  mutable Mutex mutex_;
   map<RouterKey, GlopNetworkAddress> key_to_gna_;
   map<GlopNetworkAddress, RouterKey> gna_to_key_;
   map<RouterKey, set<GlopNetworkAddress> > connections_;
-  map<RouterKey, List<pair<GlopNetworkAddress, string> > > sent_data_;
+  map<RouterKey, list<Package> > sent_data_;
+  map<pair<RouterKey, RouterKey>, Link> links_;
+  MockLinkModel default_model_;
+  unsigned int seed_;
   map<RouterKey, string> hosts_;
   RouterKey next_key_;
+  int time_ms_;
+  int num_packages_sent_;
+  long long num_bytes_sent_;
+  int num_packages_dropped_;
 };
 
 #endif // GLOP_NET_MOCK_ROUTER_H__
@@ -41,8 +41,9 @@ class GlopPlugin : public PluginInterface {
  private:
 };
 
-NetworkManager::NetworkManager()
+NetworkManager::NetworkManager(int max_connections)
   : rakpeer_(NULL),
+    max_connections_(max_connections),
     host_search_port_(0) {
 }
 
@@ -50,11 +51,11 @@ bool NetworkManager::Startup(int port) {
 //  printf("Starting on port %d\n", port);
   rakpeer_ = RakNetworkFactory::GetRakPeerInterface();
 	SocketDescriptor server_socket(port, 0);
-	if (!rakpeer_->Startup(32, 5, &server_socket, 1)) {
+	if (!rakpeer_->Startup(max_connections_, 5, &server_socket, 1)) {
     return false;
 	}
   rakpeer_->AttachPlugin(new GlopPlugin);
-  rakpeer_->SetMaximumIncomingConnections(16);
+  rakpeer_->SetMaximumIncomingConnections(max_connections_ / 2);
   return true;
 }
 
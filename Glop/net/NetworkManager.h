@@ -33,7 +33,9 @@ class NetworkConnection {
 
 class NetworkManager : public NetworkManagerInterface {
  public:
-  NetworkManager();
+  // A server that hosts many matches over one MatchTransport will want more than the default
+  // number of connections.  Half of them can be incoming.
+  NetworkManager(int max_connections = 32);
   ~NetworkManager();
 
   bool Startup(int port);
@@ -61,6 +63,7 @@ class NetworkManager : public NetworkManagerInterface {
   void Think();
  private:
   RakPeerInterface* rakpeer_;
+  int max_connections_;
 
   map<GlopNetworkAddress, string> hosts_;
   // If FindHosts() is called, this will aggregate a list of responses